@@ -143,3 +143,53 @@ int Disk_Write(int sector, char *buffer) {
   }
   return(0);
 }
+
+/*
+ * Disk_ReadV
+ *
+ * Reads 'count' consecutive sectors from "disk", starting from
+ * 'sector', into the buffers provided by the user (one per sector).
+ */
+int Disk_ReadV(int sector, int count, char **buffers) {
+  // quick error checks; nothing is read if any of the buffers is bad
+  if ((sector < 0) || (count < 0) || (sector + count > TOTAL_SECTORS) || (buffers == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return(-1);
+  }
+  for (int i = 0; i < count; i++) {
+    if (buffers[i] == NULL) {
+      diskErrno = E_INVALID_PARAM;
+      return(-1);
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    memcpy((void *)buffers[i], (void *)(disk + sector + i), sizeof(sector_t));
+  }
+  return(0);
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Writes 'count' consecutive sectors to "disk", starting from
+ * 'sector', from the buffers provided by the user (one per sector).
+ */
+int Disk_WriteV(int sector, int count, char **buffers) {
+  // quick error checks; nothing is written if any of the buffers is bad
+  if ((sector < 0) || (count < 0) || (sector + count > TOTAL_SECTORS) || (buffers == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return(-1);
+  }
+  for (int i = 0; i < count; i++) {
+    if (buffers[i] == NULL) {
+      diskErrno = E_INVALID_PARAM;
+      return(-1);
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    memcpy((void *)(disk + sector + i), (void *)buffers[i], sizeof(sector_t));
+  }
+  return(0);
+}
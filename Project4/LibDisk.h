@@ -34,4 +34,9 @@ int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// vectored versions: 'count' consecutive sectors starting from
+// 'sector', each one moved to or from its own buffer in one call
+int Disk_WriteV(int sector, int count, char** buffers);
+int Disk_ReadV(int sector, int count, char** buffers);
+
 #endif // __Disk_H__
@@ -1,23 +1,85 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "LibDisk.h"
 #include "LibFS.h"
-
-// set to 1 to have detailed debug print-outs and 0 to have none
-#define FSDEBUG    1
+#include "LibFSLz.h"
+#include "LibFSNet.h"
+#include "LibFSTrace.h"
+
+// set to 1 to have detailed debug print-outs and 0 to have none (the
+// makefile passes the value of its FSDEBUG variable)
+#ifndef FSDEBUG
+#define FSDEBUG    0
+#endif
 
 #if FSDEBUG
 #define dprintf    printf
 #else
-#define dprintf    noprintf
-void noprintf(char *str, ...) {
+#define dprintf(...)    do { if (0) printf(__VA_ARGS__); } while (0)
+#endif
+
+// set to 1 to compile in the binary trace points (see LibFSTrace.h);
+// when it's 0 they are compiled out altogether
+#ifndef FSTRACE
+#define FSTRACE    0
+#endif
+
+#if FSTRACE
+// the trace ring, the sequence number of the next record, and the
+// classes of events being recorded
+static fs_trace_rec_t trace_ring[FS_TRACE_RING_SIZE];
+static uint32_t       trace_head;
+static int            trace_mask;
+static int            trace_threads;     // used to number the threads
+static __thread int   trace_tid;
+
+// record an event; the slot in the ring is claimed with an atomic
+// increment, so threads tracing at the same time never wait on each
+// other (a writer lapped by the whole ring may leave a torn record,
+// which the decoder recognizes by its sequence number)
+static void fs_trace(int event, int a, int b, int c, int d) {
+  uint32_t        seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+  fs_trace_rec_t *rec = &trace_ring[seq & (FS_TRACE_RING_SIZE - 1)];
+  struct timespec ts;
+
+  if (trace_tid == 0) {
+    trace_tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  rec->ns     = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->event  = event;
+  rec->tid    = trace_tid;
+  rec->arg[0] = a;
+  rec->arg[1] = b;
+  rec->arg[2] = c;
+  rec->arg[3] = d;
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
 }
 
+// TRACE(event, args...) records the event with up to four integer
+// arguments if its class is enabled in the mask
+#define TRACE(ev, ...)    TRACE_(ev, __VA_ARGS__, 0, 0, 0, 0)
+#define TRACE_(ev, a, b, c, d, ...) \
+  do { if (trace_mask & ev##_CLASS) fs_trace(ev, a, b, c, d); } while (0)
+#else
+#define TRACE(ev, ...)    do { } while (0)
 #endif
 
+// bump one of the internal counters of the statistics (FS_GetStats())
+#define STAT_ADD(counter, n) \
+  __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED)
+
+// statistics of the file system calls and of some internal work, kept
+// for the life of the process; the counters are bumped with atomic
+// adds since the checker (and callers) may run several threads
+static FS_Stats_t stats;
+
 // the file system partitions the disk into five parts:
 
 // 1. the superblock (one sector), which contains a magic number at
@@ -27,6 +89,51 @@ void noprintf(char *str, ...) {
 // the magic number chosen for our file system
 #define OS_MAGIC                   0xdeadbeef
 
+// the on-disk layout revision written into the superblock; images
+// formatted before the free-space counters existed carry 0 here (the
+// rest of their superblock is zero) and get their counters rebuilt
+// from the bitmaps at boot time; revision 1 images had their whole
+// inode table initialized at format time; revision 2 images had one
+// sector per data block
+#define OS_VERSION                 3
+
+// a snapshot (FS_Snapshot()) shares the inode table and the data
+// blocks with the live file system until they change; the inode table
+// sectors written since it was taken were copied beforehand, and its
+// map sector tells where (see inode_store())
+#define MAX_SNAPSHOTS              8
+typedef struct _snapshot {
+  char name[16];      // a legal file name
+  int  map;           // sector of the map: the copy of each inode table sector, 0 if shared
+  int  table_init;    // inode table sectors initialized when it was taken
+} snapshot_t;
+
+// once the inodes of the table are all in use, the table grows by
+// chunks of INODE_CHUNK_SECTORS consecutive sectors taken from the
+// data blocks, as many as the inode bitmap has bits for (see
+// inode_table_sector()); the superblock lists where each chunk is
+#define INODE_CHUNK_SECTORS        16
+#define MAX_INODE_CHUNKS           49
+
+// the content of the superblock; the magic number must stay at the
+// first four bytes; the free counters are kept in memory while the
+// file system is booted and written back to the superblock at sync
+typedef struct _superblock {
+  int magic;          // OS_MAGIC
+  int version;        // OS_VERSION
+  int free_inodes;    // number of unused entries in the inode table
+  int free_blocks;    // number of unused blocks in the data block area
+  int inode_table_init; // number of inode table sectors initialized so far
+  int block_sectors;  // number of sectors in a data block
+  int log_head;       // next block of the log; 0 unless log-structured
+  int nsnapshots;     // number of snapshots taken
+  int shared;         // files may share blocks (File_Clone())
+  snapshot_t snapshots[MAX_SNAPSHOTS];
+  int dedup_index;    // first sector of the fingerprint index; 0 unless deduplicating
+  int inode_nchunks;  // number of chunks the inode table has grown by
+  int inode_chunks[MAX_INODE_CHUNKS]; // first sector of each chunk
+} superblock_t;
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR    1
@@ -38,14 +145,17 @@ void noprintf(char *str, ...) {
 #define INODE_BITMAP_SECTORS    ((INODE_BITMAP_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE)
 
 // 3. the sector bitmap (one or more sectors), which indicates whether
-// the particular sector in the disk is currently in use
+// the particular block of the disk is currently in use
 #define SECTOR_BITMAP_START_SECTOR    (INODE_BITMAP_START_SECTOR + INODE_BITMAP_SECTORS)
 
 // the total number of bytes and sectors needed for the data block
 // bitmap (we call it the sector bitmap); we use one bit for each
-// sector of the disk to indicate whether the sector is in use or not
+// block of the disk to indicate whether the block is in use or not;
+// room is left for blocks of one sector, and with bigger blocks only
+// the first SECTOR_BITMAP_USED sectors of the bitmap are ever looked at
 #define SECTOR_BITMAP_SIZE       ((TOTAL_SECTORS + 7) / 8)
 #define SECTOR_BITMAP_SECTORS    ((SECTOR_BITMAP_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define SECTOR_BITMAP_USED       ((TOTAL_BLOCKS + SECTOR_SIZE * 8 - 1) / (SECTOR_SIZE * 8))
 
 // 4. the inode table (one or more sectors), which contains the inodes
 // stored consecutively
@@ -56,8 +166,10 @@ void noprintf(char *str, ...) {
 // corresponding file or directory
 typedef struct _inode {
   int size;                       // the size of the file or number of directory entries
-  int type;                       // 0 means regular file; 1 means directory
-  int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
+  short type;                     // 0 means regular file; 1 means directory
+  unsigned char flags;            // INODE_COMPRESSED (files only)
+  unsigned char links;            // dirents of a file past the first (File_Link())
+  int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks (0 if none)
 } inode_t;
 
 // the inode structures are stored consecutively and yet they don't
@@ -67,14 +179,72 @@ typedef struct _inode {
 // are as many entries in the table as the number of files allowed in
 // the system; the inode bitmap (#2) indicates whether the entries are
 // current in use or not
+// the flags of a file; 'type', 'flags' and 'links' took the place of
+// a single int type, whose upper half was 0 (on a little-endian machine)
+#define INODE_COMPRESSED       1
+#define INODE_MAX_LINKS        255
+
 #define INODES_PER_SECTOR      (SECTOR_SIZE / sizeof(inode_t))
 #define INODE_TABLE_SECTORS    ((MAX_FILES + INODES_PER_SECTOR - 1) / INODES_PER_SECTOR)
 
+// the inodes past MAX_FILES are in the chunks the table has grown by,
+// chunk i holding the INODE_CHUNK_INODES inodes from MAX_FILES + i *
+// INODE_CHUNK_INODES; the inodes are numbered on from the table (whose
+// sectors are all full), so inode n is in the (n / INODES_PER_SECTOR)-th
+// sector either way; INODE_COUNT is the number of inodes there are now
+#define INODE_CHUNK_INODES     (INODE_CHUNK_SECTORS * INODES_PER_SECTOR)
+#define MAX_INODES             (INODE_BITMAP_SECTORS * SECTOR_SIZE * 8)
+#define INODE_COUNT            (MAX_FILES + sb.inode_nchunks * INODE_CHUNK_INODES < MAX_INODES ? \
+                                MAX_FILES + sb.inode_nchunks * INODE_CHUNK_INODES : MAX_INODES)
+#define INODE_SECTORS_INIT     (sb.inode_table_init + sb.inode_nchunks * INODE_CHUNK_SECTORS)
+
 
 // 5. the data blocks; all the rest sectors are reserved for data
 // blocks for the content of files and directories
 #define DATABLOCK_START_SECTOR    (INODE_TABLE_START_SECTOR + INODE_TABLE_SECTORS)
 
+// space is allocated in blocks of 'block_sectors' consecutive sectors
+// (1, 2, 4, 8 or 16, chosen when the disk is formatted); block b is
+// made of sectors b*BLOCK_SECTORS up to (b+1)*BLOCK_SECTORS-1, and the
+// blocks overlapping the sectors before the data blocks are never
+// handed out; the data[] of an inode holds the first sector of each
+// of its blocks, so a file needs fewer of them with bigger blocks
+#define BLOCK_SECTORS            (sb.block_sectors)
+#define BLOCK_SIZE               (BLOCK_SECTORS * SECTOR_SIZE)
+#define TOTAL_BLOCKS             (TOTAL_SECTORS / BLOCK_SECTORS)
+#define DATABLOCK_START_BLOCK    ((DATABLOCK_START_SECTOR + BLOCK_SECTORS - 1) / BLOCK_SECTORS)
+#define BLOCKS_PER_FILE          ((MAX_FILE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define MAX_BLOCK_SECTORS        16
+
+// a disk formatted log-structured (FSLOG) never updates a data block
+// in place: the blocks written go to the head of a log that sweeps the
+// data blocks (see block_alloc_run()), and the cleaner frees whole
+// segments of blocks behind it (see log_clean())
+#define LOG_MODE                 (sb.log_head != 0)
+#define LOG_SEGMENT_BLOCKS       32
+#define LOG_CLEAN_SEGMENTS       8      // cleaned per FS_Clean() by default
+
+// the data of a compressed file (INODE_COMPRESSED) is compressed in
+// clusters of CLUSTER_BLOCKS blocks (the last cluster of a file may
+// have fewer); of the entries of data[] of a cluster covering the
+// file, either all have a sector (stored as it is, when it doesn't
+// compress), or only the first few do (compressed: a 2-byte length
+// and the output of the compressor, see LibFSLz.h), or none does (a
+// hole); see cluster_read()
+#define CLUSTER_BLOCKS           4
+#define CLUSTER_SIZE             (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// a disk formatted with deduplication (FSDEDUP) gives a block flushed
+// to a file the sector of a block with the same content if there is
+// one, which it then shares; the blocks of files are found by their
+// fingerprint (a hash of their content) in an index kept in memory,
+// and saved at sync into the DEDUP_INDEX_BLOCKS blocks from
+// 'dedup_index' (the fingerprint of each block, 0 if none); blocks
+// are never updated in place, as in log-structured mode
+#define DEDUP_MODE               (sb.dedup_index != 0)
+#define DEDUP_INDEX_BLOCKS       ((TOTAL_BLOCKS * 4 + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define DEDUP_BUCKETS            4096
+
 // other file related definitions
 
 // max length of a path is 256 bytes (including the ending null)
@@ -86,6 +256,9 @@ typedef struct _inode {
 // max number of open files is 256
 #define MAX_OPEN_FILES    256
 
+// max number of directory handles is 256
+#define MAX_DIR_HANDLES   256
+
 // each directory entry represents a file/directory in the parent
 // directory, and consists of a file/directory name (less than 16
 // bytes) and an integer inode number
@@ -98,27 +271,42 @@ typedef struct _dirent {
 #define DIRENTS_PER_SECTOR    (SECTOR_SIZE / sizeof(dirent_t))
 
 // global errno value here
-int osErrno;
+__thread int osErrno;
 
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
-/* the following functions are internal helper functions */
+// in-memory copy of the superblock of the booted file system
+static superblock_t sb;
 
-// check magic number in the superblock; return 1 if OK, and 0 if not
-static int check_magic() {
-  dprintf("First data sector is #%d\n", DATABLOCK_START_SECTOR);
-  char buf[SECTOR_SIZE];
+// number of data blocks written but not yet given a sector (see the
+// delayed allocation below); they are already subtracted from the
+// free blocks as far as space checks are concerned
+static int pending_blocks;
 
-  if (Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) {
-    return(0);
-  }
-  if (*(int *)buf == OS_MAGIC) {
-    return(1);
-  }else {
-    return(0);
-  }
-}
+// the map of each snapshot (see snapshot_t), kept in memory; an
+// inode table sector fits in a 16-bit entry
+static unsigned short snap_maps[MAX_SNAPSHOTS][INODE_TABLE_SECTORS];
+
+// the number of references to each data block (from the inodes of the
+// live inode table and from each snapshot) when blocks may be shared,
+// counted at boot; NULL if there are no snapshots and no file was ever
+// cloned, every block in use then having exactly one
+static unsigned short *block_refs;
+
+// booted from a snapshot ("DISK@NAME"), which can't be changed
+static int read_only;
+
+// the fingerprint index of a deduplicating disk: the fingerprint of
+// each block (0 if it isn't indexed), and the blocks with the same
+// fingerprint modulo DEDUP_BUCKETS chained from a bucket (0 ending a
+// chain, as block 0 is never a data block)
+static unsigned int *dedup_fp;
+static int          *dedup_next;
+static int           dedup_head[DEDUP_BUCKETS];
+static int           dedup_dirty;     // changed since last saved
+
+/* the following functions are internal helper functions */
 
 int sgn(int n) {
   if (n == 0) {
@@ -140,7 +328,7 @@ static void bitmap_init(int start, int num, int nbits) {
 
   int a = nbits / 8 / SECTOR_SIZE; //number of sectors that are all 1
   int b = nbits / 8 % SECTOR_SIZE; //number of bytes on first sector after a
-  int c = num - a - sgn(b);        //number of sectors that are all 0
+  int c = num - a - 1;             //number of sectors that are all 0
 
   //write out all full sectors
 
@@ -151,6 +339,10 @@ static void bitmap_init(int start, int num, int nbits) {
     Disk_Write(i, bitmap_buf);
   }
 
+  if (a >= num) {
+    return;
+  }
+
   unsigned char bits[8] = { 0x0, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
   //write out partial sector
   int r = nbits % 8;
@@ -163,13 +355,9 @@ static void bitmap_init(int start, int num, int nbits) {
   Disk_Write(start + a, bitmap_buf);
 
 
-  //write out 0 sectors
-  for (int i = 0; i < b; i++) {
-    bitmap_buf[i] = 0;
-  }
-  for (int i = start + a + 1; i < start + a + 1 + c; i++) {
-    Disk_Write(i, bitmap_buf);
-  }
+  //the remaining c sectors are all 0, which they already are on the
+  //freshly initialized disk (Disk_Init() zeroes every sector)
+  dprintf("leaving %d zero sectors as they are\n", c);
 }
 
 // Written by Dario Gonzalez
@@ -181,6 +369,7 @@ static int bitmap_first_unused(int start, int num, int nbits) {
   unsigned char bits[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
 
   for (int i = 0; i < num; i++) {
+    STAT_ADD(bitmap_sectors, 1);
     if (Disk_Read(i + start, buf) < 0) {
       return(-2);
     }
@@ -190,11 +379,11 @@ static int bitmap_first_unused(int start, int num, int nbits) {
         unsigned char b = buf[j];
         for (int k = 0; k < 8; k++) {
           if ((b & bits[k]) == 0) {
-            dprintf("found a free bit at byte %d, bit %d\n", j, k);
-
             int pos = (i * SECTOR_SIZE + j) * 8 + k;
+            TRACE(TR_BITMAP_SET, start, pos);
             //check if we went too far
             buf[j] |= bits[k];
+            STAT_ADD(bitmap_sectors, 1);
             if (Disk_Write(i + start, buf) < 0) {
               return(-2);
             }
@@ -212,12 +401,121 @@ static int bitmap_first_unused(int start, int num, int nbits) {
   return(-1);
 }
 
+// look for a run of 'want' consecutive unused bits among the first
+// 'nbits' bits of a bitmap with 'num' sectors starting from 'start'
+// sector and set them all; if there's no run that long, the longest
+// run in the bitmap is set instead; the location of the first bit of
+// the run is returned through 'first' and the length of the run is
+// returned (0 if the bitmap is full, -2 if there's an I/O error); the
+// whole bitmap is scanned once, and each sector of it is written at
+// most once
+static int bitmap_first_unused_run(int start, int num, int nbits, int want, int *first) {
+  unsigned char *buf = malloc(num * SECTOR_SIZE);
+
+  if (buf == NULL) {
+    return(-2);
+  }
+  STAT_ADD(bitmap_sectors, num);
+  for (int i = 0; i < num; i++) {
+    if (Disk_Read(i + start, (char *)buf + i * SECTOR_SIZE) < 0) {
+      free(buf);
+      return(-2);
+    }
+  }
+
+  int best = -1, best_len = 0;   // longest run seen so far
+  int run  = -1, run_len = 0;    // the run being scanned
+  for (int pos = 0; pos < nbits && best_len < want; pos++) {
+    if (buf[pos / 8] & (0x80 >> (pos % 8))) {
+      run = -1; run_len = 0;
+      continue;
+    }
+    if (run < 0) {
+      run = pos;
+    }
+    run_len++;
+    if (run_len > best_len) {
+      best = run; best_len = run_len;
+    }
+  }
+  if (best_len == 0) {
+    free(buf);
+    return(0);
+  }
+
+  for (int pos = best; pos < best + best_len; pos++) {
+    buf[pos / 8] |= 0x80 >> (pos % 8);
+  }
+  for (int i = best / 8 / SECTOR_SIZE; i <= (best + best_len - 1) / 8 / SECTOR_SIZE; i++) {
+    STAT_ADD(bitmap_sectors, 1);
+    if (Disk_Write(i + start, (char *)buf + i * SECTOR_SIZE) < 0) {
+      free(buf);
+      return(-2);
+    }
+  }
+  TRACE(TR_BITMAP_RUN, start, best, best_len, want);
+  free(buf);
+  *first = best;
+  return(best_len);
+}
+
+// look for the first unused bit at or after bit 'from' of a bitmap with
+// 'num' sectors starting from 'start' sector, among its bits 'lo' up
+// to 'nbits' - 1 (wrapping around from the end to 'lo'), and set it
+// along with the unused bits right after it, up to 'want' bits in all
+// (a run doesn't wrap around); the location of the first bit of the
+// run is returned through 'first' and the length of the run is
+// returned (0 if the bitmap is full, -2 if there's an I/O error)
+static int bitmap_next_unused_run(int start, int num, int nbits, int lo, int from,
+                                  int want, int *first) {
+  unsigned char *buf = malloc(num * SECTOR_SIZE);
+
+  if (buf == NULL) {
+    return(-2);
+  }
+  STAT_ADD(bitmap_sectors, num);
+  for (int i = 0; i < num; i++) {
+    if (Disk_Read(i + start, (char *)buf + i * SECTOR_SIZE) < 0) {
+      free(buf);
+      return(-2);
+    }
+  }
+
+  int pos = -1;
+  for (int k = 0; k < nbits - lo && pos < 0; k++) {
+    int p = lo + (from - lo + k) % (nbits - lo);
+    if ((buf[p / 8] & (0x80 >> (p % 8))) == 0) {
+      pos = p;
+    }
+  }
+  if (pos < 0) {
+    free(buf);
+    return(0);
+  }
+  int len = 0;
+  while (len < want && pos + len < nbits && (buf[(pos + len) / 8] & (0x80 >> ((pos + len) % 8))) == 0) {
+    buf[(pos + len) / 8] |= 0x80 >> ((pos + len) % 8);
+    len++;
+  }
+  for (int i = pos / 8 / SECTOR_SIZE; i <= (pos + len - 1) / 8 / SECTOR_SIZE; i++) {
+    STAT_ADD(bitmap_sectors, 1);
+    if (Disk_Write(i + start, (char *)buf + i * SECTOR_SIZE) < 0) {
+      free(buf);
+      return(-2);
+    }
+  }
+  TRACE(TR_BITMAP_RUN, start, pos, len, want);
+  free(buf);
+  *first = pos;
+  return(len);
+}
+
 // Written by Dario Gonzalez
 // reset the i-th bit of a bitmap with 'num' sectors starting from
 // 'start' sector; return 0 if successful, -1 otherwise
 static int bitmap_reset(int start, int num, int ibit) {
-  int           sector = start + ibit / SECTOR_SIZE;
-  int           byte   = ibit % SECTOR_SIZE / 8; //ie which byte is it in
+  int           sector = start + ibit / (SECTOR_SIZE * 8);
+  int           byte   = ibit / 8 % SECTOR_SIZE; //ie which byte is it in
   int           bit    = ibit % 8;
   unsigned char buf[SECTOR_SIZE];
 
@@ -225,6 +523,8 @@ static int bitmap_reset(int start, int num, int ibit) {
     return(-2);
   }
 
+  TRACE(TR_BITMAP_RESET, start, ibit);
+  STAT_ADD(bitmap_sectors, 2);
   unsigned char mask = ~(128 >> bit); //ie 7 '1's with a 0 somewhere
   buf[byte] &= mask;
   if (Disk_Write(sector, buf) < 0) {
@@ -234,436 +534,2165 @@ static int bitmap_reset(int start, int num, int ibit) {
   return(0);
 }
 
-// Written by Dario Gonzalez
-// return 1 if the file name is illegal; otherwise, return 0; legal
-// characters for a file name include letters (case sensitive),
-// numbers, dots, dashes, and underscores; and a legal file name
-// should not be more than MAX_NAME-1 in length
-static int illegal_filename(char *name) {
-  char *curr;
-  int   length = 0;
+// return 1 if the i-th bit of a bitmap starting from 'start' sector
+// is set, 0 if not, -1 if the bitmap can't be read
+static int bitmap_test(int start, int ibit) {
+  unsigned char buf[SECTOR_SIZE];
 
-  for (curr = name; *curr != '\0'; curr++) {
-    length++;
-    char c = *curr;
-    if (!((c >= 'A' && c <= 'Z') ||
-          (c >= 'a' && c <= 'z') ||
-          (c >= '0' && c <= '9') ||
-          c == '.' ||
-          c == '-' ||
-          c == '_')) {
-      return(1);
-    }
-  }
-  if (length < MAX_NAME) {
-    return(0);
+  if (Disk_Read(start + ibit / (SECTOR_SIZE * 8), (char *)buf) < 0) {
+    return(-1);
   }
-  return(1);
+  STAT_ADD(bitmap_sectors, 1);
+  return((buf[ibit / 8 % SECTOR_SIZE] & (128 >> ibit % 8)) != 0);
 }
 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char *fname,
-                            int *cached_inode_sector, char *cached_inode_buffer) {
-  int cached_start_entry = ((*cached_inode_sector) - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-  int offset             = parent_inode - cached_start_entry;
-
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t *parent = (inode_t *)(cached_inode_buffer + offset * sizeof(inode_t));
-  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-          parent_inode, parent->size, parent->type);
-  if (parent->type != 1) {
-    dprintf("... parent not a directory\n");
-    return(-2);
-  }
+// count the number of unused bits among the first 'nbits' bits of a
+// bitmap with 'num' sectors starting from 'start' sector; return -1
+// if the bitmap can't be read
+static int bitmap_count_unused(int start, int num, int nbits) {
+  unsigned char buf[SECTOR_SIZE];
+  int           unused = 0;
 
-  int nentries = parent->size;       // remaining number of directory entries
-  int idx      = 0;
-  while (nentries > 0) {
-    char buf[SECTOR_SIZE];             // cached content of directory entries
-    if (Disk_Read(parent->data[idx], buf) < 0) {
-      return(-2);
+  for (int i = 0; i < num; i++) {
+    STAT_ADD(bitmap_sectors, 1);
+    if (Disk_Read(i + start, (char *)buf) < 0) {
+      return(-1);
     }
-    for (int i = 0; i < DIRENTS_PER_SECTOR; i++) {
-      if (i > nentries) {
-        break;
-      }
-      if (!strcmp(((dirent_t *)buf)[i].fname, fname)) {
-        // found the file/directory; update inode cache
-        int child_inode = ((dirent_t *)buf)[i].inode;
-        dprintf("... found child_inode=%d\n", child_inode);
-        int sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-        if (sector != (*cached_inode_sector)) {
-          *cached_inode_sector = sector;
-          if (Disk_Read(sector, cached_inode_buffer) < 0) {
-            return(-2);
-          }
-          dprintf("... load inode table for child\n");
+    for (int j = 0; j < SECTOR_SIZE; j++) {
+      for (int k = 0; k < 8; k++) {
+        int pos = (i * SECTOR_SIZE + j) * 8 + k;
+        if (pos >= nbits) {
+          return(unused);
+        }
+        if ((buf[j] & (0x80 >> k)) == 0) {
+          unused++;
         }
-        return(child_inode);
       }
     }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
   }
-  dprintf("... could not find child inode\n");
-  return(-1);      // not found
+  return(unused);
 }
 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
-// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
-// the child is 'd.txt'; the child's inode is returned through the
-// parameter 'last_inode' and its file name is returned through the
-// parameter 'last_fname' (both are references); it's possible that
-// the last file/directory is not in its parent directory, in which
-// case, 'last_inode' points to -1; if the function returns -1, it
-// means that we cannot follow the path
-static int follow_path(char *path, int *last_inode, char *last_fname) {
-  if (!path) {
-    dprintf("... invalid path\n");
-    return(-1);
-  }
-  if (path[0] != '/') {
-    dprintf("... '%s' not absolute path\n", path);
-    return(-1);
+// the sector holding the i-th sector's worth of inodes, in the table
+// or in one of the chunks it has grown by
+static int inode_table_sector(int i) {
+  if (i < INODE_TABLE_SECTORS) {
+    return(INODE_TABLE_START_SECTOR + i);
   }
+  i -= INODE_TABLE_SECTORS;
+  return(sb.inode_chunks[i / INODE_CHUNK_SECTORS] + i % INODE_CHUNK_SECTORS);
+}
 
-  // make a copy of the path (skip leading '/'); this is necessary
-  // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH];
-  strncpy(pathstore, path + 1, MAX_PATH - 1);
-  pathstore[MAX_PATH - 1] = '\0';     // for safety
-  char *lpath = pathstore;
+// the sector holding the given inode
+static int inode_sector_of(int inode) {
+  return(inode_table_sector(inode / INODES_PER_SECTOR));
+}
 
-  int parent_inode = -1, child_inode = 0;       // start from root
-  // cache the disk sector containing the root inode
-  int  cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
-  if (Disk_Read(cached_sector, cached_buffer) < 0) {
-    return(-1);
-  }
-  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
+// the inode table is initialized lazily: formatting only writes the
+// sector holding the root inode, and the superblock records how many
+// sectors from the start of the table have been initialized; when the
+// inode allocator hands out an inode beyond that mark, the sectors up
+// to and including the one holding it are zeroed first; return 0 if
+// successful, -1 if a sector can't be written
+static int inode_table_extend(int inode) {
+  int  sector = inode / INODES_PER_SECTOR;
+  char buf[SECTOR_SIZE];
 
-  // for each file/directory name separated by '/'
-  char *token;
-  while ((token = strsep(&lpath, "/")) != NULL) {
-    dprintf("... process token: '%s'\n", token);
-    if (*token == '\0') {
-      continue;                              // multiple '/' ignored
-    }
-    if (illegal_filename(token)) {
-      dprintf("... illegal file name: '%s'\n", token);
-      return(-1);
-    }
-    if (child_inode < 0) {
-      // regardless whether child_inode was not found previously, or
-      // there was issues related to the parent (say, not a
-      // directory), or there was a read error, we abort
-      dprintf("... parent inode can't be established\n");
+  if (sector < sb.inode_table_init || inode >= MAX_FILES) {
+    return(0);
+  }
+  memset(buf, 0, SECTOR_SIZE);
+  for (int i = sb.inode_table_init; i <= sector; i++) {
+    if (Disk_Write(INODE_TABLE_START_SECTOR + i, buf) < 0) {
       return(-1);
     }
-    parent_inode = child_inode;
-    child_inode  = find_child_inode(parent_inode, token,
-                                    &cached_sector, cached_buffer);
-    if (last_fname) {
-      strcpy(last_fname, token);
-    }
+    sb.inode_table_init = i + 1;
   }
-  if (child_inode < -1) {
-    return(-1);                         // if there was error, abort
-  }else {
-    // there was no error, several possibilities:
-    // 1) '/': parent = -1, child = 0
-    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
-    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
-    // in the first case, we set parent=child=0 as special case
-    if (parent_inode == -1 && child_inode == 0) {
-      parent_inode = 0;
-    }
-    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
-    *last_inode = child_inode;
-    return(parent_inode);
+  TRACE(TR_INODE_TABLE, sb.inode_table_init);
+  return(0);
+}
+
+// the fingerprint of a block's worth of content (FNV-1a, never 0)
+static unsigned int dedup_hash(char *buf) {
+  unsigned int h = 2166136261u;
+
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    h = (h ^ (unsigned char)buf[i]) * 16777619u;
   }
+  return(h ? h : 1);
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char *file) {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
+// put a block with the given fingerprint in the index
+static void dedup_insert(int block, unsigned int fp) {
+  dedup_fp[block]   = fp;
+  dedup_next[block] = dedup_head[fp % DEDUP_BUCKETS];
+  dedup_head[fp % DEDUP_BUCKETS] = block;
+  dedup_dirty = 1;
+}
 
-  if (child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return(-1);
+// take a block out of the index, if it's there
+static void dedup_remove(int block) {
+  if (dedup_fp == NULL || dedup_fp[block] == 0) {
+    return;
   }
-  dprintf("... new child inode %d\n", child_inode);
+  int *p = &dedup_head[dedup_fp[block] % DEDUP_BUCKETS];
+  while (*p != block) {
+    p = &dedup_next[*p];
+  }
+  *p = dedup_next[block];
+  dedup_fp[block] = 0;
+  dedup_dirty     = 1;
+}
 
-  // load the disk sector containing the child inode
-  int  inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if (Disk_Read(inode_sector, inode_buffer) < 0) {
-    return(-1);
+// release the data block starting at 'sector' back to the sector bitmap
+static void block_free(int sector) {
+  if (bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_USED, sector / BLOCK_SECTORS) == 0) {
+    sb.free_blocks++;
   }
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+  if (block_refs != NULL) {
+    block_refs[sector / BLOCK_SECTORS] = 0;
+  }
+  dedup_remove(sector / BLOCK_SECTORS);
+}
 
-  // get the child inode
-  int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-  int offset            = child_inode - inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
+// drop a reference to the data block starting at 'sector'; the block
+// is freed once nothing refers to it anymore
+static void block_release(int sector) {
+  if (block_refs != NULL && block_refs[sector / BLOCK_SECTORS] > 1) {
+    block_refs[sector / BLOCK_SECTORS]--;
+  }else {
+    block_free(sector);
+  }
+}
 
-  // update the new child inode and write to disk
-  memset(child, 0, sizeof(inode_t));
-  child->type = type;
-  if (Disk_Write(inode_sector, inode_buffer) < 0) {
+// whether the data block starting at 'sector' is shared (by files, or
+// by the live file system and a snapshot), in which case it can't be
+// written over
+static int block_shared(int sector) {
+  return(block_refs != NULL && block_refs[sector / BLOCK_SECTORS] > 1);
+}
+
+// allocate up to 'want' consecutive data blocks in one pass over the
+// sector bitmap; the first sector of the first block is returned
+// through 'first' and the number of blocks allocated (the longest free
+// run if there's none of 'want' blocks) is returned; -1 if the disk is
+// full or the bitmap can't be updated; in log-structured mode the
+// blocks are taken at the head of the log instead, which then moves
+// past them: the run is the free blocks found first from there on
+// (wrapping around at the end of the disk), so the blocks written one
+// after the other end up one after the other on disk
+static int block_alloc_run(int want, int *first) {
+  if (sb.free_blocks <= 0) {
     return(-1);
   }
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-          child_inode, child->size, child->type, inode_sector);
+  int block, len;
+  if (LOG_MODE) {
+    len = bitmap_next_unused_run(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_USED, TOTAL_BLOCKS,
+                                 DATABLOCK_START_BLOCK, sb.log_head, want, &block);
+    if (len > 0) {
+      sb.log_head = (block + len < TOTAL_BLOCKS) ? block + len : DATABLOCK_START_BLOCK;
+    }
+  }else {
+    len = bitmap_first_unused_run(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_USED,
+                                  TOTAL_BLOCKS, want, &block);
+  }
+  if (len <= 0) {
+    return(-1);
+  }
+  sb.free_blocks -= len;
+  for (int i = 0; block_refs != NULL && i < len; i++) {
+    block_refs[block + i] = 1;
+  }
+  *first = block * BLOCK_SECTORS;
+  return(len);
+}
 
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-  if (Disk_Read(inode_sector, inode_buffer) < 0) {
+// allocate an unused data block from the sector bitmap and account
+// for it in the superblock; the first sector of the block is returned,
+// or -1 if the disk is full (known without touching the bitmap) or if
+// the bitmap can't be updated
+static int block_alloc() {
+  if (sb.free_blocks <= 0) {
     return(-1);
   }
-  dprintf("... load inode table for parent inode %d from disk sector %d\n",
-          parent_inode, inode_sector);
+  if (LOG_MODE) {
+    int sector;
+    return(block_alloc_run(1, &sector) == 1 ? sector : -1);
+  }
+  int block = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_USED, TOTAL_BLOCKS);
+  if (block < 0) {
+    return(-1);
+  }
+  sb.free_blocks--;
+  if (block_refs != NULL) {
+    block_refs[block] = 1;
+  }
+  return(block * BLOCK_SECTORS);
+}
 
-  // get the parent inode
-  inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-  offset            = parent_inode - inode_start_entry;
+// the sector holding the i-th sector's worth of the content of an
+// inode (the i-th dirent group of a directory); 0 if its block has no
+// sector
+static int inode_data_sector(inode_t *inode, int i) {
+  int first = inode->data[i / BLOCK_SECTORS];
+  return(first ? first + i % BLOCK_SECTORS : 0);
+}
+
+// the number of entries of data[] in use: all of them for a file
+// (which may have holes, and blocks reserved past its size), those
+// covering its dirents for a directory (the others are stale)
+static int inode_nblocks(inode_t *inode) {
+  if (inode->type == 0) {
+    return(MAX_SECTORS_PER_FILE);
+  }else if (inode->type == 1 && inode->size >= 0) {
+    int groups  = (inode->size + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR;
+    int nblocks = (groups + BLOCK_SECTORS - 1) / BLOCK_SECTORS;
+    return(nblocks < MAX_SECTORS_PER_FILE ? nblocks : MAX_SECTORS_PER_FILE);
+  }
+  return(0);
+}
+
+// move the 'count' consecutive sectors starting from 'sector' to or
+// from the buffer 'buf' (one sector after the other) in one vectored
+// call of the disk; at most a block at a time
+static int sectors_io(int write, int sector, int count, char *buf) {
+  char *bufs[MAX_BLOCK_SECTORS];
+
+  assert(0 < count && count <= MAX_BLOCK_SECTORS);
+  for (int i = 0; i < count; i++) {
+    bufs[i] = buf + i * SECTOR_SIZE;
+  }
+  return(write ? Disk_WriteV(sector, count, bufs) : Disk_ReadV(sector, count, bufs));
+}
+
+// release an inode back to the inode bitmap
+static void inode_free(int inode) {
+  if (bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, inode) == 0) {
+    sb.free_inodes++;
+  }
+}
+
+// grow the inode table by a chunk: a run of blocks making up
+// INODE_CHUNK_SECTORS sectors, zeroed; its inodes are added to the
+// free ones; not done while there are snapshots, which only know of
+// the table (see snapshot_t); return 0 if successful, -1 if not
+static int inode_table_grow() {
+  int want = INODE_CHUNK_SECTORS / BLOCK_SECTORS;
+  int first;
+
+  if (sb.nsnapshots > 0 || INODE_COUNT >= MAX_INODES || sb.free_blocks - pending_blocks < want) {
+    return(-1);
+  }
+  int len = block_alloc_run(want, &first);
+  if (len < 0) {
+    return(-1);
+  }
+  char buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  int  ret = (len == want) ? 0 : -1;
+  memset(buf, 0, sizeof(buf));
+  for (int i = 0; ret == 0 && i < len; i++) {
+    ret = sectors_io(1, first + i * BLOCK_SECTORS, BLOCK_SECTORS, buf);
+  }
+  if (ret < 0) {
+    for (int i = 0; i < len; i++) {
+      block_free(first + i * BLOCK_SECTORS);
+    }
+    return(-1);
+  }
+  int count = INODE_COUNT;
+  sb.inode_chunks[sb.inode_nchunks++] = first;
+  sb.free_inodes += INODE_COUNT - count;
+  TRACE(TR_INODE_CHUNK, sb.inode_nchunks, first);
+  dprintf("... inode table grown by chunk %d at sector %d\n", sb.inode_nchunks - 1, first);
+  return(0);
+}
+
+// allocate an unused inode from the inode bitmap and account for it
+// in the superblock, growing the inode table if they're all in use;
+// return -1 if the inode table is full and can't grow or if the
+// bitmap can't be updated
+static int inode_alloc() {
+  if (sb.free_inodes <= 0 && inode_table_grow() < 0) {
+    return(-1);
+  }
+  int inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_COUNT);
+  if (inode < 0) {
+    return(-1);
+  }
+  sb.free_inodes--;
+  if (inode_table_extend(inode) < 0) {
+    inode_free(inode);
+    return(-1);
+  }
+  return(inode);
+}
+
+// write 'len' bytes from 'src' (zeros if NULL) at offset 'off' of the
+// block starting at 'sector'; only the sectors covered are written,
+// and those only partially overwritten are read first
+static int block_write(int sector, int off, char *src, int len) {
+  char  data_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  int   first = off / SECTOR_SIZE;
+  int   last  = (off + len - 1) / SECTOR_SIZE;
+  char *buf   = data_buf + first * SECTOR_SIZE;
+
+  if ((off % SECTOR_SIZE != 0 || (off + len) % SECTOR_SIZE != 0) &&
+      sectors_io(0, sector + first, last - first + 1, buf) < 0) {
+    return(-1);
+  }
+  if (src != NULL) {
+    memcpy(data_buf + off, src, len);
+  }else {
+    memset(data_buf + off, 0, len);
+  }
+  return(sectors_io(1, sector + first, last - first + 1, buf));
+}
+
+// the calls that would change the file system fail on a snapshot
+static int fs_writable() {
+  if (read_only) {
+    osErrno = E_READ_ONLY;
+    return(0);
+  }
+  return(1);
+}
+
+// write the map of snapshot 's' back to its sector
+static int snap_map_store(int s) {
+  char buf[SECTOR_SIZE];
+
+  memset(buf, 0, SECTOR_SIZE);
+  memcpy(buf, snap_maps[s], sizeof(snap_maps[s]));
+  return(Disk_Write(sb.snapshots[s].map, buf));
+}
+
+// write back a sector of the inode table; the snapshots that still
+// share the sector with the live table get a copy of its old content
+// first (one copy for all of them); return 0 if successful, -1 if not
+// (osErrno set to E_NO_SPACE if there's no block for the copy)
+static int inode_store(int sector, char *buf) {
+  int i    = sector - INODE_TABLE_START_SECTOR;
+  int copy = 0;
+
+  for (int s = 0; s < sb.nsnapshots; s++) {
+    if (i >= sb.snapshots[s].table_init || snap_maps[s][i] != 0) {
+      continue;
+    }
+    if (copy == 0) {
+      char old[SECTOR_SIZE];
+      if ((copy = block_alloc()) < 0) {
+        osErrno = E_NO_SPACE;
+        return(-1);
+      }
+      if (Disk_Read(sector, old) < 0 || Disk_Write(copy, old) < 0) {
+        return(-1);
+      }
+      block_refs[copy / BLOCK_SECTORS] = 0;
+    }
+    TRACE(TR_SNAP_COPY, s, i, copy);
+    snap_maps[s][i] = copy;
+    block_refs[copy / BLOCK_SECTORS]++;
+    if (snap_map_store(s) < 0) {
+      return(-1);
+    }
+  }
+  return(Disk_Write(sector, buf));
+}
+
+// give a directory block shared with a snapshot a copy of its own
+// before a dirent in it changes; the caller writes out the inode
+static int dir_block_unshare(inode_t *dir, int blk) {
+  char data_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  int  old = dir->data[blk];
+
+  if (!block_shared(old)) {
+    return(0);
+  }
+  int sector = block_alloc();
+  if (sector < 0) {
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+  if (sectors_io(0, old, BLOCK_SECTORS, data_buf) < 0 ||
+      sectors_io(1, sector, BLOCK_SECTORS, data_buf) < 0) {
+    return(-1);
+  }
+  block_release(old);
+  dir->data[blk] = sector;
+  return(0);
+}
+
+// count a reference to each block used by the inodes of an inode
+// table sector
+static void refs_add_sector(unsigned short *refs, char *buf) {
+  for (int j = 0; j < INODES_PER_SECTOR; j++) {
+    inode_t *node = (inode_t *)(buf + j * sizeof(inode_t));
+    for (int k = 0; k < inode_nblocks(node); k++) {
+      int block = node->data[k] / BLOCK_SECTORS;
+      if (node->data[k] != 0 && block >= DATABLOCK_START_BLOCK && block < TOTAL_BLOCKS) {
+        refs[block]++;
+      }
+    }
+  }
+}
+
+// count the references to each block: from the live inode table, from
+// each snapshot's view of it (its copies of the sectors written since,
+// the live sectors otherwise), from the snapshots to their maps and
+// copies, and to the blocks of the fingerprint index and of the
+// chunks of the inode table; return 0 if successful, -1 if the disk
+// can't be read
+static int refs_count(unsigned short *refs) {
+  char buf[SECTOR_SIZE];
+
+  memset(refs, 0, TOTAL_BLOCKS * sizeof(unsigned short));
+  for (int i = 0; DEDUP_MODE && i < DEDUP_INDEX_BLOCKS; i++) {
+    refs[sb.dedup_index / BLOCK_SECTORS + i]++;
+  }
+  for (int i = 0; i < sb.inode_nchunks * INODE_CHUNK_SECTORS; i += BLOCK_SECTORS) {
+    refs[(sb.inode_chunks[i / INODE_CHUNK_SECTORS] + i % INODE_CHUNK_SECTORS) / BLOCK_SECTORS]++;
+  }
+  for (int s = -1; s < sb.nsnapshots; s++) {
+    int init = (s < 0) ? INODE_SECTORS_INIT : sb.snapshots[s].table_init;
+    if (s >= 0) {
+      refs[sb.snapshots[s].map / BLOCK_SECTORS]++;
+    }
+    for (int i = 0; i < init; i++) {
+      int sector = inode_table_sector(i);
+      if (s >= 0 && snap_maps[s][i] != 0) {
+        sector = snap_maps[s][i];
+        refs[sector / BLOCK_SECTORS]++;
+      }
+      if (Disk_Read(sector, buf) < 0) {
+        return(-1);
+      }
+      refs_add_sector(refs, buf);
+    }
+  }
+  return(0);
+}
+
+// start keeping count of the references to the blocks, if not done
+// yet; return 0 if successful, -1 if not
+static int refs_init() {
+  if (block_refs != NULL) {
+    return(0);
+  }
+  block_refs = malloc(TOTAL_BLOCKS * sizeof(unsigned short));
+  if (block_refs == NULL || refs_count(block_refs) < 0) {
+    free(block_refs);
+    block_refs = NULL;
+    return(-1);
+  }
+  return(0);
+}
+
+// load the fingerprint index of a deduplicating disk into memory (the
+// index of another disk booted before is dropped) and chain its blocks
+// by fingerprint; return 0 if successful, -1 if not
+static int dedup_load() {
+  free(dedup_fp);
+  free(dedup_next);
+  dedup_fp   = NULL;
+  dedup_next = NULL;
+  memset(dedup_head, 0, sizeof(dedup_head));
+  dedup_dirty = 0;
+  if (!DEDUP_MODE) {
+    return(0);
+  }
+  char *buf  = malloc(DEDUP_INDEX_BLOCKS * BLOCK_SIZE);
+  dedup_fp   = calloc(TOTAL_BLOCKS, sizeof(unsigned int));
+  dedup_next = calloc(TOTAL_BLOCKS, sizeof(int));
+  int ret = (buf != NULL && dedup_fp != NULL && dedup_next != NULL) ? 0 : -1;
+  for (int i = 0; ret == 0 && i < DEDUP_INDEX_BLOCKS; i++) {
+    ret = sectors_io(0, sb.dedup_index + i * BLOCK_SECTORS, BLOCK_SECTORS, buf + i * BLOCK_SIZE);
+  }
+  for (int b = DATABLOCK_START_BLOCK; ret == 0 && b < TOTAL_BLOCKS; b++) {
+    unsigned int fp = ((unsigned int *)buf)[b];
+    if (fp != 0) {
+      dedup_insert(b, fp);
+    }
+  }
+  free(buf);
+  if (ret < 0) {
+    free(dedup_fp);
+    free(dedup_next);
+    dedup_fp   = NULL;
+    dedup_next = NULL;
+    return(-1);
+  }
+  dedup_dirty = 0;
+  return(0);
+}
+
+// save the fingerprint index if it changed; return 0 if successful,
+// -1 if not
+static int dedup_store() {
+  if (dedup_fp == NULL || !dedup_dirty) {
+    return(0);
+  }
+  char *buf = calloc(DEDUP_INDEX_BLOCKS, BLOCK_SIZE);
+  int   ret = (buf != NULL) ? 0 : -1;
+  if (buf != NULL) {
+    memcpy(buf, dedup_fp, TOTAL_BLOCKS * sizeof(unsigned int));
+  }
+  for (int i = 0; ret == 0 && i < DEDUP_INDEX_BLOCKS; i++) {
+    ret = sectors_io(1, sb.dedup_index + i * BLOCK_SECTORS, BLOCK_SECTORS, buf + i * BLOCK_SIZE);
+  }
+  free(buf);
+  if (ret == 0) {
+    dedup_dirty = 0;
+  }
+  return(ret);
+}
+
+// load the superblock into memory; the free counters of an image
+// formatted by an older version are recomputed from the bitmaps;
+// return 0 if successful, -1 if the magic number doesn't match or
+// there's a read error
+static int sb_load() {
+  char buf[SECTOR_SIZE];
+
+  if (Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) {
+    return(-1);
+  }
+  memcpy(&sb, buf, sizeof(superblock_t));
+  if (sb.magic != OS_MAGIC) {
+    return(-1);
+  }
+  if (sb.version < 3) {
+    sb.block_sectors = 1;
+    sb.log_head      = 0;
+    sb.nsnapshots    = 0;
+    sb.shared        = 0;
+    sb.dedup_index   = 0;
+    sb.inode_nchunks = 0;
+  }
+  if (sb.block_sectors < 1 || sb.block_sectors > MAX_BLOCK_SECTORS ||
+      (sb.block_sectors & (sb.block_sectors - 1)) != 0) {
+    return(-1);
+  }
+  if (sb.log_head != 0 && (sb.log_head < DATABLOCK_START_BLOCK || sb.log_head >= TOTAL_BLOCKS)) {
+    return(-1);
+  }
+  if (sb.nsnapshots < 0 || sb.nsnapshots > MAX_SNAPSHOTS) {
+    return(-1);
+  }
+  if (sb.dedup_index != 0 && (sb.dedup_index % BLOCK_SECTORS != 0 ||
+                              sb.dedup_index < DATABLOCK_START_BLOCK * BLOCK_SECTORS ||
+                              sb.dedup_index / BLOCK_SECTORS + DEDUP_INDEX_BLOCKS > TOTAL_BLOCKS)) {
+    return(-1);
+  }
+  if (sb.inode_nchunks < 0 || sb.inode_nchunks > MAX_INODE_CHUNKS ||
+      (sb.inode_nchunks > 0 && sb.nsnapshots > 0)) {
+    return(-1);
+  }
+  for (int i = 0; i < sb.inode_nchunks; i++) {
+    if (sb.inode_chunks[i] % BLOCK_SECTORS != 0 ||
+        sb.inode_chunks[i] < DATABLOCK_START_BLOCK * BLOCK_SECTORS ||
+        sb.inode_chunks[i] + INODE_CHUNK_SECTORS > TOTAL_BLOCKS * BLOCK_SECTORS) {
+      return(-1);
+    }
+  }
+  if (sb.version < 1) {
+    dprintf("... superblock version %d, recount free inodes and blocks\n", sb.version);
+    sb.free_inodes = bitmap_count_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_COUNT);
+    sb.free_blocks = bitmap_count_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_USED, TOTAL_BLOCKS);
+    if (sb.free_inodes < 0 || sb.free_blocks < 0) {
+      return(-1);
+    }
+  }
+  if (sb.version < 2) {
+    sb.inode_table_init = INODE_TABLE_SECTORS;
+  }
+  sb.version = OS_VERSION;
+  dprintf("... superblock: free inodes=%d, free blocks=%d, block size=%d\n",
+          sb.free_inodes, sb.free_blocks, BLOCK_SIZE);
+  return(0);
+}
+
+// write the in-memory superblock back to disk
+static int sb_store() {
+  char buf[SECTOR_SIZE];
+
+  memset(buf, 0, SECTOR_SIZE);
+  memcpy(buf, &sb, sizeof(superblock_t));
+  return(Disk_Write(SUPERBLOCK_START_SECTOR, buf));
+}
+
+// Written by Dario Gonzalez
+// return 1 if the file name is illegal; otherwise, return 0; legal
+// characters for a file name include letters (case sensitive),
+// numbers, dots, dashes, and underscores; and a legal file name
+// should not be more than MAX_NAME-1 in length
+static int illegal_filename(char *name) {
+  char *curr;
+  int   length = 0;
+
+  for (curr = name; *curr != '\0'; curr++) {
+    length++;
+    char c = *curr;
+    if (!((c >= 'A' && c <= 'Z') ||
+          (c >= 'a' && c <= 'z') ||
+          (c >= '0' && c <= '9') ||
+          c == '.' ||
+          c == '-' ||
+          c == '_')) {
+      return(1);
+    }
+  }
+  if (length < MAX_NAME) {
+    return(0);
+  }
+  return(1);
+}
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the parent inode is currently stored in the segment
+// of inode table in the cache (we cache only one disk sector for
+// this); once found, both cached_inode_sector and cached_inode_buffer
+// may be updated to point to the segment of inode table containing
+// the child inode; the function returns -1 if no such file is found;
+// it returns -2 is something else is wrong (such as parent is not
+// directory, or there's read error, etc.)
+static int find_child_inode(int parent_inode, char *fname,
+                            int *cached_inode_sector, char *cached_inode_buffer) {
+  int offset = parent_inode % INODES_PER_SECTOR;
+
+  assert(*cached_inode_sector == inode_sector_of(parent_inode));
+  inode_t *parent = (inode_t *)(cached_inode_buffer + offset * sizeof(inode_t));
+  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
+          parent_inode, parent->size, parent->type);
+  if (parent->type != 1) {
+    dprintf("... parent not a directory\n");
+    return(-2);
+  }
+
+  int nentries = parent->size;       // remaining number of directory entries
+  int idx      = 0;
+  while (nentries > 0) {
+    char buf[SECTOR_SIZE];             // cached content of directory entries
+    if (Disk_Read(inode_data_sector(parent, idx), buf) < 0) {
+      return(-2);
+    }
+    for (int i = 0; i < DIRENTS_PER_SECTOR; i++) {
+      if (i > nentries) {
+        break;
+      }
+      STAT_ADD(dirents_scanned, 1);
+      if (!strcmp(((dirent_t *)buf)[i].fname, fname)) {
+        // found the file/directory; update inode cache
+        int child_inode = ((dirent_t *)buf)[i].inode;
+        dprintf("... found child_inode=%d\n", child_inode);
+        TRACE(TR_LOOKUP, parent_inode, child_inode, idx * DIRENTS_PER_SECTOR + i + 1);
+        int sector = inode_sector_of(child_inode);
+        if (sector == (*cached_inode_sector)) {
+          STAT_ADD(inode_cache_hits, 1);
+        }else {
+          STAT_ADD(inode_cache_misses, 1);
+          *cached_inode_sector = sector;
+          if (Disk_Read(sector, cached_inode_buffer) < 0) {
+            return(-2);
+          }
+          dprintf("... load inode table for child\n");
+        }
+        return(child_inode);
+      }
+    }
+    idx++; nentries -= DIRENTS_PER_SECTOR;
+  }
+  dprintf("... could not find child inode\n");
+  TRACE(TR_LOOKUP, parent_inode, -1, parent->size);
+  return(-1);      // not found
+}
+
+// representing a directory handle (Dir_OpenHandle()); the handle
+// holds on to the inode of the directory, which can't be removed
+// while it's open, rather than to its path
+typedef struct _dir_handle {
+  int used;      // whether the entry is in use
+  int inode;     // pointing to the inode of the directory
+} dir_handle_t;
+static dir_handle_t dir_handles[MAX_DIR_HANDLES];
+
+// return true if 'dh' refers to an entry in use in the handle table
+static int is_valid_dh(int dh) {
+  return(0 <= dh && dh < MAX_DIR_HANDLES && dir_handles[dh].used);
+}
+
+// return true if the directory pointed to by inode has a handle open
+static int is_dir_held(int inode) {
+  for (int i = 0; i < MAX_DIR_HANDLES; i++) {
+    if (dir_handles[i].used && dir_handles[i].inode == inode) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+// follow the path; an absolute path is followed from the root, a
+// relative one from the directory of handle 'dh' (none if -1, in which
+// case the path has to be absolute); if successful, return the inode
+// of the parent directory immediately before the last file/directory
+// in the path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c'
+// and the child is 'd.txt'; the child's inode is returned through the
+// parameter 'last_inode' and its file name is returned through the
+// parameter 'last_fname' (both are references); it's possible that
+// the last file/directory is not in its parent directory, in which
+// case, 'last_inode' points to -1; if the function returns -1, it
+// means that we cannot follow the path
+static int follow_path_at(int dh, char *path, int *last_inode, char *last_fname) {
+  if (!path) {
+    dprintf("... invalid path\n");
+    return(-1);
+  }
+  if (path[0] != '/' && !is_valid_dh(dh)) {
+    dprintf("... '%s' not absolute path\n", path);
+    return(-1);
+  }
+
+  // make a copy of the path (skip leading '/'); this is necessary
+  // since the path is going to be modified by strsep()
+  char pathstore[MAX_PATH];
+  strncpy(pathstore, path + (path[0] == '/'), MAX_PATH - 1);
+  pathstore[MAX_PATH - 1] = '\0';     // for safety
+  char *lpath = pathstore;
+
+  // start from root, or from the directory of the handle
+  int start        = (path[0] == '/') ? 0 : dir_handles[dh].inode;
+  int parent_inode = -1, child_inode = start;
+  // cache the disk sector containing the starting inode
+  int  cached_sector = inode_sector_of(start);
+  char cached_buffer[SECTOR_SIZE];
+  if (Disk_Read(cached_sector, cached_buffer) < 0) {
+    return(-1);
+  }
+  dprintf("... load inode table for inode %d from disk sector %d\n", start, cached_sector);
+
+  // for each file/directory name separated by '/'
+  char *token;
+  while ((token = strsep(&lpath, "/")) != NULL) {
+    dprintf("... process token: '%s'\n", token);
+    if (*token == '\0') {
+      continue;                              // multiple '/' ignored
+    }
+    if (illegal_filename(token)) {
+      dprintf("... illegal file name: '%s'\n", token);
+      return(-1);
+    }
+    if (child_inode < 0) {
+      // regardless whether child_inode was not found previously, or
+      // there was issues related to the parent (say, not a
+      // directory), or there was a read error, we abort
+      dprintf("... parent inode can't be established\n");
+      return(-1);
+    }
+    STAT_ADD(path_components, 1);
+    parent_inode = child_inode;
+    child_inode  = find_child_inode(parent_inode, token,
+                                    &cached_sector, cached_buffer);
+    if (last_fname) {
+      strcpy(last_fname, token);
+    }
+  }
+  if (child_inode < -1) {
+    return(-1);                         // if there was error, abort
+  }else {
+    // there was no error, several possibilities:
+    // 1) '/': parent = -1, child = 0
+    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
+    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
+    // in the first case, we set parent=child=0 as special case (and
+    // likewise parent=child=start for an empty relative path)
+    if (parent_inode == -1 && child_inode == start) {
+      parent_inode = start;
+    }
+    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
+    *last_inode = child_inode;
+    return(parent_inode);
+  }
+}
+
+// follow the absolute path (see follow_path_at())
+static int follow_path(char *path, int *last_inode, char *last_fname) {
+  return(follow_path_at(-1, path, last_inode, last_fname));
+}
+
+// append a dirent named 'file' for 'child_inode' to the directory
+// 'parent_inode'; return 0 if successful, -2 if the parent is not a
+// directory, -1 if something else is wrong
+static int dirent_add(int parent_inode, char *file, int child_inode) {
+  char inode_buffer[SECTOR_SIZE];
+
+  // get the disk sector containing the parent inode
+  int inode_sector = inode_sector_of(parent_inode);
+  if (Disk_Read(inode_sector, inode_buffer) < 0) {
+    return(-1);
+  }
+  dprintf("... load inode table for parent inode %d from disk sector %d\n",
+          parent_inode, inode_sector);
+
+  // get the parent inode
+  int offset = parent_inode % INODES_PER_SECTOR;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  inode_t *parent = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
+  dprintf("... get parent inode %d (size=%d, type=%d)\n",
+          parent_inode, parent->size, parent->type);
+
+  // get the dirent sector
+  if (parent->type != 1) {
+    dprintf("... error: parent inode is not directory\n");
+    return(-2);            // parent not directory
+  }
+  int  group = parent->size / DIRENTS_PER_SECTOR;
+  char dirent_buffer[SECTOR_SIZE];
+  if (group * DIRENTS_PER_SECTOR == parent->size) {
+    // a new dirent sector is needed, and a new block when the sectors
+    // of the last one are all taken
+    if (group % BLOCK_SECTORS == 0) {
+      int newsec = (group / BLOCK_SECTORS < BLOCKS_PER_FILE) ? block_alloc() : -1;
+      if (newsec < 0) {
+        dprintf("... error: disk or directory is full\n");
+        return(-1);
+      }
+      parent->data[group / BLOCK_SECTORS] = newsec;
+      dprintf("... new block at sector %d for dirent group %d\n", newsec, group);
+    }
+    memset(dirent_buffer, 0, SECTOR_SIZE);
+  }else {
+    if (Disk_Read(inode_data_sector(parent, group), dirent_buffer) < 0) {
+      return(-1);
+    }
+    dprintf("... load disk sector %d for dirent group %d\n", inode_data_sector(parent, group), group);
+  }
+  if (dir_block_unshare(parent, group / BLOCK_SECTORS) < 0) {
+    return(-1);
+  }
+
+  // add the dirent and write to disk
+  int start_entry = group * DIRENTS_PER_SECTOR;
+  offset = parent->size - start_entry;
+  dirent_t *dirent = (dirent_t *)(dirent_buffer + offset * sizeof(dirent_t));
+  strncpy(dirent->fname, file, MAX_NAME);
+  dirent->inode = child_inode;
+  if (Disk_Write(inode_data_sector(parent, group), dirent_buffer) < 0) {
+    return(-1);
+  }
+  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
+          parent->size, dirent->fname, dirent->inode, group, inode_data_sector(parent, group));
+
+  // update parent inode and write to disk
+  parent->size++;
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    return(-1);
+  }
+  dprintf("... update parent inode on disk sector %d\n", inode_sector);
+  return(0);
+}
+
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'
+int add_inode(int type, int parent_inode, char *file) {
+  // get a new inode for child
+  int child_inode = inode_alloc();
+
+  if (child_inode < 0) {
+    dprintf("... error: inode table is full\n");
+    return(-1);
+  }
+  dprintf("... new child inode %d\n", child_inode);
+
+  // load the disk sector containing the child inode
+  int  inode_sector = inode_sector_of(child_inode);
+  char inode_buffer[SECTOR_SIZE];
+  if (Disk_Read(inode_sector, inode_buffer) < 0) {
+    return(-1);
+  }
+  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+
+  // get the child inode
+  int offset = child_inode % INODES_PER_SECTOR;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t *parent = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n",
-          parent_inode, parent->size, parent->type);
+  inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
 
-  // get the dirent sector
-  if (parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return(-2);            // parent not directory
+  // update the new child inode and write to disk
+  memset(child, 0, sizeof(inode_t));
+  child->type = type;
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    return(-1);
   }
-  int  group = parent->size / DIRENTS_PER_SECTOR;
-  char dirent_buffer[SECTOR_SIZE];
-  if (group * DIRENTS_PER_SECTOR == parent->size) {
-    // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    if (newsec < 0) {
-      dprintf("... error: disk is full\n");
+  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
+          child_inode, child->size, child->type, inode_sector);
+
+  // and add its dirent to the parent
+  int ret = dirent_add(parent_inode, file, child_inode);
+  if (ret < 0) {
+    inode_free(child_inode);
+    return(ret);
+  }
+  TRACE(TR_INODE_ADD, type, parent_inode, child_inode);
+  return(0);
+}
+
+// used by both File_Create() and Dir_Create(); type=0 is file, type=1
+// is directory
+int create_file_or_directory(int type, int dh, char *pathname) {
+  if (!fs_writable()) {
+    return(-1);
+  }
+  int  child_inode;
+  char last_fname[MAX_NAME];
+  int  parent_inode = follow_path_at(dh, pathname, &child_inode, last_fname);
+
+  if (parent_inode >= 0) {
+    if (child_inode >= 0) {
+      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
+      osErrno = E_CREATE;
+      return(-1);
+    }else {
+      if (add_inode(type, parent_inode, last_fname) >= 0) {
+        dprintf("... successfully created file/directory: '%s'\n", pathname);
+        return(0);
+      }else {
+        dprintf("... error: something wrong with adding child inode\n");
+        osErrno = E_CREATE;
+        return(-1);
+      }
+    }
+  }else {
+    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
+    osErrno = E_CREATE;
+    return(-1);
+  }
+}
+
+// Written by Dario Gonzalez
+// take the dirent named 'fname' of 'child_inode' out of the directory
+// 'parent_inode' (a file with links may have several dirents in it),
+// the last dirent taking its place; return 0 if successful, -3 if the
+// parent is not a directory, -1 if something else is wrong
+static int dirent_remove(int parent_inode, char *fname, int child_inode) {
+  int parent_loc        = inode_sector_of(parent_inode);
+  int parent_loc_offset = parent_inode % INODES_PER_SECTOR;
+
+  //for now create a new buffer to store the parent_inode
+  char parent_inode_buf[SECTOR_SIZE];
+  //load parent_inode info
+  if (Disk_Read(parent_loc, parent_inode_buf) < 0) {
+    return(-1);
+  }
+  inode_t *parent = (inode_t *)(parent_inode_buf + parent_loc_offset * sizeof(inode_t));
+  if (parent->type != 1) { //ie the parent isn't a directory
+    dprintf("remove_inode: Tried to unlink from a file with type %d \n", parent->type);
+    return(-3);
+  }
+
+  //now we need to find the child inode among the dirents and zero it
+  int found              = 0;
+  int hole               = -1; //index of the dirent zeroed
+  int full_dirent_secs   = parent->size / DIRENTS_PER_SECTOR;
+  int partial_dirent_sec = sgn(parent->size - full_dirent_secs * DIRENTS_PER_SECTOR); //ie either 0 or 1
+
+  char dirent_buf[SECTOR_SIZE];
+  //search all full dirent sectors
+  dprintf("remove_inode: searching full dirent sectors...\n");
+  for (int dir_sec = 0; dir_sec < full_dirent_secs; dir_sec++) {
+    if (found) {
+      break;
+    }
+    if (Disk_Read(inode_data_sector(parent, dir_sec), dirent_buf) < 0) {
+      return(-1);
+    }
+    int dir = 0;
+    for (dirent_t *cur_dir_ent = (dirent_t *)dirent_buf; dir < DIRENTS_PER_SECTOR; dir++, cur_dir_ent++) {
+      if (cur_dir_ent->inode == child_inode && strncmp(cur_dir_ent->fname, fname, MAX_NAME) == 0) {  //we found it!
+        dprintf("remove_inode: found inode at dir %d in sector %d, the parent's %d data sector\n", dir, inode_data_sector(parent, dir_sec), dir_sec);
+        memset(cur_dir_ent, 0, sizeof *cur_dir_ent);   //zero-out the dir entry
+        found = inode_data_sector(parent, dir_sec);
+        hole  = dir_sec * DIRENTS_PER_SECTOR + dir;
+        break;
+      }
+    }
+  }
+  //check the last data sector
+
+  dprintf("remove_inode: searching last dirent sectors...\n");
+  if (!found && partial_dirent_sec) {
+    if (Disk_Read(inode_data_sector(parent, full_dirent_secs), dirent_buf) < 0) {
+      return(-1);
+    }
+    int dir = 0;
+    for (dirent_t *cur_dir_ent = (dirent_t *)dirent_buf; dir < parent->size % DIRENTS_PER_SECTOR; dir++, cur_dir_ent++) {
+      if (cur_dir_ent->inode == child_inode && strncmp(cur_dir_ent->fname, fname, MAX_NAME) == 0) {  //we found it!
+        dprintf("remove_inode: found inode at dir %d in sector %d, the parent's %d data sector\n", dir, inode_data_sector(parent, full_dirent_secs), full_dirent_secs);
+
+        memset(cur_dir_ent, 0, sizeof *cur_dir_ent);   //zero-out the dir entry
+        found = inode_data_sector(parent, full_dirent_secs);
+        hole  = full_dirent_secs * DIRENTS_PER_SECTOR + dir;
+        break;
+      }
+    }
+  }
+
+  if (!found) {
+    return(-1);
+  }
+
+  //the blocks about to change get copies of their own if they are
+  //shared with a snapshot
+  if (dir_block_unshare(parent, hole / DIRENTS_PER_SECTOR / BLOCK_SECTORS) < 0 ||
+      dir_block_unshare(parent, (parent->size - 1) / DIRENTS_PER_SECTOR / BLOCK_SECTORS) < 0) {
+    return(-1);
+  }
+  found = inode_data_sector(parent, hole / DIRENTS_PER_SECTOR);
+
+  //zeroing out the entry alone would leave a hole, and the size of the
+  //directory would never go down; so the last entry is moved into the
+  //hole instead, and the last block is given back once all its dirent
+  //sectors are empty
+  int last     = parent->size - 1;
+  int last_sec = inode_data_sector(parent, last / DIRENTS_PER_SECTOR);
+  if (hole != last) {
+    char  last_buf[SECTOR_SIZE];
+    char *lbuf = (last_sec == found) ? dirent_buf : last_buf;
+    if (lbuf == last_buf && Disk_Read(last_sec, last_buf) < 0) {
+      return(-1);
+    }
+    dirent_t *last_ent = (dirent_t *)lbuf + last % DIRENTS_PER_SECTOR;
+    ((dirent_t *)dirent_buf)[hole % DIRENTS_PER_SECTOR] = *last_ent;
+    memset(last_ent, 0, sizeof *last_ent);
+    if (lbuf == last_buf && Disk_Write(last_sec, last_buf) < 0) {
+      return(-1);
+    }
+  }
+  parent->size--;
+  int last_group = last / DIRENTS_PER_SECTOR;
+  int released   = 0;
+  if (parent->size == last_group * DIRENTS_PER_SECTOR && last_group % BLOCK_SECTORS == 0) {
+    block_release(parent->data[last_group / BLOCK_SECTORS]);
+    parent->data[last_group / BLOCK_SECTORS] = 0;
+    released = 1;
+  }
+
+  //write out the dirent sector with the hole filled (unless it was the
+  //only dirent left in the block just given back), and the parent
+  if (!(released && hole == last) && Disk_Write(found, dirent_buf) < 0) {
+    return(-1);
+  }
+  if (inode_store(parent_loc, parent_inode_buf) < 0) {
+    return(-1);
+  }
+  return(0);
+}
+
+// remove the child named 'fname' from parent; the function is called
+// by both File_Unlink() and Dir_Unlink(); the function returns 0 if
+// success, -1 if general error, -2 if directory not empty, -3 if wrong
+// type
+int remove_inode(int type, int parent_inode, char *fname, int child_inode) {
+  //load child node info
+  //first have to find the sector it is in
+  int child_loc        = inode_sector_of(child_inode);
+  int child_loc_offset = child_inode % INODES_PER_SECTOR;
+
+  char child_inode_buf[SECTOR_SIZE];
+
+  if (Disk_Read(child_loc, child_inode_buf) < 0) {
+    return(-1);
+  }
+  inode_t *child = (inode_t *)(child_inode_buf + child_loc_offset * sizeof(inode_t));
+  if (child->type != type) {
+    dprintf("remove_inode: Given type %d, found %d when removing inode\n", child->type, type);
+    return(-3);
+  }
+  if (child->type == 1) {  //ie the file is a directory
+    if (child->size > 0) { //the directory isn't empty
+      dprintf("remove_inode: Tried to unlink a directory of size %d\n", child->size);
+      return(-2);
+    }
+  }else{
+    if (child->size > 0) {
+      dprintf("remove_inode: tried to remove a file that still claimed blocks\n");
+      return(-1); //the file to be deleted still claims blocks
+    }
+  }
+  int ret = dirent_remove(parent_inode, fname, child_inode);
+  if (ret < 0) {
+    return(ret);
+  }
+
+  //set the child's inode to free
+  inode_free(child_inode);
+  TRACE(TR_INODE_REMOVE, type, parent_inode, child_inode);
+  return(0);
+}
+
+// make sure the data blocks from 'from' up to (not including) 'to' of
+// the given inode all have a sector; a data[] entry of 0 means the
+// block has no sector yet (sector 0 is the superblock and can never be
+// a data block); all the blocks needed are checked against the free
+// counter first, so that a full disk is detected before any block
+// gets assigned (instead of half way through), and each gap is filled
+// with as few contiguous runs as the sector bitmap allows; return 0
+// if successful, otherwise -1 with osErrno set; the caller is
+// responsible for writing the inode back to disk
+static int inode_alloc_blocks(inode_t *inode, int from, int to) {
+  int needed = 0;
+  for (int i = from; i < to; i++) {
+    if (inode->data[i] == 0) {
+      needed++;
+    }
+  }
+  if (needed > sb.free_blocks - pending_blocks) {
+    dprintf("disk doesn't have %d free blocks\n", needed);
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+
+  for (int i = from; i < to; ) {
+    if (inode->data[i] != 0) {
+      i++;
+      continue;
+    }
+    int gap = 0;
+    while (i + gap < to && inode->data[i + gap] == 0) {
+      gap++;
+    }
+    int first, len = block_alloc_run(gap, &first);
+    if (len < 0) {
+      // only possible with an I/O error on the bitmap; the blocks
+      // assigned so far stay with the inode
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    dprintf("assigning sectors %d-%d to blocks %d-%d\n",
+            first, first + len * BLOCK_SECTORS - 1, i, i + len - 1);
+    for (int k = 0; k < len; k++) {
+      inode->data[i++] = first + k * BLOCK_SECTORS;
+    }
+  }
+  return(0);
+}
+
+// representing an open file
+typedef struct _open_file {
+  int inode;     // pointing to the inode of the file (0 means entry not used)
+  int size;      // file size cached here for convenience
+  int pos;       // read/write position
+} open_file_t;
+static open_file_t open_files[MAX_OPEN_FILES];
+
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode) {
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (open_files[i].inode == inode) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+// return true if 'fd' refers to an entry in use in the open file table
+static int is_valid_fd(int fd) {
+  return(0 <= fd && fd < MAX_OPEN_FILES && open_files[fd].inode > 0);
+}
+
+// return a new file descriptor not used; -1 if full
+int new_file_fd() {
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (open_files[i].inode <= 0) {
+      return(i);
+    }
+  }
+  return(-1);
+}
+
+// load the disk sector containing the given inode into 'buffer' and
+// return a pointer to the inode inside it; the sector number is
+// returned through 'sector' (so that the caller can write the inode
+// back); NULL if the sector can't be read
+static inode_t *inode_load(int inode, int *sector, char *buffer) {
+  *sector = inode_sector_of(inode);
+  if (Disk_Read(*sector, buffer) < 0) {
+    return(NULL);
+  }
+  return((inode_t *)(buffer + (inode % INODES_PER_SECTOR) * sizeof(inode_t)));
+}
+
+// delayed allocation: a block written to a file that doesn't have a
+// sector yet is kept in a page in memory instead of getting a sector
+// right away; only when the file is flushed (File_Flush(),
+// File_Close() or FS_Sync()) are all its pending blocks given sectors,
+// by which time the final size is known and a file written front to
+// back gets a single contiguous run; the pages of a file are indexed
+// by block number (each page being BLOCK_SIZE bytes), and there is at
+// most one entry per inode
+typedef struct _delalloc {
+  int   inode;                         // the file (0 means entry not used)
+  int   npages;                        // number of pages held
+  char *pages[MAX_SECTORS_PER_FILE];   // block content, NULL if not pending
+} delalloc_t;
+static delalloc_t delalloc[MAX_OPEN_FILES];
+
+// return the delayed allocation entry of the inode; if there is none,
+// a new entry is set up when 'create' is true, otherwise NULL is
+// returned
+static delalloc_t *delalloc_find(int inode, int create) {
+  delalloc_t *empty = NULL;
+
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (delalloc[i].inode == inode) {
+      return(&delalloc[i]);
+    }
+    if (empty == NULL && delalloc[i].inode == 0) {
+      empty = &delalloc[i];
+    }
+  }
+  if (create && empty != NULL) {
+    memset(empty, 0, sizeof(delalloc_t));
+    empty->inode = inode;
+  }
+  return(create ? empty : NULL);
+}
+
+// in log-structured or deduplicating mode, or if it's shared, a block
+// of a file that already has a sector is not overwritten there: it is
+// moved back into a pending page (read from the disk first unless
+// 'fill' is false, i.e., the whole block is about to be overwritten)
+// and its sector released, so that the next flush gives it a new one
+// (at the head of the log) along with the file's other new blocks;
+// the caller writes out the inode; return 0 if successful, otherwise
+// -1 with osErrno set
+static int block_redirect(inode_t *inode, int ino, delalloc_t *d, int blk, int fill) {
+  char *page = calloc(1, BLOCK_SIZE);
+
+  if (page == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (fill && sectors_io(0, inode->data[blk], BLOCK_SECTORS, page) < 0) {
+    free(page);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  TRACE(TR_LOG_REDIRECT, ino, blk, inode->data[blk]);
+  block_release(inode->data[blk]);
+  inode->data[blk] = 0;
+  d->pages[blk]    = page;
+  d->npages++;
+  pending_blocks++;
+  return(0);
+}
+
+// the number of blocks of cluster 'c' covering the first 'size' bytes
+// of a file
+static int cluster_used(int size, int c) {
+  int n = (size + BLOCK_SIZE - 1) / BLOCK_SIZE - c * CLUSTER_BLOCKS;
+  int max = BLOCKS_PER_FILE - c * CLUSTER_BLOCKS;
+
+  if (max > CLUSTER_BLOCKS) {
+    max = CLUSTER_BLOCKS;
+  }
+  return(n < 0 ? 0 : n < max ? n : max);
+}
+
+// the number of blocks cluster 'c' of a compressed file takes on disk
+// (the entries of data[] with a sector, from the first one on)
+static int cluster_stored(inode_t *inode, int c) {
+  int first = c * CLUSTER_BLOCKS;
+  int used  = cluster_used(inode->size, c);
+  int m     = 0;
+
+  while (m < used && inode->data[first + m] != 0) {
+    m++;
+  }
+  return(m);
+}
+
+// read cluster 'c' of a compressed file into 'buf' (CLUSTER_SIZE
+// bytes, zeros past the end of the file), decompressing it if it takes
+// fewer blocks than it covers; return 0 if successful, -1 if not
+static int cluster_read(inode_t *inode, int c, char *buf) {
+  int first = c * CLUSTER_BLOCKS;
+  int used  = cluster_used(inode->size, c);
+  int m     = cluster_stored(inode, c);
+
+  memset(buf, 0, CLUSTER_SIZE);
+  if (m == 0) {
+    STAT_ADD(holes_read, 1);
+    return(0);
+  }
+  char *in = (m == used) ? buf : malloc(m * BLOCK_SIZE);
+  if (in == NULL) {
+    return(-1);
+  }
+  for (int i = 0; i < m; i++) {
+    if (sectors_io(0, inode->data[first + i], BLOCK_SECTORS, in + i * BLOCK_SIZE) < 0) {
+      if (in != buf) {
+        free(in);
+      }
       return(-1);
     }
-    parent->data[group] = newsec;
-    memset(dirent_buffer, 0, SECTOR_SIZE);
-    dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
-  }else {
-    if (Disk_Read(parent->data[group], dirent_buffer) < 0) {
+  }
+  if (in == buf) {
+    return(0);
+  }
+  STAT_ADD(clusters_read, 1);
+  int len = (unsigned char)in[0] | (unsigned char)in[1] << 8;
+  int ret = (len <= m * BLOCK_SIZE - 2 &&
+             fs_lz_decompress(in + 2, len, buf, used * BLOCK_SIZE) >= 0) ? 0 : -1;
+  free(in);
+  return(ret);
+}
+
+// whether a write of 'len' bytes at 'pos' to a compressed file of the
+// given size rewrites cluster 'c': the clusters written to, and the
+// last one of the file (partly filled) if the file grows, as what it
+// covers changes
+static int cluster_touched(int size, int pos, int len, int c) {
+  if (len > 0 && pos / CLUSTER_SIZE <= c && c <= (pos + len - 1) / CLUSTER_SIZE) {
+    return(1);
+  }
+  return(pos + len > size && size % CLUSTER_SIZE != 0 && c == size / CLUSTER_SIZE);
+}
+
+// a cluster of a compressed file is rewritten as a whole: it is moved
+// back into pending pages (decompressed), one for each of its blocks
+// covering the first 'end' bytes of the file, and its sectors are
+// released, so that the next flush compresses it again; the caller
+// writes out the inode; return 0 if successful, otherwise -1 with
+// osErrno set (E_NO_SPACE if the pages would take more blocks than
+// are free)
+static int cluster_load(inode_t *inode, delalloc_t *d, int c, int end) {
+  int first = c * CLUSTER_BLOCKS;
+  int m     = cluster_stored(inode, c);
+  int want  = cluster_used(end, c);
+  int more  = 0;
+
+  for (int i = 0; i < want; i++) {
+    if (d->pages[first + i] == NULL) {
+      more++;
+    }
+  }
+  for (int i = 0; i < m; i++) {
+    if (!block_shared(inode->data[first + i])) {
+      more--;
+    }
+  }
+  if (more > sb.free_blocks - pending_blocks) {
+    dprintf("disk doesn't have %d free blocks for cluster %d\n", more, c);
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+  char *buf = NULL;
+  if (m > 0 && ((buf = malloc(CLUSTER_SIZE)) == NULL || cluster_read(inode, c, buf) < 0)) {
+    free(buf);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  for (int i = 0; i < want; i++) {
+    if (d->pages[first + i] != NULL) {
+      continue;
+    }
+    if ((d->pages[first + i] = calloc(1, BLOCK_SIZE)) == NULL) {
+      free(buf);
+      osErrno = E_GENERAL;
       return(-1);
     }
-    dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+    if (buf != NULL) {
+      memcpy(d->pages[first + i], buf + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    d->npages++;
+    pending_blocks++;
+  }
+  for (int i = 0; i < m; i++) {
+    block_release(inode->data[first + i]);
+    inode->data[first + i] = 0;
   }
+  free(buf);
+  return(0);
+}
 
-  // add the dirent and write to disk
-  int start_entry = group * DIRENTS_PER_SECTOR;
-  offset = parent->size - start_entry;
-  dirent_t *dirent = (dirent_t *)(dirent_buffer + offset * sizeof(dirent_t));
-  strncpy(dirent->fname, file, MAX_NAME);
-  dirent->inode = child_inode;
-  if (Disk_Write(parent->data[group], dirent_buffer) < 0) {
+// compress the pending pages of cluster 'c' of a compressed file (the
+// blocks without one being zeros) and give the result as many blocks
+// as it takes, or write the cluster as it is if that doesn't save a
+// block; the pages are freed; return 0 if successful, otherwise -1
+// with osErrno set
+static int cluster_flush(inode_t *inode, int ino, delalloc_t *d, int c) {
+  int first = c * CLUSTER_BLOCKS;
+  int used  = cluster_used(inode->size, c);
+  int n     = 0;
+
+  for (int i = first; i < first + CLUSTER_BLOCKS && i < MAX_SECTORS_PER_FILE; i++) {
+    if (d->pages[i] != NULL) {
+      n++;
+    }
+  }
+  if (n == 0) {
+    return(0);
+  }
+  char *buf = calloc(1, CLUSTER_SIZE);
+  char *out = malloc(CLUSTER_SIZE);
+  if (buf == NULL || out == NULL) {
+    free(buf);
+    free(out);
+    osErrno = E_GENERAL;
     return(-1);
   }
-  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
-          parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
+  for (int i = 0; i < used; i++) {
+    if (d->pages[first + i] != NULL) {
+      memcpy(buf + i * BLOCK_SIZE, d->pages[first + i], BLOCK_SIZE);
+    }
+  }
 
-  // update parent inode and write to disk
-  parent->size++;
-  if (Disk_Write(inode_sector, inode_buffer) < 0) {
-    return(-1);
+  // only the bytes up to the end of the file are compressed; the
+  // output has to save at least a block
+  int   bytes = inode->size - c * CLUSTER_SIZE;
+  int   len   = (used > 1) ? fs_lz_compress(buf, bytes < used * BLOCK_SIZE ? bytes : used * BLOCK_SIZE,
+                                            out + 2, (used - 1) * BLOCK_SIZE - 2) : -1;
+  char *src   = buf;
+  int   m     = used;
+  if (len >= 0) {
+    out[0] = len & 0xff;
+    out[1] = len >> 8;
+    src    = out;
+    m      = (len + 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
   }
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
+  TRACE(TR_CLUSTER_FLUSH, ino, c, len, m);
+  STAT_ADD(cluster_bytes, used * BLOCK_SIZE);
+  STAT_ADD(cluster_bytes_stored, m * BLOCK_SIZE);
+
+  int ret = 0;
+  for (int i = 0; i < m && ret == 0; ) {
+    int sector, run = block_alloc_run(m - i, &sector);
+    if (run < 0) {
+      osErrno = E_GENERAL;
+      ret = -1;
+      break;
+    }
+    char *bufs[CLUSTER_BLOCKS * MAX_BLOCK_SECTORS];
+    for (int k = 0; k < run * BLOCK_SECTORS; k++) {
+      bufs[k] = src + i * BLOCK_SIZE + k * SECTOR_SIZE;
+    }
+    for (int k = 0; k < run; k++) {
+      inode->data[first + i + k] = sector + k * BLOCK_SECTORS;
+    }
+    if (Disk_WriteV(sector, run * BLOCK_SECTORS, bufs) < 0) {
+      osErrno = E_GENERAL;
+      ret = -1;
+    }
+    i += run;
+  }
+  if (ret < 0) {
+    // the pages stay pending; the blocks given so far go back
+    for (int i = 0; i < m && inode->data[first + i] != 0; i++) {
+      block_release(inode->data[first + i]);
+      inode->data[first + i] = 0;
+    }
+  }else {
+    for (int i = first; i < first + CLUSTER_BLOCKS && i < MAX_SECTORS_PER_FILE; i++) {
+      if (d->pages[i] != NULL) {
+        free(d->pages[i]);
+        d->pages[i] = NULL;
+        d->npages--;
+      }
+    }
+  }
+  free(buf);
+  free(out);
+  return(ret);
+}
 
+// the first sector of an indexed block with the same content as the
+// page, 0 if there's none (a block found by its fingerprint is read
+// back and compared, so a collision never shares different content)
+static int dedup_lookup(char *page) {
+  char         data_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  unsigned int fp = dedup_hash(page);
+
+  for (int b = dedup_head[fp % DEDUP_BUCKETS]; b != 0; b = dedup_next[b]) {
+    if (dedup_fp[b] == fp && block_refs[b] < 0xffff &&
+        sectors_io(0, b * BLOCK_SECTORS, BLOCK_SECTORS, data_buf) == 0 &&
+        memcmp(data_buf, page, BLOCK_SIZE) == 0) {
+      return(b * BLOCK_SECTORS);
+    }
+  }
   return(0);
 }
 
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char *pathname) {
-  int  child_inode;
-  char last_fname[MAX_NAME];
-  int  parent_inode = follow_path(pathname, &child_inode, last_fname);
+// give sectors to all pending blocks of the inode and write them out;
+// each run of consecutive pending blocks gets one contiguous run of
+// blocks (and one pass over the sector bitmap), and is written with a
+// single vectored call; return 0 if successful, otherwise -1 with
+// osErrno set
+static int delalloc_flush(int inode) {
+  delalloc_t *d = delalloc_find(inode, 0);
 
-  if (parent_inode >= 0) {
-    if (child_inode >= 0) {
-      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
-      osErrno = E_CREATE;
+  if (d == NULL) {
+    return(0);
+  }
+  int      inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *child = inode_load(inode, &inode_sector, inode_buffer);
+  if (child == NULL) {
+    osErrno = E_GENERAL; return(-1);
+  }
+  dprintf("... flush %d pending blocks of inode %d\n", d->npages, inode);
+
+  // the pending blocks are about to become real allocations; those of
+  // a compressed file are compressed a cluster at a time first
+  pending_blocks -= d->npages;
+  for (int c = 0; (child->flags & INODE_COMPRESSED) && c * CLUSTER_BLOCKS < BLOCKS_PER_FILE; c++) {
+    if (cluster_flush(child, inode, d, c) < 0) {
+      pending_blocks += d->npages;
+      inode_store(inode_sector, inode_buffer);
       return(-1);
-    }else {
-      if (add_inode(type, parent_inode, last_fname) >= 0) {
-        dprintf("... successfully created file/directory: '%s'\n", pathname);
-        return(0);
-      }else {
-        dprintf("... error: something wrong with adding child inode\n");
-        osErrno = E_CREATE;
-        return(-1);
+    }
+  }
+
+  // on a deduplicating disk, a block already there with the same
+  // content gains a reference instead of the page getting a sector
+  for (int i = 0; dedup_fp != NULL && block_refs != NULL && i < MAX_SECTORS_PER_FILE; i++) {
+    int sector = (d->pages[i] != NULL) ? dedup_lookup(d->pages[i]) : 0;
+    if (sector == 0) {
+      continue;
+    }
+    TRACE(TR_DEDUP_HIT, inode, i, sector);
+    STAT_ADD(dedup_hits, 1);
+    block_refs[sector / BLOCK_SECTORS]++;
+    child->data[i] = sector;
+    free(d->pages[i]);
+    d->pages[i] = NULL;
+    d->npages--;
+  }
+  for (int i = 0; i < MAX_SECTORS_PER_FILE; ) {
+    if (d->pages[i] == NULL) {
+      i++;
+      continue;
+    }
+    int j = i;
+    while (j < MAX_SECTORS_PER_FILE && d->pages[j] != NULL) {
+      j++;
+    }
+    if (inode_alloc_blocks(child, i, j) < 0) {
+      // should not happen since the space was accounted for; keep the
+      // pages still pending so that a later flush can retry
+      pending_blocks += d->npages;
+      inode_store(inode_sector, inode_buffer);
+      return(-1);
+    }
+    TRACE(TR_PAGE_FLUSH, inode, i, child->data[i], j - i);
+    while (i < j) {
+      // the blocks that ended up next to each other on disk (all of
+      // them unless the bitmap is fragmented) go out together
+      int n = 1;
+      while (i + n < j && child->data[i + n] == child->data[i] + n * BLOCK_SECTORS) {
+        n++;
+      }
+      char *bufs[MAX_SECTORS_PER_FILE + MAX_BLOCK_SECTORS];    // a whole file, rounded up to a block
+      for (int k = 0; k < n * BLOCK_SECTORS; k++) {
+        bufs[k] = d->pages[i + k / BLOCK_SECTORS] + k % BLOCK_SECTORS * SECTOR_SIZE;
       }
+      if (Disk_WriteV(child->data[i], n * BLOCK_SECTORS, bufs) < 0) {
+        osErrno = E_GENERAL; return(-1);
+      }
+      for (int k = i; k < i + n; k++) {
+        if (dedup_fp != NULL) {
+          dedup_insert(child->data[k] / BLOCK_SECTORS, dedup_hash(d->pages[k]));
+        }
+        free(d->pages[k]);
+        d->pages[k] = NULL;
+        d->npages--;
+      }
+      i += n;
     }
-  }else {
-    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
-    osErrno = E_CREATE;
-    return(-1);
   }
+  d->inode = 0;
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL; return(-1);
+  }
+  return(0);
 }
 
-// Written by Dario Gonzalez
-// remove the child from parent; the function is called by both
-// File_Unlink() and Dir_Unlink(); the function returns 0 if success,
-// -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode) {
-  //load child node info
-  //first have to find the sector it is in
-  int child_loc        = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-  int child_loc_offset = child_inode % INODES_PER_SECTOR;
-
-  char child_inode_buf[SECTOR_SIZE];
+// flush the pending blocks of every file
+static int delalloc_flush_all() {
+  int ret = 0;
 
-  if (Disk_Read(child_loc, child_inode_buf) < 0) {
-    return(-1);
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (delalloc[i].inode > 0 && delalloc_flush(delalloc[i].inode) < 0) {
+      ret = -1;
+    }
   }
-  inode_t *child = (inode_t *)(child_inode_buf + child_loc_offset * sizeof(inode_t));
-  if (child->type != type) {
-    dprintf("remove_inode: Given type %d, found %d when removing inode\n", child->type, type);
-    return(-3);
+  return(ret);
+}
+
+// drop all pending blocks without writing them (when the file system
+// is booted again)
+static void delalloc_reset() {
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    for (int j = 0; j < MAX_SECTORS_PER_FILE; j++) {
+      free(delalloc[i].pages[j]);
+    }
   }
-  if (child->type == 1) {  //ie the file is a directory
-    if (child->size > 0) { //the directory isn't empty
-      dprintf("remove_inode: Tried to unlink a directory of size %d\n", child->size);
-      return(-2);
+  memset(delalloc, 0, sizeof(delalloc));
+  pending_blocks = 0;
+}
+
+// the state shared by the worker threads of the file system check;
+// the whole inode table is copied into memory first (each worker
+// loading a share of its sectors), and then the directory tree is
+// walked from the root by a pool of workers taking directories from a
+// queue; every inode reached and every block referenced is claimed
+// with an atomic operation, so that a second reference shows up as an
+// error no matter which worker gets there first
+typedef struct _fsck {
+  int             nthreads;
+  inode_t        *inodes;    // copy of the inode table
+  int            *reached;   // number of dirents referencing the inode
+  int            *owner;     // inode referencing each block, -1 if none
+  int            *queue;     // directories waiting to be scanned
+  int             qhead, qtail;
+  int             busy;      // directories being scanned right now
+  int             errors;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} fsck_t;
+
+// the argument of each worker thread
+typedef struct _fsck_worker {
+  fsck_t *fsck;
+  int     id;
+} fsck_worker_t;
+
+// report an inconsistency found by the file system check
+static void fsck_error(fsck_t *fsck, char *fmt, ...) {
+  va_list args;
+
+  __sync_fetch_and_add(&fsck->errors, 1);
+  va_start(args, fmt);
+  printf("fsck: ");
+  vprintf(fmt, args);
+  va_end(args);
+}
+
+// phase 1: copy the inode table sectors assigned to this worker (every
+// nthreads-th sector, starting from the worker's id)
+static void *fsck_load_inodes(void *arg) {
+  fsck_worker_t *w    = (fsck_worker_t *)arg;
+  fsck_t        *fsck = w->fsck;
+  char           buf[SECTOR_SIZE];
+
+  // sectors past the initialized part of the table hold no inodes
+  for (int i = w->id; i < INODE_SECTORS_INIT; i += fsck->nthreads) {
+    if (Disk_Read(inode_table_sector(i), buf) < 0) {
+      fsck_error(fsck, "can't read inode table sector %d\n", inode_table_sector(i));
+      continue;
     }
-  }else{
-    if (child->size > 0) {
-      dprintf("remove_inode: tried to remove a file that still claimed blocks\n");
-      return(-1); //the file to be deleted still claims blocks
+    for (int j = 0; j < INODES_PER_SECTOR && i * INODES_PER_SECTOR + j < INODE_COUNT; j++) {
+      memcpy(&fsck->inodes[i * INODES_PER_SECTOR + j], buf + j * sizeof(inode_t), sizeof(inode_t));
     }
   }
+  return(NULL);
+}
 
+// check the inode (just reached from a dirent) and claim the blocks
+// it refers to; return 1 if it's a directory to be scanned
+static int fsck_claim_inode(fsck_t *fsck, int inode) {
+  inode_t *node = &fsck->inodes[inode];
+  int      nblocks;
 
-  int parent_loc        = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-  int parent_loc_offset = parent_inode % INODES_PER_SECTOR;
-
-  //for now create a new buffer to store the parent_inode
-  char parent_inode_buf[SECTOR_SIZE];
-  //load parent_inode info
-  if (Disk_Read(parent_loc, parent_inode_buf) < 0) {
-    return(-1);
+  if (node->type == 0) {
+    if (node->size < 0 || node->size > MAX_FILE_SIZE) {
+      fsck_error(fsck, "file inode %d has bad size %d\n", inode, node->size);
+      return(0);
+    }
+    nblocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  }else if (node->type == 1) {
+    if (node->size < 0 || node->size > BLOCKS_PER_FILE * BLOCK_SECTORS * DIRENTS_PER_SECTOR) {
+      fsck_error(fsck, "directory inode %d has bad size %d\n", inode, node->size);
+      return(0);
+    }
+    int groups = (node->size + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR;
+    nblocks = (groups + BLOCK_SECTORS - 1) / BLOCK_SECTORS;
+  }else {
+    fsck_error(fsck, "inode %d has bad type %d\n", inode, node->type);
+    return(0);
   }
-  inode_t *parent = (inode_t *)(parent_inode_buf + parent_loc_offset * sizeof(inode_t));
-  if (parent->type != 1) { //ie the parent isn't a directory
-    dprintf("remove_inode: Tried to unlink from a file with type %d \n", parent->type);
-    return(-3);
+  if ((node->flags & ~INODE_COMPRESSED) != 0 || (node->type == 1 && node->flags != 0)) {
+    fsck_error(fsck, "inode %d has bad flags %d\n", inode, node->flags);
+  }
+  if (node->type == 1 && node->links != 0) {
+    fsck_error(fsck, "directory inode %d has %d links\n", inode, node->links);
   }
 
-  //now we need to find the child inode among the dirents and zero it
-  int found              = 0;
-  int full_dirent_secs   = parent->size / DIRENTS_PER_SECTOR;
-  int partial_dirent_sec = sgn(parent->size - full_dirent_secs * DIRENTS_PER_SECTOR); //ie either 0 or 1
+  // every block of a directory needs a sector; files may have holes
+  // (blocks without one) and sectors reserved past their size
+  int ok = 1;
+  for (int i = 0; i < MAX_SECTORS_PER_FILE; i++) {
+    int sector = node->data[i];
+    if (sector == 0) {
+      if (node->type == 1 && i < nblocks) {
+        fsck_error(fsck, "inode %d has no sector for block %d\n", inode, i);
+        ok = 0;
+      }
+      continue;
+    }
+    // a block has to start at a block boundary in the data blocks
+    int block = sector / BLOCK_SECTORS;
+    if (sector % BLOCK_SECTORS != 0 || block < DATABLOCK_START_BLOCK || block >= TOTAL_BLOCKS ||
+        i >= BLOCKS_PER_FILE) {
+      fsck_error(fsck, "inode %d block %d refers to bad sector %d\n", inode, i, sector);
+      ok = 0;
+      continue;
+    }
+    if (node->type == 1 && i >= nblocks) {
+      continue;     // stale dirent blocks are never used again
+    }
+    // (cloned files share blocks; their reference counts are checked
+    // later on)
+    int prev = __sync_val_compare_and_swap(&fsck->owner[block], -1, inode);
+    if (prev != -1 && !sb.shared) {
+      fsck_error(fsck, "sector %d is used by both inode %d and inode %d\n", sector, prev, inode);
+    }
+  }
+  return(node->type == 1 && ok);
+}
 
-  char dirent_buf[SECTOR_SIZE];
-  //search all full dirent sectors
-  dprintf("remove_inode: searching full dirent sectors...\n");
-  for (int dir_sec = 0; dir_sec < full_dirent_secs; dir_sec++) {
-    if (!found) {
-      break; //might be extraneous
+// add a directory to the queue of the workers
+static void fsck_enqueue(fsck_t *fsck, int inode) {
+  pthread_mutex_lock(&fsck->lock);
+  fsck->queue[fsck->qtail++] = inode;
+  pthread_cond_signal(&fsck->cond);
+  pthread_mutex_unlock(&fsck->lock);
+}
+
+// check all dirents of a directory and claim the inodes they refer to
+static void fsck_scan_dir(fsck_t *fsck, int dir) {
+  inode_t *node = &fsck->inodes[dir];
+  char     buf[SECTOR_SIZE];
+
+  for (int i = 0; i < node->size; i++) {
+    int sector = inode_data_sector(node, i / DIRENTS_PER_SECTOR);
+    if (i % DIRENTS_PER_SECTOR == 0 && Disk_Read(sector, buf) < 0) {
+      fsck_error(fsck, "can't read dirent sector %d of directory inode %d\n", sector, dir);
+      return;
     }
-    if (Disk_Read(parent->data[dir_sec], dirent_buf) < 0) {
-      return(-1);
+    dirent_t *dirent = (dirent_t *)buf + i % DIRENTS_PER_SECTOR;
+    if (dirent->fname[0] == '\0') {
+      continue;     // removed entry
     }
-    int dir = 0;
-    for (dirent_t *cur_dir_ent = (dirent_t *)dirent_buf; dir < DIRENTS_PER_SECTOR; dir++, cur_dir_ent++) {
-      if (cur_dir_ent->inode == child_inode) {         //we found it!
-        dprintf("remove_inode: found inode at dir %d in sector %d, the parent's %d data sector\n", dir, parent->data[dir_sec], dir_sec);
-        memset(cur_dir_ent, 0, sizeof *cur_dir_ent);   //zero-out the dir entry
-        found = parent->data[dir_sec];
-        break;
+    if (memchr(dirent->fname, '\0', MAX_NAME) == NULL || illegal_filename(dirent->fname)) {
+      fsck_error(fsck, "directory inode %d entry %d has an illegal name\n", dir, i);
+      continue;
+    }
+    int child = dirent->inode;
+    if (child <= 0 || child >= INODE_COUNT || child / INODES_PER_SECTOR >= INODE_SECTORS_INIT) {
+      fsck_error(fsck, "directory inode %d entry '%s' refers to bad inode %d\n",
+                 dir, dirent->fname, child);
+      continue;
+    }
+    // a file with links is reached once for each of its dirents (and
+    // checked against its link count later on)
+    if (__sync_add_and_fetch(&fsck->reached[child], 1) > 1) {
+      if (fsck->inodes[child].type != 0) {
+        fsck_error(fsck, "inode %d ('%s' in directory inode %d) is referenced more than once\n",
+                   child, dirent->fname, dir);
       }
+      continue;
+    }
+    if (fsck_claim_inode(fsck, child)) {
+      fsck_enqueue(fsck, child);
     }
   }
-  //check the last data sector
+}
 
-  dprintf("remove_inode: searching last dirent sectors...\n");
-  if (!found && partial_dirent_sec) {
-    if (Disk_Read(parent->data[full_dirent_secs], dirent_buf) < 0) {
+// phase 2: take directories off the queue until the queue is empty
+// and no other worker can add to it anymore
+static void *fsck_walk_dirs(void *arg) {
+  fsck_t *fsck = ((fsck_worker_t *)arg)->fsck;
+
+  pthread_mutex_lock(&fsck->lock);
+  for (;;) {
+    while (fsck->qhead == fsck->qtail && fsck->busy > 0) {
+      pthread_cond_wait(&fsck->cond, &fsck->lock);
+    }
+    if (fsck->qhead == fsck->qtail) {
+      break;
+    }
+    int dir = fsck->queue[fsck->qhead++];
+    fsck->busy++;
+    pthread_mutex_unlock(&fsck->lock);
+
+    fsck_scan_dir(fsck, dir);
+
+    pthread_mutex_lock(&fsck->lock);
+    fsck->busy--;
+    if (fsck->busy == 0) {
+      pthread_cond_broadcast(&fsck->cond);
+    }
+  }
+  pthread_mutex_unlock(&fsck->lock);
+  return(NULL);
+}
+
+// run 'func' on 'nthreads' threads and wait for all of them
+static void fsck_run(fsck_t *fsck, void *(*func)(void *)) {
+  pthread_t     threads[fsck->nthreads];
+  fsck_worker_t workers[fsck->nthreads];
+
+  for (int i = 0; i < fsck->nthreads; i++) {
+    workers[i].fsck = fsck;
+    workers[i].id   = i;
+    if (pthread_create(&threads[i], NULL, func, &workers[i]) != 0) {
+      func(&workers[i]);      // run it here instead
+      threads[i] = 0;
+    }
+  }
+  for (int i = 0; i < fsck->nthreads; i++) {
+    if (threads[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+// compare the bitmap with 'num' sectors starting from 'start' sector
+// with the one rebuilt in 'rebuilt' over the first 'nbits' bits;
+// report and count bits set but not used (leaked) and bits used but
+// not set (lost); the rebuilt bitmap is written to disk if 'repair'
+static int fsck_bitmap(fsck_t *fsck, char *name, int start, int num, int nbits,
+                       unsigned char *rebuilt, int repair) {
+  unsigned char buf[SECTOR_SIZE];
+  int           leaked = 0, lost = 0;
+
+  for (int i = 0; i < num; i++) {
+    if (Disk_Read(start + i, (char *)buf) < 0) {
+      fsck_error(fsck, "can't read %s bitmap sector %d\n", name, start + i);
       return(-1);
     }
-    int dir = 0;
-    for (dirent_t *cur_dir_ent = (dirent_t *)dirent_buf; dir < parent->size % DIRENTS_PER_SECTOR; dir++, cur_dir_ent++) {
-      if (cur_dir_ent->inode == child_inode) {         //we found it!
-        dprintf("remove_inode: found inode at dir %d in sector %d, the parent's %d data sector\n", dir, parent->data[full_dirent_secs], full_dirent_secs);
+    for (int pos = i * SECTOR_SIZE * 8; pos < (i + 1) * SECTOR_SIZE * 8 && pos < nbits; pos++) {
+      int mask = 0x80 >> (pos % 8);
+      int ondisk = (buf[pos / 8 % SECTOR_SIZE] & mask) != 0;
+      int used   = (rebuilt[pos / 8] & mask) != 0;
+      if (ondisk && !used) {
+        leaked++;
+      }else if (!ondisk && used) {
+        lost++;
+      }
+    }
+    if (repair && Disk_Write(start + i, (char *)rebuilt + i * SECTOR_SIZE) < 0) {
+      fsck_error(fsck, "can't write %s bitmap sector %d\n", name, start + i);
+      return(-1);
+    }
+  }
+  if (leaked > 0 || lost > 0) {
+    fsck_error(fsck, "%s bitmap: %d leaked, %d in use but marked free%s\n",
+               name, leaked, lost, repair ? " (rebuilt)" : "");
+  }
+  return(leaked + lost);
+}
 
-        memset(cur_dir_ent, 0, sizeof *cur_dir_ent);   //zero-out the dir entry
-        found = parent->data[full_dirent_secs];
-        break;
+// the blocks of the snapshots are in use too, though not reached from
+// the root: their maps, their copies of inode table sectors, and the
+// blocks their inodes refer to that the live file system doesn't
+// anymore; they are claimed for a made-up inode (MAX_INODES), and the
+// reference counts kept in memory are checked against a fresh count
+static void fsck_refs(fsck_t *fsck, int repair) {
+  unsigned short *refs = malloc(TOTAL_BLOCKS * sizeof(unsigned short));
+
+  if (refs == NULL || refs_count(refs) < 0) {
+    fsck_error(fsck, "can't count the references to the blocks\n");
+    free(refs);
+    return;
+  }
+  for (int i = DATABLOCK_START_BLOCK; i < TOTAL_BLOCKS; i++) {
+    if (refs[i] > 0 && fsck->owner[i] == -1) {
+      fsck->owner[i] = MAX_INODES;
+    }
+    if (block_refs != NULL && block_refs[i] != refs[i]) {
+      fsck_error(fsck, "block %d has %d references, not %d%s\n",
+                 i, block_refs[i], refs[i], repair ? " (fixed)" : "");
+      if (repair) {
+        block_refs[i] = refs[i];
       }
     }
   }
+  free(refs);
+}
 
-  if (!found) {
+// set the link count of file inode 'inode' to the dirents found
+static int fsck_fix_links(int inode, int links) {
+  int      inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *node = inode_load(inode, &inode_sector, inode_buffer);
+
+  if (node == NULL) {
     return(-1);
   }
+  node->links = (links < INODE_MAX_LINKS) ? links : INODE_MAX_LINKS;
+  return(inode_store(inode_sector, inode_buffer));
+}
 
-  //All this does is zero out that entry, but the size of the directory
-  //never changes, so we get horrible fragmentation
-  //TODO figure out a better way of dealing with this
-  //maybe always run through dirents backwards, and for each one that is all 0
-  //decrement the size of the directory. This has the benefit that directories
-  //aren't permanent, but for example if you add 1000 directories and delete
-  //all but the last one, that directory still occupies tons of space.
+// check the file system with the workers of 'fsck' and rebuild the
+// bitmaps (written to disk only if 'repair'); return 0 if the check
+// could be completed (whether or not there were errors), -1 if not
+static int fsck_check(fsck_t *fsck, int repair, FS_Check_t *result) {
+  for (int i = 0; i < TOTAL_BLOCKS; i++) {
+    fsck->owner[i] = -1;
+  }
 
-  //set the child's inode to free
-  bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
+  fsck_run(fsck, fsck_load_inodes);
+  if (fsck->errors > 0) {
+    return(-1);
+  }
+
+  // the blocks of the chunks of the inode table are taken before any
+  // inode can claim them
+  for (int i = 0; i < sb.inode_nchunks * INODE_CHUNK_SECTORS; i += BLOCK_SECTORS) {
+    fsck->owner[(sb.inode_chunks[i / INODE_CHUNK_SECTORS] + i % INODE_CHUNK_SECTORS) / BLOCK_SECTORS] = MAX_INODES;
+  }
+
+  fsck->reached[0] = 1;
+  if (fsck->inodes[0].type != 1) {
+    fsck_error(fsck, "root inode is not a directory\n");
+    return(-1);
+  }
+  if (fsck_claim_inode(fsck, 0)) {
+    fsck->queue[fsck->qtail++] = 0;
+  }
+  fsck_run(fsck, fsck_walk_dirs);
+  if (block_refs != NULL) {
+    fsck_refs(fsck, repair);
+  }
+  for (int i = 1; i < INODE_COUNT; i++) {
+    if (fsck->reached[i] > 0 && fsck->inodes[i].type == 0 &&
+        fsck->reached[i] != fsck->inodes[i].links + 1) {
+      fsck_error(fsck, "file inode %d has %d dirents but %d links%s\n", i, fsck->reached[i],
+                 fsck->inodes[i].links + 1, repair ? " (fixed)" : "");
+      if (repair && fsck_fix_links(i, fsck->reached[i] - 1) < 0) {
+        return(-1);
+      }
+    }
+  }
 
-  //write out zeroed dirent to corresponding parent data sector
-  if (Disk_Write(found, dirent_buf) < 0) {
+  // rebuild both bitmaps from what has been reached
+  unsigned char inode_bits[INODE_BITMAP_SECTORS * SECTOR_SIZE];
+  unsigned char sector_bits[SECTOR_BITMAP_SECTORS * SECTOR_SIZE];
+  memset(inode_bits, 0, sizeof(inode_bits));
+  memset(sector_bits, 0, sizeof(sector_bits));
+  for (int i = 0; i < INODE_COUNT; i++) {
+    if (fsck->reached[i]) {
+      inode_bits[i / 8] |= 0x80 >> (i % 8);
+      result->inodes_used++;
+    }
+  }
+  for (int i = 0; i < TOTAL_BLOCKS; i++) {
+    if (i < DATABLOCK_START_BLOCK || fsck->owner[i] >= 0) {
+      sector_bits[i / 8] |= 0x80 >> (i % 8);
+    }
+    if (fsck->owner[i] >= 0) {
+      result->blocks_used++;
+    }
+  }
+  // the bitmaps and counters of a snapshot are those of the live file
+  // system, which has moved on since
+  if (read_only) {
+    return(0);
+  }
+  result->inode_bits_fixed  = fsck_bitmap(fsck, "inode", INODE_BITMAP_START_SECTOR,
+                                          INODE_BITMAP_SECTORS, INODE_COUNT, inode_bits, repair);
+  result->sector_bits_fixed = fsck_bitmap(fsck, "sector", SECTOR_BITMAP_START_SECTOR,
+                                          SECTOR_BITMAP_USED, TOTAL_BLOCKS, sector_bits, repair);
+  if (result->inode_bits_fixed < 0 || result->sector_bits_fixed < 0) {
     return(-1);
   }
+
+  // and the counters in the superblock along with them
+  int free_inodes = INODE_COUNT - result->inodes_used;
+  int free_blocks = TOTAL_BLOCKS - DATABLOCK_START_BLOCK - result->blocks_used;
+  if (sb.free_inodes != free_inodes || sb.free_blocks != free_blocks) {
+    fsck_error(fsck, "superblock counts %d free inodes and %d free blocks, not %d and %d%s\n",
+               sb.free_inodes, sb.free_blocks, free_inodes, free_blocks,
+               repair ? " (fixed)" : "");
+  }
+  if (repair) {
+    sb.free_inodes = free_inodes;
+    sb.free_blocks = free_blocks;
+    // blocks freed by the repair leave the fingerprint index
+    for (int i = 0; dedup_fp != NULL && i < TOTAL_BLOCKS; i++) {
+      if (fsck->owner[i] < 0) {
+        dedup_remove(i);
+      }
+    }
+  }
   return(0);
 }
 
-// representing an open file
-typedef struct _open_file {
-  int inode;     // pointing to the inode of the file (0 means entry not used)
-  int size;      // file size cached here for convenience
-  int pos;       // read/write position
-} open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
+#if FSTRACE
+// the file the trace ring is dumped into at exit (FSTRACE_FILE)
+static char trace_filename[1024];
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode) {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (open_files[i].inode == inode) {
-      return(1);
+static void trace_dump_at_exit() {
+  FS_TraceDump(trace_filename);
+}
+#endif
+
+// let the environment turn tracing on for programs that don't call
+// FS_TraceMask() themselves: FSTRACE_MASK holds the mask of event
+// classes (as in LibFSTrace.h), and FSTRACE_FILE the file the ring is
+// dumped into when the program exits
+static void trace_from_env() {
+#if FSTRACE
+  char *mask = getenv("FSTRACE_MASK");
+  char *file = getenv("FSTRACE_FILE");
+
+  if (mask != NULL) {
+    trace_mask = strtol(mask, NULL, 0);
+  }
+  if (file != NULL && trace_filename[0] == '\0') {
+    strncpy(trace_filename, file, sizeof(trace_filename) - 1);
+    atexit(trace_dump_at_exit);
+  }
+#endif
+}
+
+// the file the statistics are dumped into at exit (FSSTATS_FILE)
+static char stats_filename[1024];
+
+static char *stats_op_names[FS_NUM_OPS] = {
+  "FS_Boot", "FS_Sync", "FS_StatFS", "FS_Check", "FS_Clean", "FS_Snapshot",
+  "FS_Defrag",
+  "File_Create", "File_Open", "File_Read", "File_Write", "File_Reserve",
+  "File_Seek", "File_Flush", "File_Close", "File_Unlink", "File_Extents",
+  "File_Clone", "File_Compress", "Dir_Create", "Dir_Unlink", "Dir_Size",
+  "Dir_Read", "Dir_OpenHandle", "Dir_CloseHandle", "File_CreateAt", "File_OpenAt",
+  "File_UnlinkAt", "Dir_CreateAt", "File_Rename", "File_Link", "FS_Walk",
+  "FS_TraceMask", "FS_TraceDump", "FS_GetStats", "FS_DumpStats", "FS_AioStart",
+  "FS_AioSubmit", "FS_AioWait", "FS_AioFd", "FS_AioStop",
+};
+
+// the current CLOCK_MONOTONIC time in nanoseconds
+static uint64_t stats_clock() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+// account for a call of 'op' started at 'start' that returned 'ret'
+// (negative means it failed), and pass 'ret' on; the latency goes
+// into bucket floor(log2(ns)) of the histogram
+static int stats_count(int op, uint64_t start, int ret) {
+  uint64_t      ns = stats_clock() - start;
+  FS_OpStats_t *s  = &stats.op[op];
+  int           b  = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+
+  if (b >= FS_STATS_BUCKETS) {
+    b = FS_STATS_BUCKETS - 1;
+  }
+  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->hist[b], 1, __ATOMIC_RELAXED);
+  if (ret < 0) {
+    __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  }
+  return(ret);
+}
+
+static void stats_dump_at_exit() {
+  FS_DumpStats(stats_filename);
+}
+
+// the calls of the library run one at a time, under this lock; the
+// result of a locked call is passed through api_unlock()
+static pthread_mutex_t api_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void api_lock() {
+  pthread_mutex_lock(&api_mutex);
+}
+
+static int api_unlock(int ret) {
+  pthread_mutex_unlock(&api_mutex);
+  return(ret);
+}
+
+#define LOCKED(call)    (api_lock(), api_unlock(call))
+
+// set up the snapshots once the superblock is loaded: their maps are
+// read and, if there are any, the references to each block counted;
+// booting snapshot 'name' (unless NULL) puts its view of the inode
+// table in place of the live one instead (in memory only, the image
+// being never saved back) and makes the file system read-only; return
+// 0 if successful, -1 if not
+static int snap_boot(char *name) {
+  char buf[SECTOR_SIZE];
+
+  free(block_refs);
+  block_refs = NULL;
+  read_only  = 0;
+  if (dedup_load() < 0) {
+    return(-1);
+  }
+  for (int s = 0; s < sb.nsnapshots; s++) {
+    snapshot_t *snap = &sb.snapshots[s];
+    if (snap->map < DATABLOCK_START_SECTOR || snap->map >= TOTAL_SECTORS ||
+        snap->table_init < 1 || snap->table_init > INODE_TABLE_SECTORS ||
+        Disk_Read(snap->map, buf) < 0) {
+      return(-1);
     }
+    memcpy(snap_maps[s], buf, sizeof(snap_maps[s]));
   }
-  return(0);
-}
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd() {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (open_files[i].inode <= 0) {
-      return(i);
+  if (name != NULL) {
+    int s = 0;
+    while (s < sb.nsnapshots && strcmp(sb.snapshots[s].name, name) != 0) {
+      s++;
+    }
+    if (s == sb.nsnapshots) {
+      dprintf("... no snapshot '%s'\n", name);
+      return(-1);
     }
+    // the sectors initialized since hold no inodes of the snapshot
+    for (int i = 0; i < sb.inode_table_init; i++) {
+      if (i < sb.snapshots[s].table_init && snap_maps[s][i] == 0) {
+        continue;
+      }
+      if (i < sb.snapshots[s].table_init) {
+        if (Disk_Read(snap_maps[s][i], buf) < 0) {
+          return(-1);
+        }
+      }else {
+        memset(buf, 0, SECTOR_SIZE);
+      }
+      if (Disk_Write(INODE_TABLE_START_SECTOR + i, buf) < 0) {
+        return(-1);
+      }
+    }
+    sb.inode_table_init = sb.snapshots[s].table_init;
+    read_only = 1;
+    dprintf("... booted snapshot '%s' read-only\n", name);
+    return(0);
   }
-  return(-1);
+
+  if (sb.nsnapshots > 0 || sb.shared) {
+    return(refs_init());
+  }
+  return(0);
 }
 
 /* end of internal helper functions, start of API functions */
 
-int FS_Boot(char *backstore_fname) {
+static int fs_boot(char *backstore_fname) {
   dprintf("FS_Boot('%s'):\n", backstore_fname);
+  trace_from_env();
+  if (getenv("FSSTATS_FILE") != NULL && stats_filename[0] == '\0') {
+    strncpy(stats_filename, getenv("FSSTATS_FILE"), sizeof(stats_filename) - 1);
+    atexit(stats_dump_at_exit);
+  }
+  // a "unix:SOCKET" path is a file system served by fs-server; all
+  // further calls become requests on the socket
+  if (FS_NET_PATH(backstore_fname)) {
+    return(fs_net_connect(backstore_fname + strlen(FS_NET_PREFIX)));
+  }
   // initialize a new disk (this is a simulated disk)
   if (Disk_Init() < 0) {
     dprintf("... disk init failed\n");
@@ -677,20 +2706,51 @@ int FS_Boot(char *backstore_fname) {
   strncpy(bs_filename, backstore_fname, 1024);
   bs_filename[1023] = '\0';       // for safety
 
+  // "DISK@NAME" is snapshot NAME of the disk in file DISK
+  char *snapshot = strrchr(bs_filename, '@');
+  if (snapshot != NULL) {
+    *snapshot++ = '\0';
+  }
+
   // we first try to load disk from this file
   if (Disk_Load(bs_filename) < 0) {
     dprintf("... load disk from file '%s' failed\n", bs_filename);
 
     // if we can't open the file; it means the file does not exist, we
     // need to create a new file system on disk
-    if (diskErrno == E_OPENING_FILE) {
+    if (diskErrno == E_OPENING_FILE && snapshot == NULL) {
       dprintf("... couldn't open file, create new file system\n");
 
-      // format superblock
+      // the block size may be chosen with the FSBLOCK_SIZE environment
+      // variable (512, 1024, 2048, 4096 or 8192 bytes); it's one
+      // sector by default
+      char *env      = getenv("FSBLOCK_SIZE");
+      int   size     = env ? atoi(env) : SECTOR_SIZE;
+      int   nsectors = size / SECTOR_SIZE;
+      if (size != nsectors * SECTOR_SIZE || nsectors < 1 || nsectors > MAX_BLOCK_SECTORS ||
+          (nsectors & (nsectors - 1)) != 0) {
+        dprintf("... bad block size %d\n", size);
+        osErrno = E_GENERAL;
+        return(-1);
+      }
+
+      // format superblock (everything but the root inode and the
+      // blocks before the data blocks is free)
       char buf[SECTOR_SIZE];
-      memset(buf, 0, SECTOR_SIZE);
-      *(int *)buf = OS_MAGIC;
-      if (Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+      memset(&sb, 0, sizeof(superblock_t));
+      sb.magic         = OS_MAGIC;
+      sb.version       = OS_VERSION;
+      sb.block_sectors = nsectors;
+      sb.free_inodes   = MAX_FILES - 1;
+      sb.free_blocks   = TOTAL_BLOCKS - DATABLOCK_START_BLOCK;
+      sb.inode_table_init = 1;
+      // FSLOG=1 makes it log-structured, the log starting from the
+      // first data block
+      env = getenv("FSLOG");
+      if (env != NULL && atoi(env) != 0) {
+        sb.log_head = DATABLOCK_START_BLOCK;
+      }
+      if (sb_store() < 0) {
         dprintf("... failed to format superblock\n");
         osErrno = E_GENERAL;
         return(-1);
@@ -702,29 +2762,51 @@ int FS_Boot(char *backstore_fname) {
       dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
               (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
 
-      // format sector bitmap (reserve the first few sectors to
+      // format sector bitmap (reserve the first few blocks to
       // superblock, inode bitmap, sector bitmap, and inode table)
       bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-                  DATABLOCK_START_SECTOR);
+                  DATABLOCK_START_BLOCK);
       dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
               (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
 
-      // format inode tables
-      for (int i = 0; i < INODE_TABLE_SECTORS; i++) {
+      // FSDEDUP=1 makes it deduplicating, the fingerprint index (all
+      // zeros) taking the first data blocks; files may then share
+      // blocks from the start
+      env = getenv("FSDEDUP");
+      if (env != NULL && atoi(env) != 0) {
+        int first;
         memset(buf, 0, SECTOR_SIZE);
-        if (i == 0) {
-          // the first inode table entry is the root directory
-          ((inode_t *)buf)->size = 0;
-          ((inode_t *)buf)->type = 1;
+        if (block_alloc_run(DEDUP_INDEX_BLOCKS, &first) != DEDUP_INDEX_BLOCKS) {
+          osErrno = E_GENERAL;
+          return(-1);
+        }
+        for (int i = 0; i < DEDUP_INDEX_BLOCKS * BLOCK_SECTORS; i++) {
+          if (Disk_Write(first + i, buf) < 0) {
+            osErrno = E_GENERAL;
+            return(-1);
+          }
         }
-        if (Disk_Write(INODE_TABLE_START_SECTOR + i, buf) < 0) {
-          dprintf("... failed to format inode table\n");
+        sb.dedup_index = first;
+        sb.shared      = 1;
+        if (sb_store() < 0) {
           osErrno = E_GENERAL;
           return(-1);
         }
       }
-      dprintf("... formatted inode table (start=%d, num=%d)\n",
-              (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+
+      // format the inode table; only the sector with the root inode
+      // is written now, the rest is initialized as inodes get
+      // allocated (see inode_table_extend())
+      memset(buf, 0, SECTOR_SIZE);
+      ((inode_t *)buf)->size = 0;
+      ((inode_t *)buf)->type = 1;
+      if (Disk_Write(INODE_TABLE_START_SECTOR, buf) < 0) {
+        dprintf("... failed to format inode table\n");
+        osErrno = E_GENERAL;
+        return(-1);
+      }
+      dprintf("... formatted inode table (start=%d, num=%d, initialized=%d)\n",
+              (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS, sb.inode_table_init);
 
       // we need to synchronize the disk to the backstore file (so
       // that we don't lose the formatted disk)
@@ -736,7 +2818,11 @@ int FS_Boot(char *backstore_fname) {
       }else {
         // everything's good now, boot is successful
         dprintf("... successfully formatted disk, boot successful\n");
+        TRACE(TR_BOOT, 1);
+        snap_boot(NULL);
         memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
+        memset(dir_handles, 0, MAX_DIR_HANDLES * sizeof(dir_handle_t));
+        delalloc_reset();
         return(0);
       }
     }else {
@@ -765,14 +2851,17 @@ int FS_Boot(char *backstore_fname) {
     }
     dprintf("... check size of file '%s' successful\n", bs_filename);
 
-    // check magic
-    if (check_magic()) {
+    // check magic, load the free counters and set up the snapshots
+    if (sb_load() == 0 && snap_boot(snapshot) == 0) {
       // everything's good by now, boot is successful
       dprintf("... check magic successful\n");
+      TRACE(TR_BOOT, 0);
       memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
+      memset(dir_handles, 0, MAX_DIR_HANDLES * sizeof(dir_handle_t));
+      delalloc_reset();
       return(0);
     }else {
-      // mismatched magic number
+      // mismatched magic number (or no such snapshot)
       dprintf("... check magic failed, boot failed\n");
       osErrno = E_GENERAL;
       return(-1);
@@ -780,8 +2869,13 @@ int FS_Boot(char *backstore_fname) {
   }
 }
 
-int FS_Sync() {
-  if (Disk_Save(bs_filename) < 0) {
+static int fs_sync() {
+  TRACE(TR_SYNC, pending_blocks);
+  if (read_only) {
+    return(0);      // a snapshot never changes
+  }
+  if (delalloc_flush_all() < 0 || dedup_store() < 0 || sb_store() < 0 ||
+      Disk_Save(bs_filename) < 0) {
     // if can't write to file, something's wrong with the backstore
     dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
     osErrno = E_GENERAL;
@@ -793,9 +2887,568 @@ int FS_Sync() {
   }
 }
 
-int File_Create(char *file) {
+static int fs_trace_mask(int mask) {
+#if FSTRACE
+  int old = trace_mask;
+  if (mask >= 0) {
+    trace_mask = mask;
+  }
+  return(old);
+#else
+  // the trace points have been compiled out
+  osErrno = E_GENERAL;
+  return(-1);
+#endif
+}
+
+int FS_TraceMask(int mask) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_TRACE_MASK, start, fs_trace_mask(mask)));
+}
+
+static int fs_trace_dump(char *file) {
+#if FSTRACE
+  FILE          *f;
+  fs_trace_hdr_t hdr;
+
+  if (file == NULL || (f = fopen(file, "w")) == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  hdr.magic     = FS_TRACE_MAGIC;
+  hdr.ring_size = FS_TRACE_RING_SIZE;
+  hdr.head      = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+  hdr.mask      = trace_mask;
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(trace_ring, sizeof(fs_trace_rec_t), FS_TRACE_RING_SIZE, f) != FS_TRACE_RING_SIZE) {
+    fclose(f);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  fclose(f);
+  return(0);
+#else
+  osErrno = E_GENERAL;
+  return(-1);
+#endif
+}
+
+int FS_TraceDump(char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_TRACE_DUMP, start, fs_trace_dump(file)));
+}
+
+// a snapshot of the statistics of this process; counters bumped
+// concurrently may be off by a call
+static void stats_snapshot(FS_Stats_t *buf) {
+  memcpy(buf, &stats, sizeof(FS_Stats_t));
+  for (int i = 0; i < FS_NUM_OPS; i++) {
+    strncpy(buf->op[i].name, stats_op_names[i], sizeof(buf->op[i].name) - 1);
+  }
+}
+
+static int fs_get_stats(FS_Stats_t *buf) {
+  if (buf == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (fs_net_fd >= 0) {
+    return(LOCKED(fs_net_call(FS_NET_GET_STATS, 0, 0, NULL, NULL, 0, buf, sizeof(FS_Stats_t))));
+  }
+  stats_snapshot(buf);
+  return(0);
+}
+
+int FS_GetStats(FS_Stats_t *buf) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_GET_STATS, start, fs_get_stats(buf)));
+}
+
+static int fs_dump_stats(char *file) {
+  FS_Stats_t buf;
+  FILE      *f;
+
+  if (file == NULL || (f = fopen(file, "w")) == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  stats_snapshot(&buf);
+  if (fwrite(&buf, sizeof(FS_Stats_t), 1, f) != 1) {
+    fclose(f);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  fclose(f);
+  return(0);
+}
+
+int FS_DumpStats(char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DUMP_STATS, start, fs_dump_stats(file)));
+}
+
+static int fs_statfs(FS_StatFS_t *stat) {
+  if (stat == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  stat->total_inodes = INODE_COUNT;
+  stat->free_inodes  = sb.free_inodes;
+  stat->total_blocks = TOTAL_BLOCKS - DATABLOCK_START_BLOCK;
+  stat->free_blocks  = sb.free_blocks - pending_blocks;
+  stat->block_size   = BLOCK_SIZE;
+
+  // every reference to a block past the first is a block saved
+  stat->saved_blocks = 0;
+  for (int i = DATABLOCK_START_BLOCK; block_refs != NULL && i < TOTAL_BLOCKS; i++) {
+    if (block_refs[i] > 1) {
+      stat->saved_blocks += block_refs[i] - 1;
+    }
+  }
+  return(0);
+}
+
+static int fs_check(int repair, int nthreads, FS_Check_t *result) {
+  dprintf("FS_Check(%d, %d):\n", repair, nthreads);
+  if (result == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  memset(result, 0, sizeof(FS_Check_t));
+  if (repair && !fs_writable()) {
+    return(-1);
+  }
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads <= 0) {
+    nthreads = 1;
+  }
+
+  // pending blocks have to be on disk for the bitmaps to be right
+  if (delalloc_flush_all() < 0) {
+    return(-1);
+  }
+
+  fsck_t fsck;
+  memset(&fsck, 0, sizeof(fsck_t));
+  fsck.nthreads = nthreads;
+  fsck.inodes   = calloc(INODE_COUNT, sizeof(inode_t));
+  fsck.reached  = calloc(INODE_COUNT, sizeof(int));
+  fsck.owner    = malloc(TOTAL_BLOCKS * sizeof(int));
+  fsck.queue    = malloc(INODE_COUNT * sizeof(int));
+  pthread_mutex_init(&fsck.lock, NULL);
+  pthread_cond_init(&fsck.cond, NULL);
+
+  int ret = -1;
+  if (fsck.inodes && fsck.reached && fsck.owner && fsck.queue) {
+    ret = fsck_check(&fsck, repair, result);
+  }
+  result->errors = fsck.errors;
+  if (ret < 0) {
+    osErrno = E_GENERAL;
+  }
+
+  pthread_mutex_destroy(&fsck.lock);
+  pthread_cond_destroy(&fsck.cond);
+  free(fsck.inodes);
+  free(fsck.reached);
+  free(fsck.owner);
+  free(fsck.queue);
+  return(ret);
+}
+
+// the owner of each data block of a log-structured disk, as inode *
+// MAX_SECTORS_PER_FILE + block number in the inode, -1 if none (leaked
+// blocks, and those of snapshots, which stay where they are); return 0
+// if successful, -1 if the disk can't be read
+static int log_owners(int *owner) {
+  unsigned char ibitmap[INODE_BITMAP_SECTORS * SECTOR_SIZE];
+  char          buf[SECTOR_SIZE];
+
+  for (int i = 0; i < TOTAL_BLOCKS; i++) {
+    owner[i] = -1;
+  }
+  for (int i = 0; i < INODE_BITMAP_SECTORS; i++) {
+    if (Disk_Read(INODE_BITMAP_START_SECTOR + i, (char *)ibitmap + i * SECTOR_SIZE) < 0) {
+      return(-1);
+    }
+  }
+  for (int i = 0; i < INODE_SECTORS_INIT; i++) {
+    if (Disk_Read(inode_table_sector(i), buf) < 0) {
+      return(-1);
+    }
+    for (int j = 0; j < INODES_PER_SECTOR && i * INODES_PER_SECTOR + j < INODE_COUNT; j++) {
+      int      ino  = i * INODES_PER_SECTOR + j;
+      inode_t *node = (inode_t *)(buf + j * sizeof(inode_t));
+      if ((ibitmap[ino / 8] & (0x80 >> (ino % 8))) == 0) {
+        continue;
+      }
+      for (int k = 0; k < inode_nblocks(node); k++) {
+        int block = node->data[k] / BLOCK_SECTORS;
+        if (node->data[k] != 0 && block >= DATABLOCK_START_BLOCK && block < TOTAL_BLOCKS &&
+            !block_shared(node->data[k])) {
+          owner[block] = ino * MAX_SECTORS_PER_FILE + k;
+        }
+      }
+    }
+  }
+  return(0);
+}
+
+// copy the live block 'block' to the head of the log and point its
+// owner to the copy; the head skips past the blocks 'lo' to 'hi' - 1
+// (the segment being cleaned) if it runs into them; return 0 if
+// successful, 1 if there's no room elsewhere, -1 on an I/O error
+static int log_move_block(int *owner, int block, int lo, int hi) {
+  int sector = block_alloc();
+
+  if (sector >= 0 && lo <= sector / BLOCK_SECTORS && sector / BLOCK_SECTORS < hi) {
+    block_free(sector);
+    sb.log_head = (hi < TOTAL_BLOCKS) ? hi : DATABLOCK_START_BLOCK;
+    sector      = block_alloc();
+  }
+  if (sector < 0) {
+    return(1);
+  }
+  if (lo <= sector / BLOCK_SECTORS && sector / BLOCK_SECTORS < hi) {
+    block_free(sector);
+    return(1);
+  }
+
+  char     data_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  char     inode_buffer[SECTOR_SIZE];
+  int      inode_sector;
+  inode_t *node = inode_load(owner[block] / MAX_SECTORS_PER_FILE, &inode_sector, inode_buffer);
+  if (node == NULL || sectors_io(0, block * BLOCK_SECTORS, BLOCK_SECTORS, data_buf) < 0 ||
+      sectors_io(1, sector, BLOCK_SECTORS, data_buf) < 0) {
+    return(-1);
+  }
+  node->data[owner[block] % MAX_SECTORS_PER_FILE] = sector;
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    return(-1);
+  }
+  // (an indexed block stays in the index at its new place)
+  unsigned int fp = (dedup_fp != NULL) ? dedup_fp[block] : 0;
+  block_free(block * BLOCK_SECTORS);
+  if (fp != 0) {
+    dedup_insert(sector / BLOCK_SECTORS, fp);
+  }
+  owner[sector / BLOCK_SECTORS] = owner[block];
+  owner[block] = -1;
+  STAT_ADD(cleaner_blocks_moved, 1);
+  return(0);
+}
+
+// the cleaner of a log-structured disk: the live blocks of a segment
+// (LOG_SEGMENT_BLOCKS blocks) that is at most half full are copied to
+// the head of the log, so that the log finds the whole segment free
+// when it comes round again; the emptiest segments go first, up to
+// 'max' of them, and the one the head is in is left alone; return the
+// number of segments emptied, or -1 with osErrno set
+static int log_clean(int max) {
+  if (!fs_writable()) {
+    return(-1);
+  }
+  if (!LOG_MODE) {
+    return(0);
+  }
+  if (max <= 0) {
+    max = LOG_CLEAN_SEGMENTS;
+  }
+  int            nsegs  = (TOTAL_BLOCKS - DATABLOCK_START_BLOCK + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+  int           *owner  = malloc(TOTAL_BLOCKS * sizeof(int));
+  char          *tried  = calloc(nsegs, 1);
+  unsigned char *bitmap = malloc(SECTOR_BITMAP_USED * SECTOR_SIZE);
+  int            ret    = (owner && tried && bitmap) ? log_owners(owner) : -1;
+  int            cleaned = 0;
+
+  while (ret == 0 && cleaned < max) {
+    // the bitmap changes as blocks move, so it's read again each time
+    STAT_ADD(bitmap_sectors, SECTOR_BITMAP_USED);
+    for (int i = 0; i < SECTOR_BITMAP_USED && ret == 0; i++) {
+      ret = Disk_Read(SECTOR_BITMAP_START_SECTOR + i, (char *)bitmap + i * SECTOR_SIZE);
+    }
+    if (ret < 0) {
+      break;
+    }
+
+    // a segment holding a block nobody owns can't be emptied
+    int victim = -1, victim_live = LOG_SEGMENT_BLOCKS / 2 + 1;
+    for (int seg = 0; seg < nsegs; seg++) {
+      int lo   = DATABLOCK_START_BLOCK + seg * LOG_SEGMENT_BLOCKS;
+      int hi   = (lo + LOG_SEGMENT_BLOCKS < TOTAL_BLOCKS) ? lo + LOG_SEGMENT_BLOCKS : TOTAL_BLOCKS;
+      int live = 0;
+      if (tried[seg] || (lo <= sb.log_head && sb.log_head < hi)) {
+        continue;
+      }
+      for (int b = lo; b < hi; b++) {
+        if (bitmap[b / 8] & (0x80 >> (b % 8))) {
+          live += (owner[b] >= 0) ? 1 : LOG_SEGMENT_BLOCKS;
+        }
+      }
+      if (live > 0 && live < victim_live) {
+        victim      = seg;
+        victim_live = live;
+      }
+    }
+    if (victim < 0) {
+      break;
+    }
+    tried[victim] = 1;
+
+    int lo    = DATABLOCK_START_BLOCK + victim * LOG_SEGMENT_BLOCKS;
+    int hi    = (lo + LOG_SEGMENT_BLOCKS < TOTAL_BLOCKS) ? lo + LOG_SEGMENT_BLOCKS : TOTAL_BLOCKS;
+    int moved = 0;
+    for (int b = lo; b < hi && ret == 0; b++) {
+      if (bitmap[b / 8] & (0x80 >> (b % 8))) {
+        ret    = log_move_block(owner, b, lo, hi);
+        moved += (ret == 0);
+      }
+    }
+    TRACE(TR_LOG_CLEAN, victim, moved, sb.log_head);
+    dprintf("... cleaned segment %d, %d blocks moved\n", victim, moved);
+    if (ret == 0) {
+      cleaned++;
+    }
+  }
+  if (ret < 0) {
+    osErrno = E_GENERAL;
+  }
+  free(owner);
+  free(tried);
+  free(bitmap);
+  return(ret < 0 ? -1 : cleaned);
+}
+
+// the number of extents (runs of blocks one after the other on disk)
+// the content of an inode is made of; its number of blocks is
+// returned through 'nblocks'
+static int inode_extents(inode_t *inode, int *nblocks) {
+  int extents = 0, prev = 0;
+
+  *nblocks = 0;
+  for (int k = 0; k < inode_nblocks(inode); k++) {
+    if (inode->data[k] == 0) {
+      continue;
+    }
+    if (inode->data[k] != prev + BLOCK_SECTORS) {
+      extents++;
+    }
+    prev = inode->data[k];
+    (*nblocks)++;
+  }
+  return(extents);
+}
+
+// move the blocks of an inode into one run of free blocks, unless they
+// are one after the other already, or some are shared (moving them
+// would unshare them), or there's no run that long; the blocks are
+// copied first, then the inode is written, and the old blocks are
+// freed last, so the inode on disk refers to a complete copy at every
+// step; return the number of blocks moved, -1 on an I/O error
+static int defrag_inode(int ino, inode_t *node, int inode_sector, char *inode_buffer) {
+  int n, extents = inode_extents(node, &n);
+
+  if (extents <= 1) {
+    return(0);
+  }
+  for (int k = 0; k < inode_nblocks(node); k++) {
+    if (node->data[k] != 0 && block_shared(node->data[k])) {
+      return(0);
+    }
+  }
+  int first, len = block_alloc_run(n, &first);
+  if (len < n) {
+    for (int i = 0; i < len; i++) {
+      block_free(first + i * BLOCK_SECTORS);
+    }
+    return(0);
+  }
+
+  char data_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  int  old[MAX_SECTORS_PER_FILE];
+  for (int k = 0, j = 0; k < MAX_SECTORS_PER_FILE; k++) {
+    old[k] = 0;
+    if (k >= inode_nblocks(node) || node->data[k] == 0) {
+      continue;
+    }
+    int sector = first + j++ * BLOCK_SECTORS;
+    if (sectors_io(0, node->data[k], BLOCK_SECTORS, data_buf) < 0 ||
+        sectors_io(1, sector, BLOCK_SECTORS, data_buf) < 0) {
+      return(-1);
+    }
+    old[k]        = node->data[k];
+    node->data[k] = sector;
+  }
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    return(-1);
+  }
+  for (int k = 0; k < MAX_SECTORS_PER_FILE; k++) {
+    // (an indexed block stays in the index at its new place)
+    unsigned int fp = (old[k] != 0 && dedup_fp != NULL) ? dedup_fp[old[k] / BLOCK_SECTORS] : 0;
+    if (old[k] != 0) {
+      block_free(old[k]);
+    }
+    if (fp != 0) {
+      dedup_insert(node->data[k] / BLOCK_SECTORS, fp);
+    }
+  }
+  TRACE(TR_DEFRAG_MOVE, ino, extents, first, n);
+  return(n);
+}
+
+// the inode the next FS_Defrag() starts from, the last one having run
+// out of time before getting there
+static int defrag_next;
+
+// defragment the files and directories, one inode after the other
+// (those in the inode bitmap), for up to 'budget_ms' milliseconds (no
+// limit if 0); the next call goes on from where this one stopped
+static int fs_defrag(int budget_ms, FS_Defrag_t *result) {
+  unsigned char ibitmap[INODE_BITMAP_SECTORS * SECTOR_SIZE];
+
+  dprintf("FS_Defrag(%d):\n", budget_ms);
+  TRACE(TR_DEFRAG, budget_ms, defrag_next);
+  if (result == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  memset(result, 0, sizeof(FS_Defrag_t));
+  if (!fs_writable()) {
+    return(-1);
+  }
+  // pending blocks get their sectors first, so that they count too
+  if (delalloc_flush_all() < 0) {
+    return(-1);
+  }
+  for (int i = 0; i < INODE_BITMAP_SECTORS; i++) {
+    if (Disk_Read(INODE_BITMAP_START_SECTOR + i, (char *)ibitmap + i * SECTOR_SIZE) < 0) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+  }
+
+  uint64_t deadline = stats_clock() + (uint64_t)budget_ms * 1000000;
+  int      next     = defrag_next;
+  result->done = 1;
+  for (int n = 0; n < INODE_COUNT; n++) {
+    int ino = (defrag_next + n) % INODE_COUNT;
+    if (budget_ms > 0 && stats_clock() >= deadline) {
+      result->done = 0;
+      break;
+    }
+    next = (ino + 1) % INODE_COUNT;
+    if ((ibitmap[ino / 8] & (0x80 >> (ino % 8))) == 0 ||
+        ino / INODES_PER_SECTOR >= INODE_SECTORS_INIT) {
+      continue;
+    }
+    int      inode_sector, nblocks;
+    char     inode_buffer[SECTOR_SIZE];
+    inode_t *node = inode_load(ino, &inode_sector, inode_buffer);
+    if (node == NULL) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    int before = inode_extents(node, &nblocks);
+    int moved  = defrag_inode(ino, node, inode_sector, inode_buffer);
+    if (moved < 0) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    int after = inode_extents(node, &nblocks);
+    result->inodes++;
+    result->extents_before += before;
+    result->extents_after  += after;
+    result->fragmented_before += (before > 1);
+    result->fragmented_after  += (after > 1);
+    result->inodes_moved += (moved > 0);
+    result->blocks_moved += moved;
+  }
+  defrag_next = result->done ? 0 : next;
+  return(0);
+}
+
+// take a snapshot: it gets a map of its own (all its entries 0, as
+// the whole inode table is shared at first), and every block the live
+// inodes refer to gains a reference; nothing else is copied until the
+// live file system changes
+static int fs_snapshot(char *name) {
+  dprintf("FS_Snapshot('%s'):\n", name);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  if (name == NULL || illegal_filename(name)) {
+    osErrno = E_CREATE;
+    return(-1);
+  }
+  for (int s = 0; s < sb.nsnapshots; s++) {
+    if (strcmp(sb.snapshots[s].name, name) == 0) {
+      dprintf("... snapshot '%s' already exists\n", name);
+      osErrno = E_CREATE;
+      return(-1);
+    }
+  }
+  if (sb.nsnapshots == MAX_SNAPSHOTS) {
+    dprintf("... too many snapshots\n");
+    osErrno = E_CREATE;
+    return(-1);
+  }
+  // (a snapshot only knows of the inode table, not of its chunks)
+  if (sb.inode_nchunks > 0) {
+    dprintf("... inode table has grown\n");
+    osErrno = E_CREATE;
+    return(-1);
+  }
+
+  // pending blocks are part of the file system as it is now
+  if (delalloc_flush_all() < 0) {
+    return(-1);
+  }
+  if (refs_init() < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (sb.free_blocks - pending_blocks <= 0) {
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+  int map = block_alloc();
+  if (map < 0) {
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+
+  int         s    = sb.nsnapshots;
+  snapshot_t *snap = &sb.snapshots[s];
+  memset(snap, 0, sizeof(snapshot_t));
+  strcpy(snap->name, name);
+  snap->map        = map;
+  snap->table_init = sb.inode_table_init;
+  memset(snap_maps[s], 0, sizeof(snap_maps[s]));
+  if (snap_map_store(s) < 0) {
+    block_free(map);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  char buf[SECTOR_SIZE];
+  for (int i = 0; i < sb.inode_table_init; i++) {
+    if (Disk_Read(INODE_TABLE_START_SECTOR + i, buf) < 0) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    refs_add_sector(block_refs, buf);
+  }
+  sb.nsnapshots++;
+  TRACE(TR_SNAPSHOT, s, map);
+  dprintf("... snapshot %d '%s', map at sector %d\n", s, name, map);
+  return(sb_store());
+}
+
+static int file_create(int dh, char *file) {
   dprintf("File_Create('%s'):\n", file);
-  return(create_file_or_directory(0, file));
+  TRACE(TR_FILE_CREATE, 0);
+  return(create_file_or_directory(0, dh, file));
 }
 
 //Written by Dario Gonzalez
@@ -808,20 +3461,20 @@ int File_Create(char *file) {
  * (and do NOT delete the file). Upon success, return 0.
  *
  */
-int File_Unlink(char *file) {
+static int file_unlink(int dh, char *file) {
+  if (!fs_writable()) {
+    return(-1);
+  }
   char file_name[255];
   int  child_inode;
-  int  parent_inode = follow_path(file, &child_inode, file_name);
+  int  parent_inode = follow_path_at(dh, file, &child_inode, file_name);
 
-  if (parent_inode < 0) {
+  TRACE(TR_FILE_UNLINK, parent_inode, child_inode);
+  if (parent_inode < 0 || child_inode < 0) {
     osErrno = E_NO_SUCH_FILE;
     return(-1);
   }
-  if (is_file_open(child_inode)) {
-    osErrno = E_FILE_IN_USE;
-    return(-1);
-  }
-  int  child_inode_sec = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
+  int  child_inode_sec = inode_sector_of(child_inode);
   char child_inode_buffer[SECTOR_SIZE];
   int  child_loc_offset = child_inode % INODES_PER_SECTOR;
   if (Disk_Read(child_inode_sec, child_inode_buffer) < 0) {
@@ -832,19 +3485,38 @@ int File_Unlink(char *file) {
   if (child->type != 0) {
     return(-2); //file isnt a file
   }
-  //free child sectors
-  dprintf("File_Unlink: deleting %d sectors of file \n", child->size);
-  for (int i = 0; i < child->size; i++) {
-    bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]);
+  if (child->links > 0) {
+    // other dirents still refer to the file, which stays as it is;
+    // the dirent goes first, so that the count is never too low (the
+    // parent may be in the same inode table sector, hence the reload)
+    if (dirent_remove(parent_inode, file_name, child_inode) < 0 ||
+        (child = inode_load(child_inode, &child_inode_sec, child_inode_buffer)) == NULL) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    child->links--;
+    return(inode_store(child_inode_sec, child_inode_buffer));
+  }
+  if (is_file_open(child_inode)) {
+    osErrno = E_FILE_IN_USE;
+    return(-1);
+  }
+  //free child sectors (including those reserved beyond the file size)
+  dprintf("File_Unlink: deleting sectors of file of size %d\n", child->size);
+  for (int i = 0; i < MAX_SECTORS_PER_FILE; i++) {
+    if (child->data[i] != 0) {
+      block_release(child->data[i]);
+      child->data[i] = 0;
+    }
   }
   child->size = 0;
-  if (Disk_Write(child_inode_sec, child_inode_buffer) < 0) {
+  if (inode_store(child_inode_sec, child_inode_buffer) < 0) {
     return(-1);
   }
 
   //TODO error check
   int r;
-  if ((r = remove_inode(0, parent_inode, child_inode)) < 0) {
+  if ((r = remove_inode(0, parent_inode, file_name, child_inode)) < 0) {
     dprintf("File_Unlink: remove_inode returned an error: %d\n", r);
     return(-1);
   }
@@ -852,7 +3524,321 @@ int File_Unlink(char *file) {
   return(0);
 }
 
-int File_Open(char *file) {
+// the number of extents of a file as it is on disk (the blocks still
+// pending in memory have no sector yet)
+static int file_extents(char *file) {
+  int      child_inode, inode_sector, nblocks;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *child = NULL;
+
+  if (follow_path(file, &child_inode, NULL) >= 0 && child_inode >= 0) {
+    child = inode_load(child_inode, &inode_sector, inode_buffer);
+  }
+  if (child == NULL || child->type != 0) {
+    osErrno = E_NO_SUCH_FILE;
+    return(-1);
+  }
+  return(inode_extents(child, &nblocks));
+}
+
+// whether the directory 'dir' is one of those leading to the absolute
+// 'path' (so that a directory isn't moved under itself)
+static int path_goes_through(char *path, int dir) {
+  char prefix[MAX_PATH];
+
+  for (int i = 1; i < MAX_PATH && path[i] != '\0'; i++) {
+    if (path[i] != '/') {
+      continue;
+    }
+    int child;
+    memcpy(prefix, path, i);
+    prefix[i] = '\0';
+    if (follow_path(prefix, &child, NULL) >= 0 && child == dir) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+static int file_rename(char *old, char *new) {
+  dprintf("File_Rename('%s', '%s'):\n", old, new);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  int  old_inode, new_inode;
+  char old_fname[MAX_NAME], new_fname[MAX_NAME];
+  int  old_parent = follow_path(old, &old_inode, old_fname);
+  int  new_parent = follow_path(new, &new_inode, new_fname);
+
+  TRACE(TR_FILE_RENAME, old_inode, old_parent, new_parent);
+  if (old_parent < 0 || old_inode < 0) {
+    dprintf("... '%s' not found\n", old);
+    osErrno = E_NO_SUCH_FILE;
+    return(-1);
+  }
+  if (old_inode == 0) {
+    osErrno = E_ROOT_DIR;
+    return(-1);
+  }
+  if (new_parent == old_parent && new_inode == old_inode && strcmp(new_fname, old_fname) == 0) {
+    return(0);    // renamed to itself
+  }
+  if (new_parent < 0 || new_inode >= 0 || path_goes_through(new, old_inode)) {
+    dprintf("... can't move to '%s'\n", new);
+    osErrno = E_CREATE;
+    return(-1);
+  }
+
+  // only the dirents move: the new one goes in first, so that the file
+  // is never without one; the old one is then found by its name
+  if (dirent_add(new_parent, new_fname, old_inode) < 0) {
+    osErrno = E_CREATE;
+    return(-1);
+  }
+  if (dirent_remove(old_parent, old_fname, old_inode) < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  return(0);
+}
+
+static int file_link(char *old, char *new) {
+  dprintf("File_Link('%s', '%s'):\n", old, new);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  int  old_inode, new_inode;
+  char new_fname[MAX_NAME];
+  int  old_parent = follow_path(old, &old_inode, NULL);
+  int  new_parent = follow_path(new, &new_inode, new_fname);
+
+  TRACE(TR_FILE_LINK, old_inode, new_parent);
+  if (old_parent < 0 || old_inode < 0) {
+    dprintf("... file '%s' is not found\n", old);
+    osErrno = E_NO_SUCH_FILE;
+    return(-1);
+  }
+  if (new_parent < 0 || new_inode >= 0) {
+    dprintf("... can't link to '%s'\n", new);
+    osErrno = E_CREATE;
+    return(-1);
+  }
+  int      inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *node = inode_load(old_inode, &inode_sector, inode_buffer);
+  if (node == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (node->type != 0 || node->links == INODE_MAX_LINKS) {
+    dprintf("... '%s' is not a file or has too many links\n", old);
+    osErrno = E_CREATE;
+    return(-1);
+  }
+
+  // the count goes up before the dirent is added, so that it's never
+  // too low; it comes down again if the dirent can't be added (the
+  // parent may be in the same inode table sector, hence the reload)
+  node->links++;
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (dirent_add(new_parent, new_fname, old_inode) < 0) {
+    if ((node = inode_load(old_inode, &inode_sector, inode_buffer)) != NULL) {
+      node->links--;
+      inode_store(inode_sector, inode_buffer);
+    }
+    osErrno = E_CREATE;
+    return(-1);
+  }
+  return(0);
+}
+
+// create file 'dst' as a clone of file 'src': the new inode gets the
+// size and the blocks of the source (any it holds in memory are
+// flushed first), and every block gains a reference; the first write
+// to a shared block by either file gives it a new sector (see
+// block_redirect())
+static int file_clone(char *src, char *dst) {
+  dprintf("File_Clone('%s', '%s'):\n", src, dst);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  int src_inode;
+  follow_path(src, &src_inode, NULL);
+  if (src_inode < 0) {
+    dprintf("... file '%s' is not found\n", src);
+    osErrno = E_NO_SUCH_FILE;
+    return(-1);
+  }
+  if (delalloc_flush(src_inode) < 0) {
+    return(-1);
+  }
+  int      inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *node = inode_load(src_inode, &inode_sector, inode_buffer);
+  if (node == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (node->type != 0) {
+    dprintf("... error: '%s' is not a file\n", src);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  inode_t copy = *node;
+
+  // counting the references comes first, as it reads the inode table
+  // (where the clone would already show up otherwise)
+  if (refs_init() < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (create_file_or_directory(0, -1, dst) < 0) {
+    return(-1);
+  }
+  int dst_inode;
+  follow_path(dst, &dst_inode, NULL);
+  if (dst_inode < 0 || (node = inode_load(dst_inode, &inode_sector, inode_buffer)) == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  for (int i = 0; i < MAX_SECTORS_PER_FILE; i++) {
+    if (copy.data[i] != 0) {
+      block_refs[copy.data[i] / BLOCK_SECTORS]++;
+    }
+  }
+  *node       = copy;
+  node->links = 0;
+  sb.shared   = 1;
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  TRACE(TR_FILE_CLONE, src_inode, dst_inode, copy.size);
+  return(0);
+}
+
+// move the blocks of a file that isn't compressed into pending pages
+// for compressing it: each cluster with anything in it gets a page for
+// every block it covers (as it may not compress at all), and the
+// blocks reserved past the end of the file are released; the caller
+// writes out the inode; return 0 if successful, otherwise -1 with
+// osErrno set
+static int file_pages_for_clusters(inode_t *inode, int ino, delalloc_t *d) {
+  int more = 0;
+
+  for (int c = 0; c * CLUSTER_BLOCKS < BLOCKS_PER_FILE; c++) {
+    int first = c * CLUSTER_BLOCKS, used = cluster_used(inode->size, c), any = 0;
+    for (int i = first; i < first + used; i++) {
+      any |= inode->data[i] != 0;
+    }
+    for (int i = first; any && i < first + used; i++) {
+      if (inode->data[i] == 0 || block_shared(inode->data[i])) {
+        more++;
+      }
+    }
+  }
+  if (more > sb.free_blocks - pending_blocks) {
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+  for (int c = 0; c * CLUSTER_BLOCKS < BLOCKS_PER_FILE; c++) {
+    int first = c * CLUSTER_BLOCKS, used = cluster_used(inode->size, c), any = 0;
+    for (int i = first; i < first + used; i++) {
+      any |= inode->data[i] != 0;
+    }
+    for (int i = first; any && i < first + used; i++) {
+      if (inode->data[i] != 0) {
+        if (block_redirect(inode, ino, d, i, 1) < 0) {
+          return(-1);
+        }
+      }else {
+        if ((d->pages[i] = calloc(1, BLOCK_SIZE)) == NULL) {
+          osErrno = E_GENERAL;
+          return(-1);
+        }
+        d->npages++;
+        pending_blocks++;
+      }
+    }
+  }
+  for (int i = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE; i < MAX_SECTORS_PER_FILE; i++) {
+    if (inode->data[i] != 0) {
+      block_release(inode->data[i]);
+      inode->data[i] = 0;
+    }
+  }
+  return(0);
+}
+
+// turn the compression of a file on or off: everything it holds is
+// moved into pending pages (decompressed, if it was compressed), and
+// the flush that follows writes it out the other way
+static int file_compress(char *file, int on) {
+  dprintf("File_Compress('%s', %d):\n", file, on);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  int ino;
+  follow_path(file, &ino, NULL);
+  if (ino < 0) {
+    dprintf("... file '%s' is not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return(-1);
+  }
+  if (delalloc_flush(ino) < 0) {
+    return(-1);
+  }
+  int      inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *child = inode_load(ino, &inode_sector, inode_buffer);
+  if (child == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (child->type != 0) {
+    dprintf("... error: '%s' is not a file\n", file);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  TRACE(TR_FILE_COMPRESS, ino, on, child->size);
+  if (!(child->flags & INODE_COMPRESSED) == !on) {
+    return(0);
+  }
+  delalloc_t *d = delalloc_find(ino, 1);
+  if (d == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  int ret = 0;
+  if (child->flags & INODE_COMPRESSED) {
+    for (int c = 0; ret == 0 && c * CLUSTER_BLOCKS < BLOCKS_PER_FILE; c++) {
+      if (cluster_stored(child, c) > 0) {
+        ret = cluster_load(child, d, c, child->size);
+      }
+    }
+  }else {
+    ret = file_pages_for_clusters(child, ino, d);
+  }
+
+  // whatever made it into pages is written back by the next flush
+  // either way
+  if (ret == 0) {
+    child->flags ^= INODE_COMPRESSED;
+  }
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (ret < 0) {
+    return(-1);
+  }
+  return(delalloc_flush(ino));
+}
+
+static int file_open(int dh, char *file) {
   dprintf("File_Open('%s'):\n", file);
   int fd = new_file_fd();
   if (fd < 0) {
@@ -862,10 +3848,12 @@ int File_Open(char *file) {
   }
 
   int child_inode;
-  follow_path(file, &child_inode, NULL);
+  if (follow_path_at(dh, file, &child_inode, NULL) < 0) {
+    child_inode = -1;
+  }
   if (child_inode >= 0) {      // child is the one
     // load the disk sector containing the inode
-    int  inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
+    int  inode_sector = inode_sector_of(child_inode);
     char inode_buffer[SECTOR_SIZE];
     if (Disk_Read(inode_sector, inode_buffer) < 0) {
       osErrno = E_GENERAL; return(-1);
@@ -873,8 +3861,7 @@ int File_Open(char *file) {
     dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
     // get the inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset            = child_inode - inode_start_entry;
+    int offset = child_inode % INODES_PER_SECTOR;
     assert(0 <= offset && offset < INODES_PER_SECTOR);
     inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
     dprintf("... inode %d (size=%d, type=%d)\n",
@@ -885,6 +3872,7 @@ int File_Open(char *file) {
       osErrno = E_GENERAL;
       return(-1);
     }
+    TRACE(TR_FILE_OPEN, fd, child_inode, child->size);
 
     // initialize open file entry and return its index
     open_files[fd].inode = child_inode;
@@ -910,21 +3898,22 @@ int File_Open(char *file) {
  * of the file, zero should be returned, even under repeated calls to File_Read().
  *
  */
-int File_Read(int fd, void *buffer, int size) {
+static int file_read(int fd, void *buffer, int size) {
   dprintf("File_Read: reading from file %d, up to %d bytes\n", fd, size);
-  if (!is_file_open(fd)) {
+  if (!is_valid_fd(fd)) {
     osErrno = E_BAD_FD;
     return(-1);
   }
   open_file_t *f = &open_files[fd];
   dprintf("File_Read: file size is %d, file cursor at %d\n", f->size, f->pos);
-  if (f->pos == f->size) {
+  TRACE(TR_FILE_READ, fd, f->pos, size);
+  if (f->pos >= f->size) {
     return(0);
   }
 
   //Taken from File_Open
   // load the disk sector containing the inode
-  int  inode_sector = INODE_TABLE_START_SECTOR + f->inode / INODES_PER_SECTOR;
+  int  inode_sector = inode_sector_of(f->inode);
   char inode_buffer[SECTOR_SIZE];
   if (Disk_Read(inode_sector, inode_buffer) < 0) {
     osErrno = E_GENERAL; return(-1);
@@ -932,41 +3921,77 @@ int File_Read(int fd, void *buffer, int size) {
   dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
   // get the inode
-  int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-  int offset            = f->inode - inode_start_entry;
+  int offset = f->inode % INODES_PER_SECTOR;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
   //Done taking from File_Open
 
   int  left            = size;
-  int  curr_pos_in_sec = f->pos % SECTOR_SIZE;
-  int  curr_sec        = f->pos / SECTOR_SIZE;
+  int  curr_pos_in_blk = f->pos % BLOCK_SIZE;
+  int  curr_blk        = f->pos / BLOCK_SIZE;
   int  out_pos         = 0;
-  char data_buf[SECTOR_SIZE];
-  dprintf("File_Read: Going to read %d bytes from sec %d, starting at offset %d\n", left, curr_sec, curr_pos_in_sec);
-
+  char data_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  dprintf("File_Read: Going to read %d bytes from block %d, starting at offset %d\n", left, curr_blk, curr_pos_in_blk);
+
+  // the clusters of a compressed file are decompressed into 'cluster'
+  // (the last one read staying there for the next block)
+  delalloc_t *d       = delalloc_find(f->inode, 0);
+  char       *cluster = NULL;
+  int         loaded  = -1;
   while (left > 0 && f->pos < f->size) {
-    //read in sector, write to buffer, update left and pos
-    if (Disk_Read(child->data[curr_sec], data_buf) < 0) {
-      return(-1);
-    }
     int to_read = 0;
-    if (left + curr_pos_in_sec > SECTOR_SIZE) {
-      to_read = SECTOR_SIZE - curr_pos_in_sec;
+    if (left + curr_pos_in_blk > BLOCK_SIZE) {
+      to_read = BLOCK_SIZE - curr_pos_in_blk;
     }else{
       to_read = left;
     }
-    memcpy(buffer, data_buf + curr_pos_in_sec, to_read);
+    if (to_read > f->size - f->pos) {
+      to_read = f->size - f->pos;
+    }
+
+    //read in the sectors of the block covered, write to buffer, update left and pos
+    char *src = data_buf;
+    if ((child->flags & INODE_COMPRESSED) && (d == NULL || d->pages[curr_blk] == NULL)) {
+      int c = curr_blk / CLUSTER_BLOCKS;
+      if (cluster == NULL && (cluster = malloc(CLUSTER_SIZE)) == NULL) {
+        osErrno = E_GENERAL;
+        return(-1);
+      }
+      if (c != loaded && cluster_read(child, c, cluster) < 0) {
+        free(cluster);
+        osErrno = E_GENERAL;
+        return(-1);
+      }
+      loaded = c;
+      src    = cluster + (curr_blk % CLUSTER_BLOCKS) * BLOCK_SIZE;
+    }else if (child->data[curr_blk] == 0 && (d == NULL || d->pages[curr_blk] == NULL)) {
+      //a hole: nothing was ever written there
+      STAT_ADD(holes_read, 1);
+      memset(data_buf + curr_pos_in_blk, 0, to_read);
+    }else if (child->data[curr_blk] == 0) {
+      //the block is still pending in memory
+      STAT_ADD(page_cache_hits, 1);
+      src = d->pages[curr_blk];
+    }else {
+      int first = curr_pos_in_blk / SECTOR_SIZE;
+      int last  = (curr_pos_in_blk + to_read - 1) / SECTOR_SIZE;
+      if (sectors_io(0, child->data[curr_blk] + first, last - first + 1,
+                     data_buf + first * SECTOR_SIZE) < 0) {
+        return(-1);
+      }
+    }
+    memcpy((char *)buffer + out_pos, src + curr_pos_in_blk, to_read);
 
     left           -= to_read;
-    curr_pos_in_sec = 0;
+    curr_pos_in_blk = 0;
     f->pos         += to_read;
-    curr_sec       += 1;
+    curr_blk       += 1;
     out_pos        += to_read;
     if (f->pos > f->size) {
       f->pos = f->size;
     }
   }
+  free(cluster);
   return(out_pos);
 }
 
@@ -981,14 +4006,18 @@ int File_Read(int fd, void *buffer, int size) {
  * complete (due to a lack of space on disk), return -1 and set osErrno to E_NO_SPACE. Finally, if
  * the file exceeds the maximum file size, you should return -1and set osErrno to E_FILE_TOO_BIG
  */
-int File_Write(int fd, void *buffer, int size) {
-  if (!is_file_open(fd)) {
+static int file_write(int fd, void *buffer, int size) {
+  if (!is_valid_fd(fd)) {
     dprintf("tried to write to file that wasn't open\n");
     osErrno = E_BAD_FD;
     return(-1);
   }
   open_file_t *f = &open_files[fd];
-  if (f->pos + size > MAX_SECTORS_PER_FILE * SECTOR_SIZE) {
+  TRACE(TR_FILE_WRITE, fd, f->pos, size);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  if (f->pos + size > MAX_FILE_SIZE) {
     dprintf("tried to write too much to a file\n");
     osErrno = E_FILE_TOO_BIG;
     return(-1);
@@ -996,7 +4025,7 @@ int File_Write(int fd, void *buffer, int size) {
 
   //Taken from File_Open
   // load the disk sector containing the inode
-  int  inode_sector = INODE_TABLE_START_SECTOR + f->inode / INODES_PER_SECTOR;
+  int  inode_sector = inode_sector_of(f->inode);
   char inode_buffer[SECTOR_SIZE];
   if (Disk_Read(inode_sector, inode_buffer) < 0) {
     osErrno = E_GENERAL; return(-1);
@@ -1004,83 +4033,228 @@ int File_Write(int fd, void *buffer, int size) {
   dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
   // get the inode
-  int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-  int offset            = f->inode - inode_start_entry;
+  int offset = f->inode % INODES_PER_SECTOR;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
   //Done taking from File_Open
 
-  int allocated_secs = (f->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
-  int needed_secs    = (size - (allocated_secs * SECTOR_SIZE - f->pos) + SECTOR_SIZE - 1) / SECTOR_SIZE;
-  for (int i = allocated_secs; i < allocated_secs + needed_secs; i++) {
-    int next = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    dprintf("assigning block %d to file for writing\n", next);
-    if (next < 0) {
-      dprintf("disk ran out of space when allocating blocks to write\n");
-      osErrno = E_NO_SPACE;
-      return(-1);
+  // blocks that already have a sector (written and flushed before, or
+  // reserved) are updated in place, unless the disk is log-structured
+  // or deduplicating, or the block is shared;
+  // the others are held in pending pages until the file is flushed, and
+  // only counted against the free blocks here so that a full disk is
+  // still reported right away; so is a block that gets moved into a
+  // pending page while its sector stays taken (shared, or possibly so
+  // once deduplicated), including one zeroed below for a hole
+  int end       = (f->pos + size > f->size) ? f->pos + size : f->size;
+  int last_blk  = (f->pos + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int first_blk = ((child->size < f->pos) ? child->size : f->pos) / BLOCK_SIZE;
+  delalloc_t *d = delalloc_find(f->inode, 0);
+  int new_pages = 0;
+  int compressed = (child->flags & INODE_COMPRESSED) != 0;
+  for (int i = first_blk; !compressed && i < last_blk; i++) {
+    if (child->data[i] != 0) {
+      if (DEDUP_MODE || block_shared(child->data[i])) {
+        new_pages++;
+      }
+    }else if (i >= f->pos / BLOCK_SIZE && (d == NULL || d->pages[i] == NULL)) {
+      new_pages++;
     }
-    child->data[i] = next;
   }
-  child->size += size;
-  if (Disk_Write(inode_sector, inode_buffer) < 0) {
+  if (new_pages > sb.free_blocks - pending_blocks) {
+    dprintf("disk doesn't have %d free blocks for writing\n", new_pages);
+    osErrno = E_NO_SPACE;
+    return(-1);
+  }
+  if ((new_pages > 0 || LOG_MODE || DEDUP_MODE || block_refs != NULL || compressed) && d == NULL &&
+      (d = delalloc_find(f->inode, 1)) == NULL) {
+    osErrno = E_GENERAL;
     return(-1);
   }
+  int inode_dirty = 0;
+
+  // the clusters of a compressed file touched by the write are moved
+  // into pending pages as a whole (which also checks for space), so
+  // the rest is written as if they had never been flushed
+  for (int c = 0; compressed && c * CLUSTER_BLOCKS < BLOCKS_PER_FILE; c++) {
+    if (!cluster_touched(child->size, f->pos, size, c)) {
+      continue;
+    }
+    if (cluster_load(child, d, c, end) < 0) {
+      if (inode_dirty) {
+        inode_store(inode_sector, inode_buffer);
+      }
+      return(-1);
+    }
+    inode_dirty = 1;
+  }
+
+  // writing past the end of the file leaves a hole; the blocks of the
+  // hole without a sector stay that way (and read as zeros), but those
+  // with one (reserved, or the old last block) may hold anything past
+  // the old end and are zeroed
+  for (int pos = child->size; pos < f->pos; ) {
+    int blk = pos / BLOCK_SIZE, off = pos % BLOCK_SIZE;
+    int len = (f->pos - pos < BLOCK_SIZE - off) ? f->pos - pos : BLOCK_SIZE - off;
+    if (child->data[blk] != 0 && (LOG_MODE || DEDUP_MODE || block_shared(child->data[blk]))) {
+      if (block_redirect(child, f->inode, d, blk, len < BLOCK_SIZE) < 0) {
+        if (inode_dirty) {
+          inode_store(inode_sector, inode_buffer);
+        }
+        return(-1);
+      }
+      inode_dirty = 1;
+    }
+    if (child->data[blk] != 0) {
+      if (block_write(child->data[blk], off, NULL, len) < 0) {
+        if (inode_dirty) {
+          inode_store(inode_sector, inode_buffer);
+        }
+        return(-1);
+      }
+    }else if (d != NULL && d->pages[blk] != NULL) {
+      memset(d->pages[blk] + off, 0, len);
+    }
+    pos += len;
+  }
 
-  allocated_secs += needed_secs;
-  f->size         = f->pos + size;
-  child->size     = f->size;
+  int left            = size;
+  int curr_pos_in_blk = f->pos % BLOCK_SIZE;
+  int curr_blk        = f->pos / BLOCK_SIZE;
+  int in_pos          = 0;
 
-  int  left            = size;
-  int  curr_pos_in_sec = f->pos % SECTOR_SIZE;
-  int  curr_sec        = f->pos / SECTOR_SIZE;
-  int  in_pos          = 0;
-  char data_buf[SECTOR_SIZE];
-
-  //write out while still in allocated secs
-  while (left > 0 && curr_sec < allocated_secs) {
-    //read in sector, write to buffer, update left and pos
-    if (Disk_Read(child->data[curr_sec], data_buf) < 0) {
-      return(-1);
+  while (left > 0) {
+    int to_write = BLOCK_SIZE - curr_pos_in_blk;
+    if (to_write > left) {
+      to_write = left;
     }
-    int to_write = 0;
-    if (left > SECTOR_SIZE) {
-      to_write = SECTOR_SIZE - curr_pos_in_sec;
-    }else{
-      to_write = left - curr_pos_in_sec;
+    if (child->data[curr_blk] != 0 && (LOG_MODE || DEDUP_MODE || block_shared(child->data[curr_blk]))) {
+      if (block_redirect(child, f->inode, d, curr_blk, to_write < BLOCK_SIZE) < 0) {
+        if (inode_dirty) {
+          inode_store(inode_sector, inode_buffer);
+        }
+        return(-1);
+      }
+      inode_dirty = 1;
     }
-    memcpy(data_buf + curr_pos_in_sec, buffer + in_pos, to_write);
-    if (Disk_Write(child->data[curr_sec], data_buf) < 0) {
+    if (child->data[curr_blk] == 0) {
+      //no sector yet, write into the pending page
+      if (d->pages[curr_blk] == NULL) {
+        if ((d->pages[curr_blk] = calloc(1, BLOCK_SIZE)) == NULL) {
+          if (inode_dirty) {
+            inode_store(inode_sector, inode_buffer);
+          }
+          osErrno = E_GENERAL;
+          return(-1);
+        }
+        d->npages++;
+        pending_blocks++;
+        TRACE(TR_PAGE_NEW, f->inode, curr_blk, pending_blocks);
+      }
+      memcpy(d->pages[curr_blk] + curr_pos_in_blk, (char *)buffer + in_pos, to_write);
+    }else if (block_write(child->data[curr_blk], curr_pos_in_blk,
+                           (char *)buffer + in_pos, to_write) < 0) {
+      if (inode_dirty) {
+        inode_store(inode_sector, inode_buffer);
+      }
       return(-1);
     }
 
     left           -= to_write;
-    curr_pos_in_sec = 0;
+    curr_pos_in_blk = 0;
     f->pos         += to_write;
-    curr_sec       += 1;
+    curr_blk       += 1;
     in_pos         += to_write;
   }
-  return(size - left);
+
+  if (end != child->size || inode_dirty) {
+    f->size     = end;
+    child->size = end;
+    if (inode_store(inode_sector, inode_buffer) < 0) {
+      return(-1);
+    }
+  }
+  return(size);
+}
+
+static int file_reserve(int fd, int size) {
+  dprintf("File_Reserve(%d, %d):\n", fd, size);
+  TRACE(TR_FILE_RESERVE, fd, size);
+  if (!fs_writable()) {
+    return(-1);
+  }
+  if (!is_valid_fd(fd)) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return(-1);
+  }
+  if (size < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (size > MAX_FILE_SIZE) {
+    dprintf("... can't reserve more than the max file size\n");
+    osErrno = E_FILE_TOO_BIG;
+    return(-1);
+  }
+  open_file_t *f = &open_files[fd];
+
+  // blocks still pending in memory get their sectors first, so that
+  // the reservation below only fills in the blocks nobody has written
+  if (delalloc_flush(f->inode) < 0) {
+    return(-1);
+  }
+
+  // load the disk sector containing the inode
+  int      inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *child = inode_load(f->inode, &inode_sector, inode_buffer);
+  if (child == NULL) {
+    osErrno = E_GENERAL; return(-1);
+  }
+
+  // a compressed file only knows how many blocks a cluster takes once
+  // it's compressed, so nothing is reserved for it
+  if (child->flags & INODE_COMPRESSED) {
+    return(0);
+  }
+
+  // the blocks are only recorded in the inode; the file size doesn't
+  // change and nothing gets written to the blocks themselves, so only
+  // blocks past the end get one (a write there zeroes what it skips);
+  // a hole below the end has to keep reading as zeros
+  int from = (child->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (inode_alloc_blocks(child, from, (size + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0) {
+    return(-1);
+  }
+  if (inode_store(inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL; return(-1);
+  }
+  dprintf("... reserved %d bytes for inode %d\n", size, f->inode);
+  return(0);
 }
 
 //Written by Dario Gonzalez
-int File_Seek(int fd, int offset) {
-  if (!is_file_open(fd)) {
+static int file_seek(int fd, int offset) {
+  TRACE(TR_FILE_SEEK, fd, offset);
+  if (!is_valid_fd(fd)) {
     osErrno = E_BAD_FD;
     return(-1);
   }
-  open_file_t *f = &open_files[fd];
-  if (offset > f->size || offset < 0) {
+  // the position may go past the end of the file (a write there leaves
+  // a hole), but not past the max file size
+  if (offset > MAX_FILE_SIZE || offset < 0) {
     osErrno = E_SEEK_OUT_OF_BOUNDS;
     return(-1);
   }
-  f->pos = offset;
+  open_files[fd].pos = offset;
   return(0);
 }
 
-int File_Close(int fd) {
+static int file_close(int fd) {
   dprintf("File_Close(%d):\n", fd);
-  if (0 > fd || fd > MAX_OPEN_FILES) {
+  TRACE(TR_FILE_CLOSE, fd);
+  if (0 > fd || fd >= MAX_OPEN_FILES) {
     dprintf("... fd=%d out of bound\n", fd);
     osErrno = E_BAD_FD;
     return(-1);
@@ -1091,14 +4265,31 @@ int File_Close(int fd) {
     return(-1);
   }
 
+  if (delalloc_flush(open_files[fd].inode) < 0) {
+    dprintf("... failed to flush pending blocks\n");
+    return(-1);
+  }
+
   dprintf("... file closed successfully\n");
   open_files[fd].inode = 0;
   return(0);
 }
 
-int Dir_Create(char *path) {
+static int file_flush(int fd) {
+  dprintf("File_Flush(%d):\n", fd);
+  TRACE(TR_FILE_FLUSH, fd);
+  if (!is_valid_fd(fd)) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return(-1);
+  }
+  return(delalloc_flush(open_files[fd].inode));
+}
+
+static int dir_create(int dh, char *path) {
   dprintf("Dir_Create('%s'):\n", path);
-  return(create_file_or_directory(1, path));
+  TRACE(TR_DIR_CREATE, 0);
+  return(create_file_or_directory(1, dh, path));
 }
 
 //Written by Marcelo Valencia
@@ -1111,8 +4302,11 @@ int Dir_Create(char *path) {
  * -1 and set osErrno to E_DIR_NOT_EMPTY. It’s not allowed to remove the root directory ("/"),
  * in which case the function should return -1 and set osErrno to E_ROOT_DIR.
  */
-int Dir_Unlink(char *path) {
+static int dir_unlink(char *path) {
   /* YOUR CODE */
+  if (!fs_writable()) {
+    return(-1);
+  }
   char *rootPath = "/";
 
   if (strcmp(rootPath, path) == 0) {
@@ -1122,18 +4316,50 @@ int Dir_Unlink(char *path) {
   char path_name[255];
   int  child_inode;
   int  parent_inode = follow_path(path, &child_inode, path_name);
+  TRACE(TR_DIR_UNLINK, parent_inode, child_inode);
   if (parent_inode < 0) {
     osErrno = E_NO_SUCH_DIR;
     return(-1);
   }
+  if (child_inode >= 0 && is_dir_held(child_inode)) {
+    dprintf("... directory has a handle open\n");
+    osErrno = E_FILE_IN_USE;
+    return(-1);
+  }
 
-  int success = remove_inode(1, parent_inode, child_inode);
+  int success = remove_inode(1, parent_inode, path_name, child_inode);
   if (success < 0) {
     dprintf("...DIR not empty %d\n", success);
     osErrno = E_DIR_NOT_EMPTY;
     return(-1);
   }
-  printf("...DIR unlinked\n");
+  dprintf("...DIR unlinked\n");
+  return(0);
+}
+
+// copy the dirents of directory 'dir' into 'buffer'; return 0 if
+// successful, -1 if not
+static int dir_dirents(inode_t *dir, char *buffer) {
+  int out_pos = 0;
+  //now we need to read potentially many sectors into buffer; the dirent
+  //sectors of each block are read together, and the dirents of each
+  //sector copied over (fewer in the last, partially filled sector)
+  char blk_buf[MAX_BLOCK_SECTORS * SECTOR_SIZE];
+  int  groups = (dir->size + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR;
+  for (int g = 0; g < groups; g += BLOCK_SECTORS) {
+    int n = (groups - g < BLOCK_SECTORS) ? groups - g : BLOCK_SECTORS;
+    if (sectors_io(0, dir->data[g / BLOCK_SECTORS], n, blk_buf) < 0) {
+      return(-1);
+    }
+    for (int k = 0; k < n; k++) {
+      int left = dir->size - (g + k) * DIRENTS_PER_SECTOR;
+      if (left > DIRENTS_PER_SECTOR) {
+        left = DIRENTS_PER_SECTOR;
+      }
+      memcpy(buffer + out_pos, blk_buf + k * SECTOR_SIZE, left * sizeof(dirent_t));
+      out_pos += left * sizeof(dirent_t);
+    }
+  }
   return(0);
 }
 
@@ -1144,18 +4370,19 @@ int Dir_Unlink(char *path) {
  * used to find the size of the directory before calling Dir_Read() (described below) to find the
  * contents of the directory.
  */
-int Dir_Size(char *path) {
+static int dir_size(char *path) {
   /* YOUR CODE */
   char child_name[16]; child_name[15] = '\0';
   int  child_node;
   int  parent_node = follow_path(path, &child_node, child_name);
 
   dprintf("Dir_Size: followed path\n");
+  TRACE(TR_DIR_SIZE, child_node);
   if (parent_node < 0) {
     osErrno = E_NO_SUCH_DIR;
     return(-1);
   }
-  int  inode_sector = INODE_TABLE_START_SECTOR + child_node / INODES_PER_SECTOR;
+  int  inode_sector = inode_sector_of(child_node);
   char inode_buffer[SECTOR_SIZE];
 
   Disk_Read(inode_sector, inode_buffer);
@@ -1175,17 +4402,18 @@ int Dir_Size(char *path) {
  * E_BUFFER_TOO_SMALL. Otherwise, read the data into the buffer, and return the number of
  * directory entries that are in the directory (e.g., 2 if there are two entries in the directory).
  */
-int Dir_Read(char *path, void *buffer, int size) {
+static int dir_read(char *path, void *buffer, int size) {
   char child_name[16]; child_name[15] = '\0';
   int  child_node;
   int  parent_node = follow_path(path, &child_node, child_name);
 
   dprintf("Dir_Read: followed path\n");
+  TRACE(TR_DIR_READ, child_node, size);
   if (parent_node < 0) {
     osErrno = E_NO_SUCH_DIR;
     return(-1);
   }
-  int  inode_sector = INODE_TABLE_START_SECTOR + child_node / INODES_PER_SECTOR;
+  int  inode_sector = inode_sector_of(child_node);
   char inode_buffer[SECTOR_SIZE];
 
   if (Disk_Read(inode_sector, inode_buffer) < 0) {
@@ -1199,24 +4427,771 @@ int Dir_Read(char *path, void *buffer, int size) {
     return(-1);
   }
 
-  int out_pos = 0;
-  //now we need to read potentially many sectors into buffer
-  //first copy all dirents in full sectors
-  char sec_buf[SECTOR_SIZE];
-  for (int i = 0; i < child->size / DIRENTS_PER_SECTOR; i++) {
-    if (Disk_Read(child->data[i], sec_buf) < 0) {
-      return(-1);
+  if (dir_dirents(child, buffer) < 0) {
+    return(-1);
+  }
+  return(child->size);
+}
+static int dir_open_handle(char *path) {
+  dprintf("Dir_OpenHandle('%s'):\n", path);
+  int dh = 0;
+  while (dh < MAX_DIR_HANDLES && dir_handles[dh].used) {
+    dh++;
+  }
+  if (dh == MAX_DIR_HANDLES) {
+    dprintf("... max directory handles reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return(-1);
+  }
+
+  int      child_inode, inode_sector;
+  char     inode_buffer[SECTOR_SIZE];
+  inode_t *child = NULL;
+  if (follow_path(path, &child_inode, NULL) >= 0 && child_inode >= 0) {
+    child = inode_load(child_inode, &inode_sector, inode_buffer);
+  }
+  TRACE(TR_DIR_HANDLE, dh, child ? child_inode : -1);
+  if (child == NULL || child->type != 1) {
+    dprintf("... '%s' is not a directory\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return(-1);
+  }
+  dir_handles[dh].used  = 1;
+  dir_handles[dh].inode = child_inode;
+  return(dh);
+}
+static int dir_close_handle(int dh) {
+  dprintf("Dir_CloseHandle(%d):\n", dh);
+  if (!is_valid_dh(dh)) {
+    osErrno = E_BAD_FD;
+    return(-1);
+  }
+  dir_handles[dh].used = 0;
+  return(0);
+}
+
+// the entries of directory 'inode', or of 'path' if not NULL, for
+// FS_Walk(): the directory itself first (with no name), then one for
+// each dirent, with the type and size of its inode; a file gives only
+// itself. Return the number of entries put in 'out' (no more than
+// 'max'), or -1 if the inode is not in use (a directory removed after
+// it was reached, which the walk then skips)
+static int walk_dir(char *path, int inode, fs_net_dirent_t *out, int max) {
+  int      inode_sector, child_sector = -1;
+  char     inode_buffer[SECTOR_SIZE], child_buffer[SECTOR_SIZE];
+  inode_t *node = NULL;
+
+  if (path != NULL && follow_path(path, &inode, NULL) < 0) {
+    inode = -1;
+  }
+  TRACE(TR_WALK_DIR, inode);
+  // the bitmap is that of the live file system when a snapshot is
+  // booted, but then nothing is ever removed
+  if (inode >= 0 && inode < INODE_COUNT && max > 0 &&
+      (read_only || bitmap_test(INODE_BITMAP_START_SECTOR, inode) == 1)) {
+    node = inode_load(inode, &inode_sector, inode_buffer);
+  }
+  if (node == NULL) {
+    osErrno = E_NO_SUCH_DIR;
+    return(-1);
+  }
+  memset(&out[0], 0, sizeof(fs_net_dirent_t));
+  out[0].inode = inode;
+  out[0].type  = node->type;
+  out[0].size  = node->size;
+  if (node->type != 1 || node->size == 0) {
+    return(1);
+  }
+
+  dirent_t *dirents = malloc(node->size * sizeof(dirent_t));
+  if (dirents == NULL || dir_dirents(node, (char *)dirents) < 0) {
+    free(dirents);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  int n = 1;
+  for (int i = 0; i < node->size && n < max; i++) {
+    int child = dirents[i].inode;
+    if (dirents[i].fname[0] == '\0' || child <= 0 || child >= INODE_COUNT) {
+      continue;
+    }
+    // siblings tend to share inode table sectors
+    inode_t *c = (inode_t *)(child_buffer + (child % INODES_PER_SECTOR) * sizeof(inode_t));
+    if (inode_sector_of(child) != child_sector) {
+      child_sector = inode_sector_of(child);
+      if (Disk_Read(child_sector, child_buffer) < 0) {
+        child_sector = -1;
+        continue;
+      }
     }
-    memcpy(buffer + out_pos, sec_buf, DIRENTS_PER_SECTOR * sizeof(dirent_t));
-    out_pos += DIRENTS_PER_SECTOR * sizeof(dirent_t);
+    memcpy(out[n].fname, dirents[i].fname, MAX_NAME);
+    out[n].fname[MAX_NAME - 1] = '\0';
+    out[n].inode = child;
+    out[n].type  = c->type;
+    out[n].size  = c->size;
+    n++;
   }
-  //copy over the last, partially filled sector
-  int left = child->size % DIRENTS_PER_SECTOR;
-  if (left > 0) {
-    if (Disk_Read(child->data[child->size / DIRENTS_PER_SECTOR], sec_buf) < 0) {
-      return(-1);
+  free(dirents);
+  return(n);
+}
+
+/* the API functions proper: each call is made under the library
+   lock, and timed and counted in the statistics before the result is
+   passed back; in client mode (see
+   LibFSNet.h) the call is sent to the server instead of being run
+   here, and the time counted is that of the round trip */
+
+#define REMOTE    (fs_net_fd >= 0)
+
+int FS_Boot(char *path) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_BOOT, start, LOCKED(fs_boot(path))));
+}
+
+int FS_Sync() {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_SYNC, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_SYNC, 0, 0, NULL, NULL, 0, NULL, 0) :
+                     fs_sync())));
+}
+
+int FS_StatFS(FS_StatFS_t *stat) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_STATFS, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_STATFS, 0, 0, NULL, NULL, 0, stat, stat ? sizeof(*stat) : 0) :
+                     fs_statfs(stat))));
+}
+
+int FS_Check(int repair, int nthreads, FS_Check_t *result) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_CHECK, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_CHECK, repair, nthreads, NULL, NULL, 0, result, result ? sizeof(*result) : 0) :
+                     fs_check(repair, nthreads, result))));
+}
+
+int FS_Clean(int max_segments) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_CLEAN, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_CLEAN, max_segments, 0, NULL, NULL, 0, NULL, 0) :
+                     log_clean(max_segments))));
+}
+
+int FS_Defrag(int budget_ms, FS_Defrag_t *result) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DEFRAG, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DEFRAG, budget_ms, 0, NULL, NULL, 0, result, result ? sizeof(*result) : 0) :
+                     fs_defrag(budget_ms, result))));
+}
+
+int FS_Snapshot(char *name) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_SNAPSHOT, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_SNAPSHOT, 0, 0, name, NULL, 0, NULL, 0) :
+                     fs_snapshot(name))));
+}
+
+int File_Create(char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_CREATE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_CREATE, 0, 0, file, NULL, 0, NULL, 0) :
+                     file_create(-1, file))));
+}
+
+int File_Open(char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_OPEN, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_OPEN, 0, 0, file, NULL, 0, NULL, 0) :
+                     file_open(-1, file))));
+}
+
+int File_Read(int fd, void *buffer, int size) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_READ, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_READ, fd, size, NULL, NULL, 0, buffer, size) :
+                     file_read(fd, buffer, size))));
+}
+
+int File_Write(int fd, void *buffer, int size) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_WRITE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_WRITE, fd, size, NULL, buffer, size, NULL, 0) :
+                     file_write(fd, buffer, size))));
+}
+
+int File_Reserve(int fd, int size) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_RESERVE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_RESERVE, fd, size, NULL, NULL, 0, NULL, 0) :
+                     file_reserve(fd, size))));
+}
+
+int File_Seek(int fd, int offset) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_SEEK, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_SEEK, fd, offset, NULL, NULL, 0, NULL, 0) :
+                     file_seek(fd, offset))));
+}
+
+int File_Flush(int fd) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_FLUSH, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_FLUSH, fd, 0, NULL, NULL, 0, NULL, 0) :
+                     file_flush(fd))));
+}
+
+int File_Close(int fd) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_CLOSE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_CLOSE, fd, 0, NULL, NULL, 0, NULL, 0) :
+                     file_close(fd))));
+}
+
+int File_Unlink(char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_UNLINK, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_UNLINK, 0, 0, file, NULL, 0, NULL, 0) :
+                     file_unlink(-1, file))));
+}
+
+int File_Extents(char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_EXTENTS, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_EXTENTS, 0, 0, file, NULL, 0, NULL, 0) :
+                     file_extents(file))));
+}
+
+int File_Clone(char *src, char *dst) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_CLONE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_CLONE, 0, 0, src, dst, dst ? strlen(dst) + 1 : 0, NULL, 0) :
+                     file_clone(src, dst))));
+}
+
+int File_Link(char *old, char *new) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_LINK, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_LINK, 0, 0, old, new, new ? strlen(new) + 1 : 0, NULL, 0) :
+                     file_link(old, new))));
+}
+
+int File_Rename(char *old, char *new) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_RENAME, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_RENAME, 0, 0, old, new, new ? strlen(new) + 1 : 0, NULL, 0) :
+                     file_rename(old, new))));
+}
+
+int File_Compress(char *file, int on) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_COMPRESS, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_COMPRESS, on, 0, file, NULL, 0, NULL, 0) :
+                     file_compress(file, on))));
+}
+
+int Dir_Create(char *path) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_CREATE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_CREATE, 0, 0, path, NULL, 0, NULL, 0) :
+                     dir_create(-1, path))));
+}
+
+int Dir_Unlink(char *path) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_UNLINK, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_UNLINK, 0, 0, path, NULL, 0, NULL, 0) :
+                     dir_unlink(path))));
+}
+
+int Dir_Size(char *path) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_SIZE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_SIZE, 0, 0, path, NULL, 0, NULL, 0) :
+                     dir_size(path))));
+}
+
+int Dir_Read(char *path, void *buffer, int size) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_READ, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_READ, 0, size, path, NULL, 0, buffer, size) :
+                     dir_read(path, buffer, size))));
+}
+
+int Dir_OpenHandle(char *path) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_OPEN_HANDLE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_OPEN_HANDLE, 0, 0, path, NULL, 0, NULL, 0) :
+                     dir_open_handle(path))));
+}
+
+int Dir_CloseHandle(int dh) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_CLOSE_HANDLE, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_CLOSE_HANDLE, dh, 0, NULL, NULL, 0, NULL, 0) :
+                     dir_close_handle(dh))));
+}
+
+int File_CreateAt(int dh, char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_CREATE_AT, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_CREATE_AT, dh, 0, file, NULL, 0, NULL, 0) :
+                     file_create(dh, file))));
+}
+
+int File_OpenAt(int dh, char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_OPEN_AT, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_OPEN_AT, dh, 0, file, NULL, 0, NULL, 0) :
+                     file_open(dh, file))));
+}
+
+int File_UnlinkAt(int dh, char *file) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_FILE_UNLINK_AT, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_FILE_UNLINK_AT, dh, 0, file, NULL, 0, NULL, 0) :
+                     file_unlink(dh, file))));
+}
+
+int Dir_CreateAt(int dh, char *path) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_DIR_CREATE_AT, start, LOCKED(REMOTE ?
+                     fs_net_call(FS_OP_DIR_CREATE_AT, dh, 0, path, NULL, 0, NULL, 0) :
+                     dir_create(dh, path))));
+}
+
+/* FS_Walk(): the directories are scanned by inode, each in one locked
+   call (one round trip in client mode), and 'fn' is called without
+   the lock, so that it can use the library itself. With more than one
+   worker, a subdirectory goes into a bounded queue for whichever
+   worker is free; when the queue is full, the worker that found it
+   walks it there and then instead */
+
+#define WALK_QUEUE_MAX      256
+#define WALK_MAX_ENTRIES    (MAX_SECTORS_PER_FILE * MAX_BLOCK_SECTORS * DIRENTS_PER_SECTOR + 1)
+
+// a directory waiting to be scanned
+typedef struct {
+  char *path;
+  int   inode;
+  int   depth;
+} walk_item_t;
+
+typedef struct {
+  FS_WalkFn       fn;
+  void           *arg;
+  int             nworkers;
+  walk_item_t     queue[WALK_QUEUE_MAX];   // ring of directories
+  int             qhead, qcount;
+  int             busy;      // directories being scanned right now
+  int             stop;      // what 'fn' returned to stop the walk, 0 if not stopped
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} walk_t;
+
+int fs_walk_dir(char *path, int inode, fs_net_dirent_t *out, int max) {
+  return(LOCKED(walk_dir(path, inode, out, max)));
+}
+
+// the entries of a directory (see walk_dir()), from here or the server
+static int walk_load(char *path, int inode, fs_net_dirent_t *out) {
+  return(LOCKED(REMOTE ?
+                fs_net_call(FS_NET_WALK_DIR, inode, 0, path, NULL, 0, out,
+                            WALK_MAX_ENTRIES * sizeof(fs_net_dirent_t)) :
+                walk_dir(path, inode, out, WALK_MAX_ENTRIES)));
+}
+
+// queue a directory for the workers; return 0 if it can't be (there
+// are no other workers, or the queue is full)
+static int walk_enqueue(walk_t *walk, walk_item_t *item) {
+  int ok = 0;
+
+  if (walk->nworkers <= 1) {
+    return(0);
+  }
+  pthread_mutex_lock(&walk->lock);
+  if (walk->qcount < WALK_QUEUE_MAX && (item->path = strdup(item->path)) != NULL) {
+    walk->queue[(walk->qhead + walk->qcount++) % WALK_QUEUE_MAX] = *item;
+    pthread_cond_signal(&walk->cond);
+    ok = 1;
+  }
+  pthread_mutex_unlock(&walk->lock);
+  return(ok);
+}
+
+// call 'fn' on the 'n' entries of directory 'dir' after the first
+// (the directory itself; they are loaded here if 'ents' is NULL) and
+// go down the subdirectories it doesn't skip
+static void walk_entries(walk_t *walk, walk_item_t *dir, fs_net_dirent_t *ents, int n) {
+  int len    = strlen(dir->path);
+  int loaded = 0;
+
+  if (ents == NULL) {
+    ents   = malloc(WALK_MAX_ENTRIES * sizeof(fs_net_dirent_t));
+    n      = (ents != NULL) ? walk_load(NULL, dir->inode, ents) : -1;
+    loaded = 1;
+  }
+  for (int i = 1; i < n && walk->stop == 0; i++) {
+    char path[len + MAX_NAME + 1];
+    sprintf(path, "%s%s%s", dir->path, (len > 0 && dir->path[len - 1] == '/') ? "" : "/",
+            ents[i].fname);
+
+    FS_WalkEntry_t entry = { path, path + strlen(path) - strlen(ents[i].fname),
+                             ents[i].inode, ents[i].type, ents[i].size, dir->depth + 1 };
+    int ret = walk->fn(&entry, walk->arg);
+    if (ret < 0) {
+      __sync_bool_compare_and_swap(&walk->stop, 0, ret);
+    }else if (ret == 0 && ents[i].type == 1) {
+      walk_item_t sub = { path, ents[i].inode, dir->depth + 1 };
+      if (!walk_enqueue(walk, &sub)) {
+        walk_entries(walk, &sub, NULL, 0);
+      }
     }
-    memcpy(buffer + out_pos, sec_buf, left * sizeof(dirent_t));
   }
-  return(child->size);
+  if (loaded) {
+    free(ents);
+  }
+}
+
+// take directories off the queue until it is empty and no other
+// worker can add to it anymore
+static void *walk_worker(void *arg) {
+  walk_t *walk = (walk_t *)arg;
+
+  pthread_mutex_lock(&walk->lock);
+  for (;;) {
+    while (walk->qcount == 0 && walk->busy > 0) {
+      pthread_cond_wait(&walk->cond, &walk->lock);
+    }
+    if (walk->qcount == 0) {
+      break;
+    }
+    walk_item_t dir = walk->queue[walk->qhead];
+    walk->qhead = (walk->qhead + 1) % WALK_QUEUE_MAX;
+    walk->qcount--;
+    walk->busy++;
+    pthread_mutex_unlock(&walk->lock);
+
+    if (walk->stop == 0) {
+      walk_entries(walk, &dir, NULL, 0);
+    }
+    free(dir.path);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->busy--;
+    if (walk->busy == 0) {
+      pthread_cond_broadcast(&walk->cond);
+    }
+  }
+  pthread_mutex_unlock(&walk->lock);
+  return(NULL);
+}
+
+static int fs_walk(char *root, FS_WalkFn fn, void *arg, int flags) {
+  dprintf("FS_Walk('%s', %d):\n", root, flags);
+  if (root == NULL || fn == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  fs_net_dirent_t *ents = malloc(WALK_MAX_ENTRIES * sizeof(fs_net_dirent_t));
+  int              n    = (ents != NULL) ? walk_load(root, -1, ents) : -1;
+  if (n <= 0) {
+    free(ents);
+    osErrno = (ents != NULL) ? E_NO_SUCH_DIR : E_GENERAL;
+    return(-1);
+  }
+
+  walk_t walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.fn       = fn;
+  walk.arg      = arg;
+  walk.nworkers = FS_WALK_WORKERS(flags);
+  walk.busy     = 1;         // the root, scanned by the caller
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.cond, NULL);
+
+  char          *name = strrchr(root, '/');
+  FS_WalkEntry_t entry = { root, name ? name + 1 : root, ents[0].inode, ents[0].type,
+                           ents[0].size, 0 };
+  int            ret   = fn(&entry, arg);
+  if (ret < 0) {
+    walk.stop = ret;
+  }
+
+  // the caller is one of the workers
+  pthread_t threads[walk.nworkers + 1];
+  int       nthreads = 0;
+  while (nthreads < walk.nworkers - 1 &&
+         pthread_create(&threads[nthreads], NULL, walk_worker, &walk) == 0) {
+    nthreads++;
+  }
+  walk_item_t dir = { root, ents[0].inode, 0 };
+  if (ret == 0) {
+    walk_entries(&walk, &dir, ents, n);
+  }
+  free(ents);
+  pthread_mutex_lock(&walk.lock);
+  if (--walk.busy == 0) {
+    pthread_cond_broadcast(&walk.cond);
+  }
+  pthread_mutex_unlock(&walk.lock);
+  walk_worker(&walk);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&walk.lock);
+  pthread_cond_destroy(&walk.cond);
+  return(walk.stop);
+}
+
+int FS_Walk(char *root, FS_WalkFn fn, void *arg, int flags) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_WALK, start, fs_walk(root, fn, arg, flags)));
+}
+
+/* asynchronous calls: a request waits in a queue until a worker is
+   free and no other worker is running a request on the same inode;
+   taking the first such request from the head of the queue keeps the
+   requests of each inode in the order they were submitted */
+
+typedef struct _aio {
+  FS_Aio_t    *req;
+  int          key;    // the inode the request is on; -1 if none
+  struct _aio *next;
+} aio_t;
+
+#define AIO_MAX_WORKERS    64
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t  work;        // signaled when there may be work
+  pthread_cond_t  done;        // signaled when a request completes
+  aio_t          *queue;       // submitted requests, oldest first
+  aio_t         **queue_tail;
+  aio_t          *completed;   // completed requests, oldest first
+  aio_t         **completed_tail;
+  int             ncompleted;
+  int             inflight;    // submitted, and not yet completed
+  int             nworkers;
+  int             running[AIO_MAX_WORKERS];   // key of the request each worker runs
+  pthread_t       workers[AIO_MAX_WORKERS];
+  int             pipe[2];     // readable while 'completed' isn't empty
+  int             stop;
+} aio = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// the first queued request whose inode isn't busy, unlinked from the
+// queue; NULL if there is none
+static aio_t *aio_next() {
+  for (aio_t **p = &aio.queue; *p != NULL; p = &(*p)->next) {
+    int busy = 0;
+    for (int w = 0; w < aio.nworkers && (*p)->key >= 0 && !busy; w++) {
+      busy = aio.running[w] == (*p)->key;
+    }
+    if (!busy) {
+      aio_t *a = *p;
+      *p = a->next;
+      if (*p == NULL) {
+        aio.queue_tail = p;
+      }
+      return(a);
+    }
+  }
+  return(NULL);
+}
+
+static void *aio_worker(void *arg) {
+  int    w = (int)(long)arg;
+  aio_t *a;
+
+  pthread_mutex_lock(&aio.lock);
+  while (!aio.stop || aio.queue != NULL) {
+    if ((a = aio_next()) == NULL) {
+      pthread_cond_wait(&aio.work, &aio.lock);
+      continue;
+    }
+    aio.running[w] = a->key;
+    pthread_mutex_unlock(&aio.lock);
+
+    FS_Aio_t *req = a->req;
+    switch (req->op) {
+    case FS_AIO_OPEN:
+      req->ret = File_Open(req->path);
+      break;
+    case FS_AIO_READ:
+      req->ret = File_Read(req->fd, req->buffer, req->size);
+      break;
+    case FS_AIO_WRITE:
+      req->ret = File_Write(req->fd, req->buffer, req->size);
+      break;
+    case FS_AIO_CLOSE:
+      req->ret = File_Close(req->fd);
+      break;
+    default:
+      req->ret = -1;
+      osErrno  = E_GENERAL;
+    }
+    req->err = req->ret < 0 ? osErrno : 0;
+
+    pthread_mutex_lock(&aio.lock);
+    aio.running[w] = -1;
+    a->next = NULL;
+    *aio.completed_tail = a;
+    aio.completed_tail  = &a->next;
+    if (aio.ncompleted++ == 0) {
+      char c = 0;
+      if (write(aio.pipe[1], &c, 1) < 0) {
+        dprintf("aio_worker: can't write completion pipe\n");
+      }
+    }
+    aio.inflight--;
+    pthread_cond_broadcast(&aio.done);
+    // a request queued behind this one's inode may be runnable now
+    pthread_cond_broadcast(&aio.work);
+  }
+  pthread_mutex_unlock(&aio.lock);
+  return(NULL);
+}
+
+static int aio_start(int nworkers) {
+  if (nworkers <= 0) {
+    nworkers = 2;
+  }
+  pthread_mutex_lock(&aio.lock);
+  if (aio.nworkers > 0 || nworkers > AIO_MAX_WORKERS || pipe(aio.pipe) < 0) {
+    pthread_mutex_unlock(&aio.lock);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  aio.queue          = aio.completed = NULL;
+  aio.queue_tail     = &aio.queue;
+  aio.completed_tail = &aio.completed;
+  aio.ncompleted     = aio.inflight = aio.stop = 0;
+  for (int w = 0; w < nworkers; w++) {
+    aio.running[w] = -1;
+    if (pthread_create(&aio.workers[w], NULL, aio_worker, (void *)(long)w) != 0) {
+      break;
+    }
+    aio.nworkers++;
+  }
+  pthread_mutex_unlock(&aio.lock);
+  if (aio.nworkers == 0) {
+    close(aio.pipe[0]);
+    close(aio.pipe[1]);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  return(0);
+}
+
+int FS_AioStart(int nworkers) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_AIO_START, start, aio_start(nworkers)));
+}
+
+static int aio_submit(FS_Aio_t *req) {
+  aio_t *a;
+
+  if (req == NULL || aio.nworkers == 0 || (a = malloc(sizeof(aio_t))) == NULL) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  a->req  = req;
+  a->key  = -1;
+  a->next = NULL;
+  if (req->op != FS_AIO_OPEN) {
+    // a file descriptor of a remote file system only stands for itself
+    api_lock();
+    a->key = REMOTE ? MAX_INODES + req->fd : is_valid_fd(req->fd) ? open_files[req->fd].inode : -1;
+    api_unlock(0);
+  }
+
+  pthread_mutex_lock(&aio.lock);
+  *aio.queue_tail = a;
+  aio.queue_tail  = &a->next;
+  aio.inflight++;
+  pthread_cond_signal(&aio.work);
+  pthread_mutex_unlock(&aio.lock);
+  return(0);
+}
+
+int FS_AioSubmit(FS_Aio_t *req) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_AIO_SUBMIT, start, aio_submit(req)));
+}
+
+static int aio_wait(FS_Aio_t **done, int min, int max) {
+  int n = 0;
+
+  if (done == NULL || max < min) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  pthread_mutex_lock(&aio.lock);
+  while (aio.ncompleted < min && aio.inflight > 0) {
+    pthread_cond_wait(&aio.done, &aio.lock);
+  }
+  while (n < max && aio.completed != NULL) {
+    aio_t *a = aio.completed;
+    aio.completed = a->next;
+    done[n++]     = a->req;
+    free(a);
+    if (--aio.ncompleted == 0) {
+      char c;
+      aio.completed_tail = &aio.completed;
+      if (read(aio.pipe[0], &c, 1) < 0) {
+        dprintf("FS_AioWait: can't read completion pipe\n");
+      }
+    }
+  }
+  pthread_mutex_unlock(&aio.lock);
+  return(n);
+}
+
+int FS_AioWait(FS_Aio_t **done, int min, int max) {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_AIO_WAIT, start, aio_wait(done, min, max)));
+}
+
+static int aio_fd() {
+  if (aio.nworkers == 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  return(aio.pipe[0]);
+}
+
+int FS_AioFd() {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_AIO_FD, start, aio_fd()));
+}
+
+static int aio_stop() {
+  pthread_mutex_lock(&aio.lock);
+  if (aio.nworkers == 0) {
+    pthread_mutex_unlock(&aio.lock);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  // the workers finish what is queued before they quit
+  aio.stop = 1;
+  pthread_cond_broadcast(&aio.work);
+  pthread_mutex_unlock(&aio.lock);
+  for (int w = 0; w < aio.nworkers; w++) {
+    pthread_join(aio.workers[w], NULL);
+  }
+  aio.nworkers = 0;
+
+  // completions nobody picked up are dropped
+  while (aio.completed != NULL) {
+    aio_t *a = aio.completed;
+    aio.completed = a->next;
+    free(a);
+  }
+  close(aio.pipe[0]);
+  close(aio.pipe[1]);
+  return(0);
+}
+
+int FS_AioStop() {
+  uint64_t start = stats_clock();
+  return(stats_count(FS_OP_AIO_STOP, start, aio_stop()));
 }
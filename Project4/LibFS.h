@@ -20,41 +20,315 @@ typedef enum {
     E_DIR_NOT_EMPTY,
     E_ROOT_DIR,
     E_BUFFER_TOO_SMALL, 
+    E_READ_ONLY,    // booted from a snapshot
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors; each thread has its own, as the calls may be
+// made from several threads (see the asynchronous calls below)
+extern __thread int osErrno;
 
 // a few file system parameters
 
-// the total number of files and directories in the file system has a
-// maximum limit of 1000
+// the inode table has room for 1000 files and directories; past that
+// it grows on demand, with inodes taken from the data blocks 64 at a
+// time, up to 4096 in all (FS_StatFS() reports how many there are)
 #define MAX_FILES 1000
 
-// each file can have a maximum of 30 sectors; we treat the data
-// blocks of the file/director the same as sectors
+// each file can have a maximum of 30 sectors; the data blocks of the
+// file/directory are one sector each unless the disk was formatted
+// with a bigger block size (FSBLOCK_SIZE), in which case a file gets
+// fewer, bigger blocks
 #define MAX_SECTORS_PER_FILE 30
 
 // the size of a file or directory is limited
 #define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
 
+// capacity of the file system as reported by FS_StatFS(); the counts
+// come from the superblock, so no bitmap has to be scanned
+typedef struct {
+    int total_inodes;    // number of entries in the inode table
+    int free_inodes;     // number of unused entries in the inode table
+    int total_blocks;    // number of data blocks
+    int free_blocks;     // number of unused data blocks
+    int block_size;      // size of a block in bytes (a multiple of the sector size)
+    int saved_blocks;    // blocks saved by sharing: references to blocks past the first
+} FS_StatFS_t;
+
+// outcome of FS_Check(); inconsistencies found are printed as they
+// are found and counted in 'errors'
+typedef struct {
+    int inodes_used;        // inodes reachable from the root directory
+    int blocks_used;        // data blocks referenced by those inodes
+    int errors;             // number of inconsistencies found
+    int inode_bits_fixed;   // wrong bits in the inode bitmap
+    int sector_bits_fixed;  // wrong bits in the sector bitmap
+} FS_Check_t;
+
+// the calls counted by FS_GetStats()
+typedef enum {
+    FS_OP_BOOT,
+    FS_OP_SYNC,
+    FS_OP_STATFS,
+    FS_OP_CHECK,
+    FS_OP_CLEAN,
+    FS_OP_SNAPSHOT,
+    FS_OP_DEFRAG,
+    FS_OP_FILE_CREATE,
+    FS_OP_FILE_OPEN,
+    FS_OP_FILE_READ,
+    FS_OP_FILE_WRITE,
+    FS_OP_FILE_RESERVE,
+    FS_OP_FILE_SEEK,
+    FS_OP_FILE_FLUSH,
+    FS_OP_FILE_CLOSE,
+    FS_OP_FILE_UNLINK,
+    FS_OP_FILE_EXTENTS,
+    FS_OP_FILE_CLONE,
+    FS_OP_FILE_COMPRESS,
+    FS_OP_DIR_CREATE,
+    FS_OP_DIR_UNLINK,
+    FS_OP_DIR_SIZE,
+    FS_OP_DIR_READ,
+    FS_OP_DIR_OPEN_HANDLE,
+    FS_OP_DIR_CLOSE_HANDLE,
+    FS_OP_FILE_CREATE_AT,
+    FS_OP_FILE_OPEN_AT,
+    FS_OP_FILE_UNLINK_AT,
+    FS_OP_DIR_CREATE_AT,
+    FS_OP_FILE_RENAME,
+    FS_OP_FILE_LINK,
+    FS_OP_WALK,
+    FS_OP_TRACE_MASK,
+    FS_OP_TRACE_DUMP,
+    FS_OP_GET_STATS,
+    FS_OP_DUMP_STATS,
+    FS_OP_AIO_START,
+    FS_OP_AIO_SUBMIT,
+    FS_OP_AIO_WAIT,
+    FS_OP_AIO_FD,
+    FS_OP_AIO_STOP,
+    FS_NUM_OPS
+} FS_Op_t;
+
+// latency histograms have one bucket per power of two nanoseconds;
+// bucket i counts the calls that took [2^i, 2^(i+1)) ns (the last
+// bucket takes everything slower)
+#define FS_STATS_BUCKETS 32
+
+// statistics of one call
+typedef struct {
+    char               name[16];   // name of the call
+    unsigned long long calls;      // number of calls
+    unsigned long long errors;     // number of calls that returned -1
+    unsigned long long total_ns;   // time spent in all calls
+    unsigned long long hist[FS_STATS_BUCKETS];
+} FS_OpStats_t;
+
+// statistics reported by FS_GetStats(), since the process started
+typedef struct {
+    FS_OpStats_t op[FS_NUM_OPS];
+    unsigned long long path_components;    // path components resolved
+    unsigned long long dirents_scanned;    // dirents compared during lookups
+    unsigned long long bitmap_sectors;     // bitmap sectors read or written
+    unsigned long long inode_cache_hits;   // lookups finding the child inode in the cached sector
+    unsigned long long inode_cache_misses; // lookups having to load another inode sector
+    unsigned long long page_cache_hits;    // blocks read from pending (unflushed) pages
+    unsigned long long holes_read;         // blocks read from holes (zeros, no disk I/O)
+    unsigned long long cleaner_blocks_moved; // blocks copied by the log cleaner
+    unsigned long long clusters_read;      // clusters of compressed files decompressed
+    unsigned long long cluster_bytes;      // bytes of clusters of compressed files written
+    unsigned long long cluster_bytes_stored; // bytes of blocks they took
+    unsigned long long dedup_hits;         // blocks flushed sharing a block with the same content
+} FS_Stats_t;
+
 // file system generic calls
 int FS_Boot(char *path);
 int FS_Sync();
+int FS_StatFS(FS_StatFS_t *stat);
+int FS_Check(int repair, int nthreads, FS_Check_t *result);
+
+// on a disk formatted log-structured (FSLOG=1 in the environment when
+// the disk is created), blocks are never rewritten in place: new and
+// updated blocks are appended at the head of a log going round the
+// data blocks; FS_Clean() compacts up to 'max_segments' (0 for a
+// default) of the mostly empty segments of blocks left behind, moving
+// their live blocks to the head, and returns the number compacted (0
+// on a disk updated in place)
+int FS_Clean(int max_segments);
+
+// on a disk formatted deduplicating (FSDEDUP=1 in the environment when
+// the disk is created), a block flushed to a file with the same
+// content as a block already on disk shares that block instead of
+// taking one; FS_StatFS() reports the blocks saved by sharing
+
+// FS_Snapshot() takes a snapshot of the file system under the given
+// name (a legal file name; at most 8 snapshots): a point-in-time view
+// that shares all its blocks with the file system until they change.
+// Booting "DISK@NAME" mounts snapshot NAME of DISK read-only: calls
+// that would change anything fail with E_READ_ONLY, and FS_Sync()
+// writes nothing back
+int FS_Snapshot(char *name);
+
+// outcome of FS_Defrag(), over the files and directories it looked at;
+// an extent is a run of blocks one after the other on disk
+typedef struct {
+    int inodes;             // files and directories looked at
+    int extents_before;     // extents they were made of
+    int extents_after;      // and are made of now
+    int fragmented_before;  // of them, those made of more than one extent
+    int fragmented_after;
+    int inodes_moved;       // files and directories given one extent
+    int blocks_moved;       // blocks copied to do so
+    int done;               // 1 if all of them were looked at
+} FS_Defrag_t;
+
+// FS_Defrag() moves the blocks of each file and directory into a
+// single run of free blocks, for up to 'budget_ms' milliseconds (0 for
+// no limit); when it runs out of time, the next call carries on from
+// there. The blocks are copied before the inode refers to them, and
+// the old ones freed after. Files sharing blocks are left alone
+int FS_Defrag(int budget_ms, FS_Defrag_t *result);
+
+// an entry reached by FS_Walk()
+typedef struct {
+    char *path;     // its path, starting with the root walked
+    char *name;     // its last component (within 'path')
+    int   inode;
+    int   type;     // 0 for a file, 1 for a directory
+    int   size;     // bytes of a file (as last flushed), dirents of a directory
+    int   depth;    // 0 for the root walked, 1 for its entries, and so on
+} FS_WalkEntry_t;
+
+// what FS_Walk() calls for each entry; it returns 0 to carry on, more
+// than 0 to skip what is below a directory, less than 0 to stop
+typedef int (*FS_WalkFn)(FS_WalkEntry_t *entry, void *arg);
 
-// file ops
+// the flags of FS_Walk(): the number of worker threads (0 or 1 for
+// none, up to 255)
+#define FS_WALK_WORKERS(n)    ((n) & 0xff)
+
+// FS_Walk() calls 'fn' with 'arg' for 'root' and everything below it,
+// a directory before its entries. The directories are read by inode,
+// each in one call, rather than resolving the path of each; 'fn' is
+// called outside the library lock and may use the library. With
+// workers (FS_WALK_WORKERS(n) in 'flags'), the subdirectories are
+// handed out to them, and 'fn' is called from several threads at once,
+// in no particular order. Return 0 once all was walked, -1 if 'root'
+// doesn't exist, or the value 'fn' returned to stop the walk
+int FS_Walk(char *root, FS_WalkFn fn, void *arg, int flags);
+
+// tracing (see LibFSTrace.h); both fail if the library was built
+// without FSTRACE=1; FS_TraceMask() returns the previous mask (a
+// negative mask leaves it as it is)
+int FS_TraceMask(int mask);
+int FS_TraceDump(char *file);
+
+// statistics; FS_DumpStats() saves them in a file for fs-stats, which
+// also happens at exit if the FSSTATS_FILE environment variable names
+// a file when the file system is booted
+int FS_GetStats(FS_Stats_t *stats);
+int FS_DumpStats(char *file);
+
+// file ops; File_Seek() may go past the end of the file (up to
+// MAX_FILE_SIZE), and a write there leaves a hole in between, which
+// takes no blocks and reads as zeros
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
+int File_Reserve(int fd, int size);
 int File_Seek(int fd, int offset);
+int File_Flush(int fd);
 int File_Close(int fd);
 int File_Unlink(char *file);
 
+// File_Extents() returns the number of extents (runs of blocks one
+// after the other on disk) the blocks of a file make, as flushed; 1
+// for a file in one piece, 0 for one without blocks
+int File_Extents(char *file);
+
+// File_Clone() creates file 'dst' with the content of file 'src'
+// without copying it: the two share their blocks until either writes
+// to one, which then gets a copy of its own
+int File_Clone(char *src, char *dst);
+
+// File_Rename() moves a file or directory to a new path, in the same
+// directory or another one, by moving its dirent: nothing it holds is
+// copied. The new path must not exist yet, and a directory can't be
+// moved under itself
+int File_Rename(char *old, char *new);
+
+// File_Link() gives file 'old' another name, 'new' (which must not
+// exist yet): a second dirent for the same inode, which counts its
+// dirents (up to 256). File_Unlink() removes one of them, and the file
+// itself only goes with the last one
+int File_Link(char *old, char *new);
+
+// File_Compress() turns the compression of a file on or off, rewriting
+// what it holds. The data of a compressed file is compressed in
+// clusters of 4 blocks, each taking as few blocks as it compresses to
+// (or 4 if it doesn't compress); a read decompresses only the
+// clusters it touches, and a write rewrites them. A compressed file
+// has no use for File_Reserve(), which does nothing to it
+int File_Compress(char *file, int on);
+
 // directory ops
 int Dir_Create(char *path);
 int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// directory handles: Dir_OpenHandle() resolves the path of a directory
+// once and returns a handle on it, and the *At() calls take a path
+// relative to that directory (an absolute path still starts from the
+// root), so that many calls in a deep directory don't each walk down
+// to it again. A directory can't be removed while it has a handle
+// open (E_FILE_IN_USE); Dir_CloseHandle() gives the handle back
+int Dir_OpenHandle(char *path);
+int Dir_CloseHandle(int dh);
+int File_CreateAt(int dh, char *file);
+int File_OpenAt(int dh, char *file);
+int File_UnlinkAt(int dh, char *file);
+int Dir_CreateAt(int dh, char *path);
+
+// asynchronous calls: a request is submitted to a queue and run by a
+// pool of worker threads, and its completion is picked up later with
+// FS_AioWait(); requests on the same file (the same inode, whichever
+// file descriptor is used) complete in the order they were submitted,
+// others in any order. The calls of the library run one at a time
+// whichever thread makes them, so this does not make the file system
+// faster; it lets the caller get on with other work meanwhile
+typedef enum {
+    FS_AIO_OPEN,     // File_Open(path)
+    FS_AIO_READ,     // File_Read(fd, buffer, size)
+    FS_AIO_WRITE,    // File_Write(fd, buffer, size)
+    FS_AIO_CLOSE,    // File_Close(fd)
+} FS_AioOp_t;
+
+// a request; it belongs to the library from FS_AioSubmit() until it
+// is returned by FS_AioWait()
+typedef struct {
+    int   op;       // FS_AioOp_t
+    int   fd;
+    char *path;
+    void *buffer;
+    int   size;
+    void *data;     // for the caller; left alone
+    int   ret;      // what the call returned
+    int   err;      // osErrno, if the call failed
+} FS_Aio_t;
+
+// FS_AioStart() starts the workers (2 if 'nworkers' is 0), and
+// FS_AioStop() waits for the requests in flight and stops them;
+// FS_AioWait() waits until at least 'min' requests have completed (or
+// none is left in flight), puts up to 'max' of them in 'done' and
+// returns how many it did (min 0 polls without waiting); the file
+// descriptor returned by FS_AioFd() is readable while completions are
+// waiting to be picked up, for use with poll() or select()
+int FS_AioStart(int nworkers);
+int FS_AioSubmit(FS_Aio_t *req);
+int FS_AioWait(FS_Aio_t **done, int min, int max);
+int FS_AioFd();
+int FS_AioStop();
+
 #endif /* __LibFS_h__ */
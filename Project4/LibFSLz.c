@@ -0,0 +1,95 @@
+#include "LibFSLz.h"
+
+// hash of the 3 bytes starting at 'p'
+static int lz_hash(const unsigned char *p) {
+  unsigned int v = p[0] | p[1] << 8 | p[2] << 16;
+  return((v * 2654435761u) >> (32 - FS_LZ_HASH_BITS));
+}
+
+int fs_lz_compress(const char *src, int n, char *dst, int cap) {
+  const unsigned char *in  = (const unsigned char *)src;
+  unsigned char       *out = (unsigned char *)dst;
+  int                  head[1 << FS_LZ_HASH_BITS];
+  int                  i = 0, o = 0, ctrl = 0, bit = 8;
+
+  for (int h = 0; h < (1 << FS_LZ_HASH_BITS); h++) {
+    head[h] = -1;
+  }
+  while (i < n) {
+    if (bit == 8) {
+      if (o >= cap) {
+        return(-1);
+      }
+      ctrl      = o++;
+      out[ctrl] = 0;
+      bit       = 0;
+    }
+    // the last position with the same hash is the only candidate
+    int len = 0, dist = 0;
+    if (i + FS_LZ_MIN_MATCH <= n) {
+      int h    = lz_hash(in + i);
+      int cand = head[h];
+      head[h] = i;
+      if (cand >= 0 && i - cand <= FS_LZ_WINDOW) {
+        int max = (n - i < FS_LZ_MAX_MATCH) ? n - i : FS_LZ_MAX_MATCH;
+        while (len < max && in[cand + len] == in[i + len]) {
+          len++;
+        }
+        dist = i - cand;
+      }
+    }
+    if (len >= FS_LZ_MIN_MATCH) {
+      if (o + 2 > cap) {
+        return(-1);
+      }
+      out[ctrl] |= 1 << bit;
+      out[o++]   = (dist - 1) >> 4;
+      out[o++]   = ((dist - 1) & 0x0f) << 4 | (len - FS_LZ_MIN_MATCH);
+      // the positions inside the match can be matched later on
+      for (int k = 1; k < len && i + k + FS_LZ_MIN_MATCH <= n; k++) {
+        head[lz_hash(in + i + k)] = i + k;
+      }
+      i += len;
+    }else {
+      if (o >= cap) {
+        return(-1);
+      }
+      out[o++] = in[i++];
+    }
+    bit++;
+  }
+  return(o);
+}
+
+int fs_lz_decompress(const char *src, int n, char *dst, int cap) {
+  const unsigned char *in  = (const unsigned char *)src;
+  unsigned char       *out = (unsigned char *)dst;
+  int                  i = 0, o = 0;
+
+  while (i < n) {
+    int ctrl = in[i++];
+    for (int bit = 0; bit < 8 && i < n; bit++) {
+      if ((ctrl & (1 << bit)) == 0) {
+        if (o >= cap) {
+          return(-1);
+        }
+        out[o++] = in[i++];
+        continue;
+      }
+      if (i + 2 > n) {
+        return(-1);
+      }
+      int dist = (in[i] << 4 | in[i + 1] >> 4) + 1;
+      int len  = (in[i + 1] & 0x0f) + FS_LZ_MIN_MATCH;
+      i += 2;
+      if (dist > o || o + len > cap) {
+        return(-1);
+      }
+      // byte by byte, as a match may overlap what it produces
+      for (int k = 0; k < len; k++, o++) {
+        out[o] = out[o - dist];
+      }
+    }
+  }
+  return(o);
+}
@@ -0,0 +1,34 @@
+//
+// LibFSLz.h
+//
+// The compressor of the clusters of compressed files (see
+// File_Compress() in LibFS.h): a small LZSS. The output is a sequence
+// of groups, each a control byte followed by up to 8 tokens, bit i of
+// the control byte (from the least significant one) telling whether
+// token i is a literal (0: one byte, copied as it is) or a match (1:
+// two bytes, a 12-bit distance minus one followed by a 4-bit length
+// minus FS_LZ_MIN_MATCH, copying that many bytes from that far back in
+// the output). Matches are found with a hash of the next 3 bytes,
+// keeping the last position of each hash only: it compresses less
+// than the real thing, but it's fast and needs no memory besides the
+// hash table.
+//
+
+#ifndef __LibFSLz_h__
+#define __LibFSLz_h__
+
+#define FS_LZ_WINDOW       4096     // farthest a match can reach back
+#define FS_LZ_MIN_MATCH    3
+#define FS_LZ_MAX_MATCH    (FS_LZ_MIN_MATCH + 15)
+#define FS_LZ_HASH_BITS    12
+
+// compress the 'n' bytes of 'src' into 'dst' and return the length of
+// the output, or -1 if it would take more than 'cap' bytes
+int fs_lz_compress(const char *src, int n, char *dst, int cap);
+
+// decompress the 'n' bytes of 'src' into 'dst' and return the length
+// of the output, or -1 if it would take more than 'cap' bytes or the
+// input is corrupt
+int fs_lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif /* __LibFSLz_h__ */
@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+// the socket connected to fs-server, if the file system is remote
+int fs_net_fd = -1;
+
+int fs_net_read_full(int fd, void *buf, int len) {
+  char *p = buf;
+
+  while (len > 0) {
+    int n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return(-1);
+    }
+    p   += n;
+    len -= n;
+  }
+  return(0);
+}
+
+int fs_net_write_full(int fd, void *buf, int len) {
+  char *p = buf;
+
+  while (len > 0) {
+    int n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return(-1);
+    }
+    p   += n;
+    len -= n;
+  }
+  return(0);
+}
+
+int fs_net_connect(char *socket_path) {
+  struct sockaddr_un addr;
+  int                fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (fs_net_fd >= 0) {
+    close(fs_net_fd);
+  }
+  fs_net_fd = fd;
+  return(0);
+}
+
+// send one request to the server and wait for the reply; the data of
+// the reply (at most 'outlen' bytes of it) goes into 'out'. A broken
+// connection fails the call with E_GENERAL
+int fs_net_call(int op, int arg0, int arg1, char *path,
+                void *data, int dlen, void *out, int outlen) {
+  fs_net_req_t req;
+  fs_net_rsp_t rsp;
+  struct iovec iov[3];
+  int          plen = path ? strlen(path) : 0;
+
+  if (plen > 0xffff || dlen < 0 || dlen > FS_NET_MAX_DATA) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  req.op     = op;
+  req.plen   = plen;
+  req.arg[0] = arg0;
+  req.arg[1] = arg1;
+  req.dlen   = dlen;
+
+  // the whole request goes out in one system call
+  iov[0].iov_base = &req;
+  iov[0].iov_len  = sizeof(req);
+  iov[1].iov_base = path;
+  iov[1].iov_len  = plen;
+  iov[2].iov_base = data;
+  iov[2].iov_len  = dlen;
+  int n = writev(fs_net_fd, iov, 3);
+  if (n < 0 && errno != EINTR) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  if (n < 0) {
+    n = 0;
+  }
+  // a short write of a big request: send the rest piece by piece
+  for (int i = 0; i < 3; i++) {
+    if (n >= (int)iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      continue;
+    }
+    if (fs_net_write_full(fs_net_fd, (char *)iov[i].iov_base + n, iov[i].iov_len - n) < 0) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    n = 0;
+  }
+
+  if (fs_net_read_full(fs_net_fd, &rsp, sizeof(rsp)) < 0 || rsp.dlen > FS_NET_MAX_DATA) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  int keep = (int)rsp.dlen < outlen ? (int)rsp.dlen : outlen;
+  if (keep > 0 && fs_net_read_full(fs_net_fd, out, keep) < 0) {
+    osErrno = E_GENERAL;
+    return(-1);
+  }
+  // drop whatever does not fit
+  for (int left = rsp.dlen - keep; left > 0; ) {
+    char junk[512];
+    int  len = left < (int)sizeof(junk) ? left : (int)sizeof(junk);
+    if (fs_net_read_full(fs_net_fd, junk, len) < 0) {
+      osErrno = E_GENERAL;
+      return(-1);
+    }
+    left -= len;
+  }
+  if (rsp.ret < 0) {
+    osErrno = rsp.err;
+  }
+  return(rsp.ret);
+}
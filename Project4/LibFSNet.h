@@ -0,0 +1,76 @@
+//
+// LibFSNet.h
+//
+// Protocol between fs-server, which keeps a disk image booted, and
+// the library in client mode. A program becomes a client by booting
+// a "unix:SOCKET" path instead of a disk image; every API call then
+// turns into one request on the socket and one reply.
+//
+// A request is a fs_net_req_t header, followed by 'plen' bytes of the
+// path (without a terminating null) and 'dlen' bytes of data (what
+// File_Write writes; the *At() calls carry the directory handle as
+// their first argument). A reply is a fs_net_rsp_t header followed by
+// 'dlen' bytes of data (what File_Read, Dir_Read, FS_StatFS, FS_Check,
+// FS_Defrag or FS_GetStats return). All fields are in host byte order,
+// as both ends run on the same machine.
+//
+
+#ifndef __LibFSNet_h__
+#define __LibFSNet_h__
+
+#include <stdint.h>
+#include <string.h>
+
+// prefix of a boot path naming the socket of a server, and whether a
+// boot path is one (the tools then leave it to the server to write its
+// image back, instead of calling FS_Sync() as they exit)
+#define FS_NET_PREFIX      "unix:"
+#define FS_NET_PATH(path)  (strncmp((path), FS_NET_PREFIX, strlen(FS_NET_PREFIX)) == 0)
+
+// requests are the FS_Op_t calls (except FS_OP_BOOT), and these
+#define FS_NET_GET_STATS   FS_NUM_OPS   // FS_GetStats() of the server
+#define FS_NET_WALK_DIR    (FS_NUM_OPS + 1)   // a directory for FS_Walk()
+
+// the most data carried by one request or reply
+#define FS_NET_MAX_DATA    (1 << 20)
+
+typedef struct {
+  uint16_t op;       // FS_Op_t, or FS_NET_GET_STATS
+  uint16_t plen;     // length of the path
+  int32_t  arg[2];   // integer arguments, e.g., fd and size
+  uint32_t dlen;     // length of the data
+} fs_net_req_t;
+
+typedef struct {
+  int32_t  ret;      // what the call returned
+  int32_t  err;      // osErrno, if the call failed
+  uint32_t dlen;     // length of the data
+} fs_net_rsp_t;
+
+// an entry of the reply to FS_NET_WALK_DIR, which is the directory
+// whose inode is the first argument (or the one the path leads to, if
+// there is a path) followed by its dirents
+typedef struct {
+  char    fname[16];
+  int32_t inode;
+  int32_t type;      // 0 for a file, 1 for a directory
+  int32_t size;
+} fs_net_dirent_t;
+
+// server side, in LibFS.c: the reply to FS_NET_WALK_DIR, at most
+// 'max' entries; the number of entries, or -1
+int fs_walk_dir(char *path, int inode, fs_net_dirent_t *out, int max);
+
+// client side, in LibFSNet.c; the socket of the server is fs_net_fd,
+// or -1 if the file system is local
+extern int fs_net_fd;
+int fs_net_connect(char *socket_path);
+int fs_net_call(int op, int arg0, int arg1, char *path,
+                void *data, int dlen, void *out, int outlen);
+
+// reads or writes exactly 'len' bytes; 0 on success, -1 on error or
+// end of file
+int fs_net_read_full(int fd, void *buf, int len);
+int fs_net_write_full(int fd, void *buf, int len);
+
+#endif /* __LibFSNet_h__ */
@@ -0,0 +1,97 @@
+//
+// LibFSTrace.h
+//
+// Binary trace events of the file system library. When the library
+// is built with FSTRACE=1, each event that is enabled in the runtime
+// mask (FS_TraceMask(), or the FSTRACE_MASK environment variable read
+// at boot) is recorded as a fixed-size record in a ring buffer in
+// memory; FS_TraceDump() (or the FSTRACE_FILE environment variable,
+// dumped at exit) saves the ring to a file, which fs-trace decodes.
+// With FSTRACE=0 (the default) the trace points compile to nothing.
+//
+
+#ifndef __LibFSTrace_h__
+#define __LibFSTrace_h__
+
+#include <stdint.h>
+
+// event classes, one bit each in the runtime mask
+#define TRACE_API       0x01   // entry to the API calls
+#define TRACE_PATH      0x02   // path resolution
+#define TRACE_ALLOC     0x04   // inode and sector bitmaps
+#define TRACE_DELALLOC  0x08   // delayed allocation of written blocks
+#define TRACE_ALL       0xff
+
+// the events: identifier, class, and the format used by the decoder
+// for its (up to four integer) arguments
+#define FS_TRACE_EVENTS(X) \
+  X(TR_BOOT,          TRACE_API,      "formatted=%d") \
+  X(TR_SYNC,          TRACE_API,      "pending=%d") \
+  X(TR_FILE_CREATE,   TRACE_API,      "") \
+  X(TR_FILE_OPEN,     TRACE_API,      "fd=%d inode=%d size=%d") \
+  X(TR_FILE_READ,     TRACE_API,      "fd=%d pos=%d size=%d") \
+  X(TR_FILE_WRITE,    TRACE_API,      "fd=%d pos=%d size=%d") \
+  X(TR_FILE_RESERVE,  TRACE_API,      "fd=%d size=%d") \
+  X(TR_FILE_SEEK,     TRACE_API,      "fd=%d offset=%d") \
+  X(TR_FILE_FLUSH,    TRACE_API,      "fd=%d") \
+  X(TR_FILE_CLOSE,    TRACE_API,      "fd=%d") \
+  X(TR_FILE_UNLINK,   TRACE_API,      "parent=%d inode=%d") \
+  X(TR_FILE_CLONE,    TRACE_API,      "src=%d dst=%d size=%d") \
+  X(TR_FILE_COMPRESS, TRACE_API,      "inode=%d on=%d size=%d") \
+  X(TR_FILE_RENAME,   TRACE_API,      "inode=%d from=%d to=%d") \
+  X(TR_FILE_LINK,     TRACE_API,      "inode=%d parent=%d") \
+  X(TR_DIR_CREATE,    TRACE_API,      "") \
+  X(TR_DIR_UNLINK,    TRACE_API,      "parent=%d inode=%d") \
+  X(TR_DIR_SIZE,      TRACE_API,      "inode=%d") \
+  X(TR_DIR_READ,      TRACE_API,      "inode=%d size=%d") \
+  X(TR_DIR_HANDLE,    TRACE_API,      "handle=%d inode=%d") \
+  X(TR_WALK_DIR,      TRACE_API,      "inode=%d") \
+  X(TR_LOOKUP,        TRACE_PATH,     "parent=%d child=%d dirents=%d") \
+  X(TR_INODE_ADD,     TRACE_PATH,     "type=%d parent=%d inode=%d") \
+  X(TR_INODE_REMOVE,  TRACE_PATH,     "type=%d parent=%d inode=%d") \
+  X(TR_BITMAP_SET,    TRACE_ALLOC,    "bitmap=%d bit=%d") \
+  X(TR_BITMAP_RUN,    TRACE_ALLOC,    "bitmap=%d bit=%d len=%d want=%d") \
+  X(TR_BITMAP_RESET,  TRACE_ALLOC,    "bitmap=%d bit=%d") \
+  X(TR_INODE_TABLE,   TRACE_ALLOC,    "initialized=%d") \
+  X(TR_INODE_CHUNK,   TRACE_ALLOC,    "chunks=%d sector=%d") \
+  X(TR_PAGE_NEW,      TRACE_DELALLOC, "inode=%d block=%d pending=%d") \
+  X(TR_PAGE_FLUSH,    TRACE_DELALLOC, "inode=%d block=%d sector=%d len=%d") \
+  X(TR_LOG_REDIRECT,  TRACE_DELALLOC, "inode=%d block=%d sector=%d") \
+  X(TR_LOG_CLEAN,     TRACE_ALLOC,    "segment=%d live=%d head=%d") \
+  X(TR_SNAPSHOT,      TRACE_API,      "snapshot=%d map=%d") \
+  X(TR_DEFRAG,        TRACE_API,      "budget=%d from=%d") \
+  X(TR_DEFRAG_MOVE,   TRACE_ALLOC,    "inode=%d extents=%d sector=%d len=%d") \
+  X(TR_SNAP_COPY,     TRACE_ALLOC,    "snapshot=%d table_sector=%d copy=%d") \
+  X(TR_CLUSTER_FLUSH, TRACE_DELALLOC, "inode=%d cluster=%d bytes=%d blocks=%d") \
+  X(TR_DEDUP_HIT,     TRACE_DELALLOC, "inode=%d block=%d sector=%d")
+
+#define FS_TRACE_ID(id, cls, fmt)     id,
+#define FS_TRACE_CLASS(id, cls, fmt)  id##_CLASS = cls,
+enum { FS_TRACE_EVENTS(FS_TRACE_ID) TR_NUM_EVENTS };
+enum { FS_TRACE_EVENTS(FS_TRACE_CLASS) };
+#undef FS_TRACE_ID
+#undef FS_TRACE_CLASS
+
+// a trace record; 'seq' is the position of the record in the stream
+// of all events, so that the decoder can put the ring back in order
+typedef struct {
+  uint64_t ns;       // CLOCK_MONOTONIC time of the event
+  uint32_t seq;      // sequence number
+  uint16_t event;    // one of the TR_* events
+  uint16_t tid;      // low bits of the thread id
+  int32_t  arg[4];   // event arguments
+} fs_trace_rec_t;
+
+// number of records in the ring (a power of two)
+#define FS_TRACE_RING_SIZE    (1 << 14)
+
+// a dump file consists of this header followed by the whole ring
+#define FS_TRACE_MAGIC        0x46535452   // "FSTR"
+typedef struct {
+  uint32_t magic;
+  uint32_t ring_size;   // number of records that follow
+  uint32_t head;        // sequence number of the next record
+  uint32_t mask;        // event classes that were enabled
+} fs_trace_hdr_t;
+
+#endif /* __LibFSTrace_h__ */
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// the largest number of operations timed in one workload
+#define MAX_OPS 20000
+
+// latencies (in ns) of the operations of the current workload
+static double lat[MAX_OPS];
+static int nops;
+static double bench_start;
+static long long bench_bytes;
+// extents per file of the workload, if it measures them (-1 if not)
+static double bench_extents;
+
+// the seed of the pseudo-random workloads; the same seed gives the
+// same sequence of operations
+static unsigned int seed = 1;
+
+// the block size the disk is formatted with, and whether it's
+// log-structured
+static int block_size = SECTOR_SIZE;
+static int log_mode;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-s seed] [-w workload] [-b block_size] [-l] [disk]\n", prog);
+  exit(1);
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int next_rand()
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+void begin()
+{
+  nops = 0;
+  bench_bytes = 0;
+  bench_extents = -1;
+  bench_start = now();
+}
+
+// record the latency of one operation started at 't'
+void op(double t)
+{
+  if(nops < MAX_OPS) lat[nops++] = now() - t;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(double*)a, y = *(double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// print the result of the workload as one JSON object per line
+void end(char *name, int chunk)
+{
+  double secs = (now() - bench_start) / 1e9;
+  qsort(lat, nops, sizeof(double), cmp_double);
+  double p50 = nops ? lat[nops/2] / 1e3 : 0;
+  double p99 = nops ? lat[(int)(nops*0.99)] / 1e3 : 0;
+  printf("{\"workload\":\"%s\",\"block\":%d,\"log\":%d,\"chunk\":%d,\"ops\":%d,\"secs\":%.6f,"
+	 "\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+	 "\"bytes\":%lld,\"mb_per_sec\":%.2f",
+	 name, block_size, log_mode, chunk, nops, secs, secs > 0 ? nops/secs : 0, p50, p99,
+	 bench_bytes, secs > 0 ? bench_bytes/secs/1e6 : 0);
+  if(bench_extents >= 0) printf(",\"extents_per_file\":%.2f", bench_extents);
+  printf("}\n");
+  fflush(stdout);
+}
+
+void fail(char *what, char *path)
+{
+  fprintf(stderr, "ERROR: %s '%s' failed (osErrno=%d)\n", what, path, osErrno);
+  exit(-2);
+}
+
+// create and then unlink many files in one directory
+void bench_create_unlink()
+{
+  int n = 600;
+  char path[64];
+  if(Dir_Create("/storm") < 0) fail("Dir_Create", "/storm");
+
+  begin();
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/storm/f%d", i);
+    double t = now();
+    if(File_Create(path) < 0) fail("File_Create", path);
+    op(t);
+  }
+  end("create", 0);
+
+  begin();
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/storm/f%d", (i*7919) % n);   // not in creation order
+    double t = now();
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+    op(t);
+  }
+  end("unlink", 0);
+
+  if(Dir_Unlink("/storm") < 0) fail("Dir_Unlink", "/storm");
+}
+
+// open (and close) a file at the bottom of a deep directory tree, by
+// its path and through a handle on its directory
+void bench_deep_open()
+{
+  int depth = 12;
+  char path[256] = "";
+  for(int i=0; i<depth; i++) {
+    sprintf(path + strlen(path), "/level-%d", i);
+    if(Dir_Create(path) < 0) fail("Dir_Create", path);
+  }
+  strcat(path, "/leaf");
+  if(File_Create(path) < 0) fail("File_Create", path);
+
+  begin();
+  for(int i=0; i<5000; i++) {
+    double t = now();
+    int fd = File_Open(path);
+    if(fd < 0) fail("File_Open", path);
+    op(t);
+    File_Close(fd);
+  }
+  end("deep_open", 0);
+
+  // the same through a handle on its directory, resolved once
+  *strrchr(path, '/') = '\0';
+  int dh = Dir_OpenHandle(path);
+  if(dh < 0) fail("Dir_OpenHandle", path);
+  begin();
+  for(int i=0; i<5000; i++) {
+    double t = now();
+    int fd = File_OpenAt(dh, "leaf");
+    if(fd < 0) fail("File_OpenAt", "leaf");
+    op(t);
+    File_Close(fd);
+  }
+  end("deep_open_at", 0);
+  if(Dir_CloseHandle(dh) < 0) fail("Dir_CloseHandle", path);
+  strcat(path, "/leaf");
+
+  if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  for(int i=depth; i>0; i--) {
+    *strrchr(path, '/') = '\0';
+    if(Dir_Unlink(path) < 0) fail("Dir_Unlink", path);
+  }
+}
+
+// sequential and random reads and writes of whole files with the
+// given chunk size
+void bench_rw(int chunk)
+{
+  int nfiles = 20;
+  char path[64];
+  char *buf = malloc(MAX_FILE_SIZE);
+  memset(buf, 'x', MAX_FILE_SIZE);
+  int per_file = MAX_FILE_SIZE / chunk;
+
+  begin();
+  for(int f=0; f<nfiles; f++) {
+    sprintf(path, "/rw-%d", f);
+    if(File_Create(path) < 0) fail("File_Create", path);
+    int fd = File_Open(path);
+    if(fd < 0) fail("File_Open", path);
+    for(int i=0; i<per_file; i++) {
+      double t = now();
+      if(File_Write(fd, buf, chunk) != chunk) fail("File_Write", path);
+      op(t);
+      bench_bytes += chunk;
+    }
+    File_Close(fd);
+  }
+  end("seq_write", chunk);
+
+  begin();
+  for(int f=0; f<nfiles; f++) {
+    sprintf(path, "/rw-%d", f);
+    int fd = File_Open(path);
+    if(fd < 0) fail("File_Open", path);
+    for(int i=0; i<per_file; i++) {
+      double t = now();
+      if(File_Read(fd, buf, chunk) != chunk) fail("File_Read", path);
+      op(t);
+      bench_bytes += chunk;
+    }
+    File_Close(fd);
+  }
+  end("seq_read", chunk);
+
+  int fds[nfiles];
+  for(int f=0; f<nfiles; f++) {
+    sprintf(path, "/rw-%d", f);
+    if((fds[f] = File_Open(path)) < 0) fail("File_Open", path);
+  }
+  begin();
+  for(int i=0; i<nfiles*per_file; i++) {
+    int fd = fds[next_rand() % nfiles];
+    double t = now();
+    File_Seek(fd, (next_rand() % per_file) * chunk);
+    if(File_Read(fd, buf, chunk) != chunk) fail("File_Read", "random");
+    op(t);
+    bench_bytes += chunk;
+  }
+  end("rand_read", chunk);
+
+  begin();
+  for(int i=0; i<nfiles*per_file; i++) {
+    int fd = fds[next_rand() % nfiles];
+    double t = now();
+    File_Seek(fd, (next_rand() % per_file) * chunk);
+    if(File_Write(fd, buf, chunk) != chunk) fail("File_Write", "random");
+    op(t);
+    bench_bytes += chunk;
+  }
+  end("rand_write", chunk);
+
+  for(int f=0; f<nfiles; f++) {
+    File_Close(fds[f]);
+    sprintf(path, "/rw-%d", f);
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  }
+  free(buf);
+}
+
+// list a directory with many entries
+void bench_dir_list()
+{
+  int n = 700;
+  char path[64];
+  if(Dir_Create("/big") < 0) fail("Dir_Create", "/big");
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/big/entry-%d", i);
+    if(File_Create(path) < 0) fail("File_Create", path);
+  }
+
+  char *buf = malloc(n * 20);
+  begin();
+  for(int i=0; i<2000; i++) {
+    double t = now();
+    int sz = Dir_Size("/big");
+    if(sz < 0 || Dir_Read("/big", buf, sz) != n) fail("Dir_Read", "/big");
+    op(t);
+    bench_bytes += sz;
+  }
+  end("dir_list", 0);
+  free(buf);
+
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/big/entry-%d", i);
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  }
+  if(Dir_Unlink("/big") < 0) fail("Dir_Unlink", "/big");
+}
+
+// read whole files in 512 byte chunks through the asynchronous calls,
+// with the requests of all files in flight at once; the latency of an
+// op is from its submission to its completion
+void bench_aio()
+{
+  int nfiles = 20, chunk = 512, per_file = MAX_FILE_SIZE / chunk;
+  int nreqs = nfiles * per_file;
+  char path[64];
+  char *buf = malloc(MAX_FILE_SIZE);
+  memset(buf, 'a', MAX_FILE_SIZE);
+  for(int f=0; f<nfiles; f++) {
+    sprintf(path, "/aio-%d", f);
+    int fd;
+    if(File_Create(path) < 0 || (fd = File_Open(path)) < 0) fail("File_Create", path);
+    if(File_Write(fd, buf, MAX_FILE_SIZE) != MAX_FILE_SIZE) fail("File_Write", path);
+    File_Close(fd);
+  }
+
+  if(FS_AioStart(0) < 0) fail("FS_AioStart", "");
+  FS_Aio_t *reqs = calloc(nreqs, sizeof(FS_Aio_t));
+  FS_Aio_t *done[64];
+  double *submitted = malloc(nreqs * sizeof(double));
+  char *data = malloc(nreqs * chunk);
+
+  int fds[nfiles];
+  for(int f=0; f<nfiles; f++) {
+    sprintf(path, "/aio-%d", f);
+    if((fds[f] = File_Open(path)) < 0) fail("File_Open", path);
+  }
+
+  begin();
+  for(int i=0; i<nreqs; i++) {
+    // round robin over the files; the reads of a file stay in order
+    reqs[i].op = FS_AIO_READ;
+    reqs[i].fd = fds[i % nfiles];
+    reqs[i].buffer = data + i*chunk;
+    reqs[i].size = chunk;
+    reqs[i].data = &submitted[i];
+    submitted[i] = now();
+    if(FS_AioSubmit(&reqs[i]) < 0) fail("FS_AioSubmit", "");
+  }
+  for(int left=nreqs; left>0; ) {
+    int n = FS_AioWait(done, 1, 64);
+    if(n <= 0) fail("FS_AioWait", "");
+    for(int i=0; i<n; i++) {
+      if(done[i]->ret != chunk) fail("File_Read", "async");
+      op(*(double*)done[i]->data);
+      bench_bytes += chunk;
+    }
+    left -= n;
+  }
+  end("aio_read", chunk);
+
+  FS_AioStop();
+  for(int f=0; f<nfiles; f++) {
+    File_Close(fds[f]);
+    sprintf(path, "/aio-%d", f);
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  }
+  free(reqs);
+  free(submitted);
+  free(data);
+  free(buf);
+}
+
+// import files of known sizes (between half and the whole of
+// MAX_FILE_SIZE) in 1024 byte chunks, the way slow-import does, into a
+// disk churned into small holes: plainly, with a flush after every
+// chunk (as a writer that has its data reach the disk as it goes,
+// where delaying the allocation doesn't help), and with File_Reserve()
+// first and a flush after every chunk; one operation is the import of
+// one file, and the extents of each file are counted once it's closed
+void bench_reserve()
+{
+  int nholes = 600, nfiles = 40, chunk = 1024;
+  char path[64];
+  char *buf = malloc(MAX_FILE_SIZE);
+  memset(buf, 'r', MAX_FILE_SIZE);
+
+  // every other file of two blocks goes, leaving holes of two blocks
+  for(int i=0; i<nholes; i++) {
+    sprintf(path, "/churn-%d", i);
+    int fd;
+    if(File_Create(path) < 0 || (fd = File_Open(path)) < 0) fail("File_Create", path);
+    if(File_Write(fd, buf, 2*block_size) != 2*block_size) fail("File_Write", path);
+    File_Close(fd);
+  }
+  for(int i=0; i<nholes; i+=2) {
+    sprintf(path, "/churn-%d", i);
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  }
+
+  char *names[] = { "import", "import_flush", "import_reserve" };
+  for(int mode=0; mode<3; mode++) {
+    unsigned int keep = seed;     // the same sizes for every mode
+    int extents = 0;
+    begin();
+    for(int f=0; f<nfiles; f++) {
+      int size = MAX_FILE_SIZE/2 + next_rand() % (MAX_FILE_SIZE/2 + 1);
+      sprintf(path, "/import-%d", f);
+      double t = now();
+      int fd;
+      if(File_Create(path) < 0 || (fd = File_Open(path)) < 0) fail("File_Create", path);
+      if(mode == 2 && File_Reserve(fd, size) < 0) fail("File_Reserve", path);
+      for(int pos=0; pos<size; pos+=chunk) {
+	int n = size-pos < chunk ? size-pos : chunk;
+	if(File_Write(fd, buf, n) != n) fail("File_Write", path);
+	if(mode > 0 && File_Flush(fd) < 0) fail("File_Flush", path);
+      }
+      File_Close(fd);
+      op(t);
+      bench_bytes += size;
+      int e = File_Extents(path);
+      if(e < 0) fail("File_Extents", path);
+      extents += e;
+    }
+    bench_extents = (double)extents / nfiles;
+    end(names[mode], chunk);
+    for(int f=0; f<nfiles; f++) {
+      sprintf(path, "/import-%d", f);
+      if(File_Unlink(path) < 0) fail("File_Unlink", path);
+    }
+    seed = keep;
+  }
+
+  for(int i=1; i<nholes; i+=2) {
+    sprintf(path, "/churn-%d", i);
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  }
+  free(buf);
+}
+
+// fill the disk with max-size files until it runs out of space; one
+// operation is the create, write and close of one file
+void bench_fill()
+{
+  char path[64];
+  char *buf = malloc(MAX_FILE_SIZE);
+  memset(buf, 'f', MAX_FILE_SIZE);
+
+  int n;
+  begin();
+  for(n=0; ; n++) {
+    sprintf(path, "/fill-%d", n);
+    double t = now();
+    if(File_Create(path) < 0) break;
+    int fd = File_Open(path);
+    if(fd < 0) fail("File_Open", path);
+    int wsz = File_Write(fd, buf, MAX_FILE_SIZE);
+    File_Close(fd);
+    if(wsz != MAX_FILE_SIZE) {
+      if(osErrno != E_NO_SPACE) fail("File_Write", path);
+      File_Unlink(path);
+      break;
+    }
+    op(t);
+    bench_bytes += MAX_FILE_SIZE;
+  }
+  end("fill", MAX_FILE_SIZE);
+
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/fill-%d", i);
+    if(File_Unlink(path) < 0) fail("File_Unlink", path);
+  }
+  free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "bench-disk", *only = NULL;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-s") && i+1 < argc) seed = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-w") && i+1 < argc) only = argv[++i];
+    else if(!strcmp(argv[i], "-b") && i+1 < argc) block_size = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-l")) log_mode = 1;
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  // always start from a freshly formatted disk
+  char bs[16];
+  sprintf(bs, "%d", block_size);
+  setenv("FSBLOCK_SIZE", bs, 1);
+  setenv("FSLOG", log_mode ? "1" : "0", 1);
+  unlink(diskfile);
+  if(FS_Boot(diskfile) < 0) {
+    fprintf(stderr, "ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  if(!only || !strcmp(only, "create")) bench_create_unlink();
+  if(!only || !strcmp(only, "deep_open")) bench_deep_open();
+  int chunks[] = { 64, 512, 4096 };
+  for(int i=0; i<3; i++)
+    if(!only || !strcmp(only, "rw")) bench_rw(chunks[i]);
+  if(!only || !strcmp(only, "dir_list")) bench_dir_list();
+  if(!only || !strcmp(only, "aio")) bench_aio();
+  if(!only || !strcmp(only, "reserve")) bench_reserve();
+  if(!only || !strcmp(only, "fill")) bench_fill();
+
+  if(FS_Sync() < 0) {
+    fprintf(stderr, "ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
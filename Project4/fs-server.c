@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+#define MAX_CLIENTS 64
+#define MAX_FDS     1024
+
+// the connected clients; slot 0 of 'polls' is the listening socket
+static struct pollfd polls[MAX_CLIENTS+1];
+static int nclients;
+
+// the client that opened each file descriptor, or -1
+static int owner[MAX_FDS];
+
+// the client that opened each directory handle, or -1
+static int dh_owner[MAX_FDS];
+
+static char path[0x10000];
+static char data[FS_NET_MAX_DATA];
+static char out[FS_NET_MAX_DATA];
+
+static volatile sig_atomic_t stop;
+
+// the disk image served, and whether it has changes not written back
+static char *diskfile = "default-disk";
+static int dirty;
+
+// write the image back if it changed, the log of a log-structured
+// disk being cleaned first
+int save()
+{
+  if(!dirty) return 0;
+  FS_Clean(0);
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -1;
+  }
+  dirty = 0;
+  return 0;
+}
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-s socket] [-i idle_ms] [disk]\n", prog);
+  exit(1);
+}
+
+void on_signal(int sig)
+{
+  stop = 1;
+}
+
+int is_fd_op(int op)
+{
+  return op == FS_OP_FILE_READ || op == FS_OP_FILE_WRITE || op == FS_OP_FILE_RESERVE ||
+    op == FS_OP_FILE_SEEK || op == FS_OP_FILE_FLUSH || op == FS_OP_FILE_CLOSE;
+}
+
+// the calls taking a directory handle (-1 for none, but for closing)
+int is_dh_op(int op)
+{
+  return op == FS_OP_DIR_CLOSE_HANDLE || op == FS_OP_FILE_CREATE_AT ||
+    op == FS_OP_FILE_OPEN_AT || op == FS_OP_FILE_UNLINK_AT || op == FS_OP_DIR_CREATE_AT;
+}
+
+// serve one request of client 'c'; returns whether the request may
+// have changed the file system, or -1 if the client is to be dropped
+int serve(int c)
+{
+  int sock = polls[c].fd;
+  fs_net_req_t req;
+  fs_net_rsp_t rsp;
+  if(fs_net_read_full(sock, &req, sizeof(req)) < 0) return -1;
+  if(req.dlen > FS_NET_MAX_DATA) return -1;
+  if(fs_net_read_full(sock, path, req.plen) < 0) return -1;
+  path[req.plen] = '\0';
+  if(req.dlen > 0 && fs_net_read_full(sock, data, req.dlen) < 0) return -1;
+
+  int fd = req.arg[0], size = req.arg[1];
+  int changes = 1;
+  rsp.ret = -1;
+  rsp.dlen = 0;
+  rsp.err = 0;
+  osErrno = E_GENERAL;
+
+  // a client can only use the file descriptors it opened itself
+  if(is_fd_op(req.op) && (fd < 0 || fd >= MAX_FDS || owner[fd] != c)) {
+    osErrno = E_BAD_FD;
+    changes = 0;
+  } else if(is_dh_op(req.op) && (fd != -1 || req.op == FS_OP_DIR_CLOSE_HANDLE) &&
+	    (fd < 0 || fd >= MAX_FDS || dh_owner[fd] != c)) {
+    osErrno = E_BAD_FD;
+    changes = 0;
+  } else if((req.op == FS_OP_FILE_READ || req.op == FS_OP_DIR_READ) &&
+	    (size < 0 || size > FS_NET_MAX_DATA)) {
+    changes = 0;
+  } else switch(req.op) {
+  case FS_OP_SYNC:
+    // the client is told the data is on disk only once it is
+    rsp.ret = save();
+    changes = 0;
+    break;
+  case FS_OP_STATFS:
+    rsp.ret = FS_StatFS((FS_StatFS_t*)out);
+    if(rsp.ret == 0) rsp.dlen = sizeof(FS_StatFS_t);
+    changes = 0;
+    break;
+  case FS_OP_CHECK:
+    rsp.ret = FS_Check(req.arg[0], req.arg[1], (FS_Check_t*)out);
+    if(rsp.ret == 0) rsp.dlen = sizeof(FS_Check_t);
+    break;
+  case FS_OP_CLEAN:
+    rsp.ret = FS_Clean(req.arg[0]);
+    break;
+  case FS_OP_SNAPSHOT:
+    rsp.ret = FS_Snapshot(path);
+    break;
+  case FS_OP_DEFRAG:
+    rsp.ret = FS_Defrag(req.arg[0], (FS_Defrag_t*)out);
+    if(rsp.ret == 0) rsp.dlen = sizeof(FS_Defrag_t);
+    break;
+  case FS_OP_FILE_CREATE:
+    rsp.ret = File_Create(path);
+    break;
+  case FS_OP_FILE_OPEN:
+  case FS_OP_FILE_OPEN_AT:
+    rsp.ret = (req.op == FS_OP_FILE_OPEN) ? File_Open(path) : File_OpenAt(fd, path);
+    if(rsp.ret >= MAX_FDS) {
+      File_Close(rsp.ret);
+      rsp.ret = -1;
+      osErrno = E_TOO_MANY_OPEN_FILES;
+    } else if(rsp.ret >= 0) owner[rsp.ret] = c;
+    break;
+  case FS_OP_FILE_READ:
+    rsp.ret = File_Read(fd, out, size);
+    if(rsp.ret > 0) rsp.dlen = rsp.ret;
+    changes = 0;
+    break;
+  case FS_OP_FILE_WRITE:
+    rsp.ret = File_Write(fd, data, req.dlen);
+    break;
+  case FS_OP_FILE_RESERVE:
+    rsp.ret = File_Reserve(fd, size);
+    break;
+  case FS_OP_FILE_SEEK:
+    rsp.ret = File_Seek(fd, size);
+    changes = 0;
+    break;
+  case FS_OP_FILE_FLUSH:
+    rsp.ret = File_Flush(fd);
+    break;
+  case FS_OP_FILE_CLOSE:
+    rsp.ret = File_Close(fd);
+    if(rsp.ret == 0) owner[fd] = -1;
+    break;
+  case FS_OP_FILE_UNLINK:
+    rsp.ret = File_Unlink(path);
+    break;
+  case FS_OP_FILE_EXTENTS:
+    rsp.ret = File_Extents(path);
+    changes = 0;
+    break;
+  case FS_OP_FILE_CLONE:
+    // the name of the clone comes as the data, with its ending null
+    if(req.dlen > 0 && data[req.dlen-1] == '\0') rsp.ret = File_Clone(path, data);
+    break;
+  case FS_OP_FILE_LINK:
+    // the new name comes as the data, with its ending null
+    if(req.dlen > 0 && data[req.dlen-1] == '\0') rsp.ret = File_Link(path, data);
+    break;
+  case FS_OP_FILE_RENAME:
+    // the new path comes as the data, with its ending null
+    if(req.dlen > 0 && data[req.dlen-1] == '\0') rsp.ret = File_Rename(path, data);
+    break;
+  case FS_OP_FILE_COMPRESS:
+    rsp.ret = File_Compress(path, req.arg[0]);
+    break;
+  case FS_OP_DIR_CREATE:
+    rsp.ret = Dir_Create(path);
+    break;
+  case FS_OP_DIR_UNLINK:
+    rsp.ret = Dir_Unlink(path);
+    break;
+  case FS_OP_DIR_SIZE:
+    rsp.ret = Dir_Size(path);
+    changes = 0;
+    break;
+  case FS_OP_DIR_READ:
+    rsp.ret = Dir_Read(path, out, size);
+    if(rsp.ret >= 0) rsp.dlen = rsp.ret * 20;
+    changes = 0;
+    break;
+  case FS_OP_DIR_OPEN_HANDLE:
+    rsp.ret = Dir_OpenHandle(path);
+    if(rsp.ret >= MAX_FDS) {
+      Dir_CloseHandle(rsp.ret);
+      rsp.ret = -1;
+      osErrno = E_TOO_MANY_OPEN_FILES;
+    } else if(rsp.ret >= 0) dh_owner[rsp.ret] = c;
+    changes = 0;
+    break;
+  case FS_OP_DIR_CLOSE_HANDLE:
+    rsp.ret = Dir_CloseHandle(fd);
+    if(rsp.ret == 0) dh_owner[fd] = -1;
+    changes = 0;
+    break;
+  case FS_OP_FILE_CREATE_AT:
+    rsp.ret = File_CreateAt(fd, path);
+    break;
+  case FS_OP_FILE_UNLINK_AT:
+    rsp.ret = File_UnlinkAt(fd, path);
+    break;
+  case FS_OP_DIR_CREATE_AT:
+    rsp.ret = Dir_CreateAt(fd, path);
+    break;
+  case FS_NET_WALK_DIR:
+    rsp.ret = fs_walk_dir(req.plen > 0 ? path : NULL, fd, (fs_net_dirent_t*)out,
+			  FS_NET_MAX_DATA / sizeof(fs_net_dirent_t));
+    if(rsp.ret > 0) rsp.dlen = rsp.ret * sizeof(fs_net_dirent_t);
+    changes = 0;
+    break;
+  case FS_NET_GET_STATS:
+    rsp.ret = FS_GetStats((FS_Stats_t*)out);
+    if(rsp.ret == 0) rsp.dlen = sizeof(FS_Stats_t);
+    changes = 0;
+    break;
+  default:
+    changes = 0;
+  }
+  if(rsp.ret < 0) rsp.err = osErrno;
+
+  if(fs_net_write_full(sock, &rsp, sizeof(rsp)) < 0 ||
+     (rsp.dlen > 0 && fs_net_write_full(sock, out, rsp.dlen) < 0))
+    return -1;
+  return changes;
+}
+
+// close the connection of client 'c' and whatever files and
+// directory handles it left open
+void drop(int c)
+{
+  for(int fd=0; fd<MAX_FDS; fd++) {
+    if(owner[fd] == c) { File_Close(fd); owner[fd] = -1; }
+    if(dh_owner[fd] == c) { Dir_CloseHandle(fd); dh_owner[fd] = -1; }
+  }
+  close(polls[c].fd);
+
+  // the last client takes the slot
+  if(c != nclients) {
+    polls[c] = polls[nclients];
+    for(int fd=0; fd<MAX_FDS; fd++) {
+      if(owner[fd] == nclients) owner[fd] = c;
+      if(dh_owner[fd] == nclients) dh_owner[fd] = c;
+    }
+  }
+  nclients--;
+}
+
+int main(int argc, char *argv[])
+{
+  char *sockfile = "fs-socket";
+  int idle_ms = 1000;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-s") && i+1 < argc) sockfile = argv[++i];
+    else if(!strcmp(argv[i], "-i") && i+1 < argc) idle_ms = atoi(argv[++i]);
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(sockfile) >= sizeof(addr.sun_path)) {
+    printf("ERROR: socket path '%s' is too long\n", sockfile);
+    return -2;
+  }
+  strcpy(addr.sun_path, sockfile);
+  int lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(sockfile);
+  if(lsock < 0 || bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+     listen(lsock, 16) < 0) {
+    printf("ERROR: can't listen on socket '%s'\n", sockfile);
+    return -2;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  for(int fd=0; fd<MAX_FDS; fd++) owner[fd] = dh_owner[fd] = -1;
+  polls[0].fd = lsock;
+  polls[0].events = POLLIN;
+  printf("serving '%s' on '%s'\n", diskfile, sockfile);
+  fflush(stdout);
+
+  // the image is written back on FS_Sync() from a client, once no
+  // request came in for 'idle_ms' after a change, and when the server
+  // is stopped
+  while(!stop) {
+    int n = poll(polls, nclients+1, dirty ? idle_ms : -1);
+    if(n < 0 && errno != EINTR) break;
+    if(n <= 0) {
+      if(dirty && !stop) save();
+      continue;
+    }
+    for(int c=nclients; c>=1; c--) {
+      if(!polls[c].revents) continue;
+      int ret = serve(c);
+      if(ret < 0) drop(c);
+      else if(ret > 0) dirty = 1;
+    }
+    if((polls[0].revents & POLLIN) && nclients < MAX_CLIENTS) {
+      int sock = accept(lsock, NULL, NULL);
+      if(sock >= 0) {
+	nclients++;
+	polls[nclients].fd = sock;
+	polls[nclients].events = POLLIN;
+	polls[nclients].revents = 0;
+      }
+    }
+  }
+
+  for(int c=nclients; c>=1; c--) drop(c);
+  close(lsock);
+  unlink(sockfile);
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
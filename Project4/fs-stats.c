@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s stats_file\n", prog);
+  printf("       %s -s socket\n", prog);
+  exit(1);
+}
+
+// upper bound (in microseconds) of the latency below which the given
+// fraction of the calls fall, from the log-bucketed histogram
+double percentile(FS_OpStats_t* op, double frac)
+{
+  unsigned long long sum = 0;
+  for(int b=0; b<FS_STATS_BUCKETS; b++) {
+    sum += op->hist[b];
+    if(sum >= frac*op->calls) return (double)(1ULL<<(b+1)) / 1000.0;
+  }
+  return (double)(1ULL<<FS_STATS_BUCKETS) / 1000.0;
+}
+
+void print_stats(FS_Stats_t* st)
+{
+  printf("%-14s %10s %8s %12s %12s %12s\n", "CALL", "COUNT", "ERRORS",
+	 "MEAN(us)", "P50(us)<=", "P99(us)<=");
+  for(int i=0; i<FS_NUM_OPS; i++) {
+    FS_OpStats_t* op = &st->op[i];
+    if(op->calls == 0) continue;
+    printf("%-14s %10llu %8llu %12.2f %12.2f %12.2f\n", op->name, op->calls, op->errors,
+	   op->total_ns / 1000.0 / op->calls, percentile(op, 0.5), percentile(op, 0.99));
+  }
+  printf("\n");
+  printf("path components resolved  %llu\n", st->path_components);
+  printf("dirents scanned           %llu\n", st->dirents_scanned);
+  printf("bitmap sectors touched    %llu\n", st->bitmap_sectors);
+  printf("inode cache hits/misses   %llu/%llu\n", st->inode_cache_hits, st->inode_cache_misses);
+  printf("pending page hits         %llu\n", st->page_cache_hits);
+  printf("hole blocks read          %llu\n", st->holes_read);
+  printf("blocks moved by cleaner   %llu\n", st->cleaner_blocks_moved);
+  printf("clusters decompressed     %llu\n", st->clusters_read);
+  printf("cluster bytes in/stored   %llu/%llu\n", st->cluster_bytes, st->cluster_bytes_stored);
+  printf("deduplicated blocks       %llu\n", st->dedup_hits);
+}
+
+int main(int argc, char *argv[])
+{
+  FS_Stats_t st;
+  if(argc == 3 && !strcmp(argv[1], "-s")) {
+    // ask a running fs-server for its statistics
+    char boot[256];
+    snprintf(boot, sizeof(boot), "%s%s", FS_NET_PREFIX, argv[2]);
+    if(FS_Boot(boot) < 0 || FS_GetStats(&st) < 0) {
+      printf("ERROR: can't get statistics from server on '%s'\n", argv[2]);
+      return -1;
+    }
+    print_stats(&st);
+    return 0;
+  }
+  if(argc != 2) usage(argv[0]);
+
+  FILE* fptr = fopen(argv[1], "r");
+  if(!fptr) {
+    printf("ERROR: can't open stats file '%s'\n", argv[1]);
+    return -1;
+  }
+  if(fread(&st, sizeof(st), 1, fptr) != 1) {
+    printf("ERROR: '%s' is not a stats file\n", argv[1]);
+    return -2;
+  }
+  fclose(fptr);
+
+  print_stats(&st);
+  return 0;
+}
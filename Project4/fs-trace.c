@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFSTrace.h"
+
+// names and formats of the events, in the order of their identifiers
+#define FS_TRACE_NAME(id, cls, fmt)  { #id, fmt },
+static struct { char *name; char *fmt; } events[] = { FS_TRACE_EVENTS(FS_TRACE_NAME) };
+
+void usage(char *prog)
+{
+  printf("USAGE: %s trace_file\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+
+  FILE* fptr = fopen(argv[1], "r");
+  if(!fptr) {
+    printf("ERROR: can't open trace file '%s'\n", argv[1]);
+    return -1;
+  }
+
+  fs_trace_hdr_t hdr;
+  if(fread(&hdr, sizeof(hdr), 1, fptr) != 1 || hdr.magic != FS_TRACE_MAGIC) {
+    printf("ERROR: '%s' is not a trace file\n", argv[1]);
+    return -2;
+  }
+  fs_trace_rec_t* ring = malloc(hdr.ring_size * sizeof(fs_trace_rec_t));
+  if(!ring || fread(ring, sizeof(fs_trace_rec_t), hdr.ring_size, fptr) != hdr.ring_size) {
+    printf("ERROR: can't read trace file '%s'\n", argv[1]);
+    return -3;
+  }
+  fclose(fptr);
+
+  // the ring holds the last ring_size records before head
+  uint32_t first = hdr.head > hdr.ring_size ? hdr.head - hdr.ring_size : 0;
+  if(first > 0) printf("(%u earlier events overwritten)\n", first);
+  uint64_t start = 0;
+  for(uint32_t seq = first; seq != hdr.head; seq++) {
+    fs_trace_rec_t* rec = &ring[seq & (hdr.ring_size-1)];
+    if(rec->seq != seq || rec->event >= TR_NUM_EVENTS) {
+      printf("%-8u (torn record)\n", seq);
+      continue;
+    }
+    if(!start) start = rec->ns;
+    printf("%-8u %12.3fus t%-3d %-16s ", seq, (rec->ns - start) / 1000.0,
+	   rec->tid, events[rec->event].name);
+    printf(events[rec->event].fmt, rec->arg[0], rec->arg[1], rec->arg[2], rec->arg[3]);
+    printf("\n");
+  }
+  free(ring);
+  return 0;
+}
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// the operations of a workload; each one is a short sequence of API
+// calls done on behalf of one (simulated) client request
+typedef enum {
+  OP_MKDIR,    // Dir_Create
+  OP_CREATE,   // File_Create, then write the whole file
+  OP_UNLINK,   // File_Unlink
+  OP_READ,     // open, read the whole file, close
+  OP_WRITE,    // open, seek, write one chunk, close
+  OP_OPEN,     // open and close
+  OP_LIST,     // Dir_Size and Dir_Read
+  NUM_OPS
+} op_t;
+
+static char* op_names[NUM_OPS] = {
+  "mkdir", "create", "unlink", "read", "write", "open", "list"
+};
+
+// one entry of the op stream, as recorded and replayed
+typedef struct {
+  op_t op;
+  char path[64];
+  int  arg1;       // create: file size; write: offset
+  int  arg2;       // write: chunk size
+  int  think_us;   // time to sleep before the op
+} rec_t;
+
+// a weighted choice, as used for the file size distribution and the
+// op mix of a profile
+#define MAX_CHOICES 16
+typedef struct {
+  int n;
+  int value[MAX_CHOICES];
+  int weight[MAX_CHOICES];
+  int total;
+} dist_t;
+
+// the workload profile
+static struct {
+  unsigned int seed;
+  int fanout;       // subdirectories of each directory
+  int depth;        // levels of subdirectories below the root
+  int files;        // files created before the measured ops
+  int max_files;    // the most files alive at a time
+  int ops;          // number of measured ops
+  int chunk;        // size of a write op
+  int think_us;     // mean think time between ops
+  dist_t filesize;  // sizes of created files
+  dist_t mix;       // the op mix (values are op_t)
+} prof = { 1, 4, 2, 100, 500, 10000, 512, 0 };
+
+// per-op results
+typedef struct {
+  int count;
+  int errors;
+  int cap;
+  double *lat;      // latencies in ns
+  double total;
+} result_t;
+static result_t results[NUM_OPS];
+
+static FILE *record_file;
+
+// start of the measured part of the workload
+static double start;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-f] [-r record_file] profile [disk]\n", prog);
+  printf("       %s [-f] -p record_file [disk]\n", prog);
+  exit(1);
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int next_rand()
+{
+  prof.seed = prof.seed * 1103515245 + 12345;
+  return (prof.seed >> 16) & 0x7fff;
+}
+
+int pick(dist_t* d)
+{
+  int r = next_rand() % d->total;
+  for(int i=0; i<d->n; i++) {
+    if(r < d->weight[i]) return d->value[i];
+    r -= d->weight[i];
+  }
+  return d->value[d->n-1];
+}
+
+int op_by_name(char *name)
+{
+  for(int i=0; i<NUM_OPS; i++)
+    if(!strcmp(op_names[i], name)) return i;
+  return -1;
+}
+
+// parse "value:weight,value:weight,..."; values are numbers, or op
+// names if 'ops' is set
+int parse_dist(char *s, dist_t* d, int ops)
+{
+  d->n = d->total = 0;
+  for(char *tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+    char *colon = strchr(tok, ':');
+    if(!colon || d->n == MAX_CHOICES) return -1;
+    *colon = '\0';
+    int v = ops ? op_by_name(tok) : atoi(tok);
+    int w = atoi(colon+1);
+    if(v < 0 || w <= 0) return -1;
+    d->value[d->n] = v;
+    d->weight[d->n++] = w;
+    d->total += w;
+  }
+  return d->n > 0 ? 0 : -1;
+}
+
+// a profile has one "key = value" setting per line; '#' starts a
+// comment
+int load_profile(char *fname)
+{
+  FILE *fp = fopen(fname, "r");
+  if(!fp) return -1;
+  char line[256], key[32], val[224];
+  int lineno = 0;
+  parse_dist(strcpy(val, "512:1"), &prof.filesize, 0);
+  parse_dist(strcpy(val, "read:1"), &prof.mix, 1);
+  while(fgets(line, sizeof(line), fp)) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if(hash) *hash = '\0';
+    if(sscanf(line, " %31[a-z_] = %223s", key, val) != 2) {
+      if(strspn(line, " \t\r\n") == strlen(line)) continue;
+      goto bad;
+    }
+    if(!strcmp(key, "seed")) prof.seed = atoi(val);
+    else if(!strcmp(key, "fanout")) prof.fanout = atoi(val);
+    else if(!strcmp(key, "depth")) prof.depth = atoi(val);
+    else if(!strcmp(key, "files")) prof.files = atoi(val);
+    else if(!strcmp(key, "max_files")) prof.max_files = atoi(val);
+    else if(!strcmp(key, "ops")) prof.ops = atoi(val);
+    else if(!strcmp(key, "chunk")) prof.chunk = atoi(val);
+    else if(!strcmp(key, "think_us")) prof.think_us = atoi(val);
+    else if(!strcmp(key, "filesize")) {
+      if(parse_dist(val, &prof.filesize, 0) < 0) goto bad;
+    } else if(!strcmp(key, "mix")) {
+      if(parse_dist(val, &prof.mix, 1) < 0) goto bad;
+    } else goto bad;
+  }
+  fclose(fp);
+  return 0;
+
+ bad:
+  fprintf(stderr, "ERROR: %s:%d: bad setting\n", fname, lineno);
+  fclose(fp);
+  return -1;
+}
+
+// run one op and account for its latency; the think time is not part
+// of the latency
+void run(rec_t* r)
+{
+  static char buf[MAX_FILE_SIZE];
+  if(record_file)
+    fprintf(record_file, "%s %s %d %d %d\n", op_names[r->op], r->path,
+	    r->arg1, r->arg2, r->think_us);
+  if(r->think_us > 0) usleep(r->think_us);
+
+  int ok = 1, fd;
+  double t = now();
+  switch(r->op) {
+  case OP_MKDIR:
+    ok = Dir_Create(r->path) == 0;
+    break;
+  case OP_CREATE:
+    if(File_Create(r->path) < 0 || (fd = File_Open(r->path)) < 0) { ok = 0; break; }
+    ok = File_Write(fd, buf, r->arg1) == r->arg1;
+    File_Close(fd);
+    break;
+  case OP_UNLINK:
+    ok = File_Unlink(r->path) == 0;
+    break;
+  case OP_READ:
+    if((fd = File_Open(r->path)) < 0) { ok = 0; break; }
+    ok = File_Read(fd, buf, MAX_FILE_SIZE) >= 0;
+    File_Close(fd);
+    break;
+  case OP_WRITE:
+    if((fd = File_Open(r->path)) < 0) { ok = 0; break; }
+    ok = File_Seek(fd, r->arg1) == 0 && File_Write(fd, buf, r->arg2) == r->arg2;
+    File_Close(fd);
+    break;
+  case OP_OPEN:
+    if((fd = File_Open(r->path)) < 0) { ok = 0; break; }
+    File_Close(fd);
+    break;
+  case OP_LIST: {
+    int sz = Dir_Size(r->path);
+    ok = sz >= 0 && Dir_Read(r->path, buf, sz) >= 0;
+    break;
+  }
+  default:
+    ok = 0;
+  }
+  t = now() - t;
+
+  result_t* res = &results[r->op];
+  if(res->count == res->cap) {
+    res->cap = res->cap ? 2*res->cap : 1024;
+    res->lat = realloc(res->lat, res->cap * sizeof(double));
+  }
+  res->lat[res->count++] = t;
+  res->total += t;
+  if(!ok) res->errors++;
+}
+
+// the files that the generator believes to be alive, and their sizes
+static char (*files)[64];
+static int *sizes;
+static int nfiles, nseq;
+
+// the directories of the tree, each of them 'fanout' wide
+static char (*dirs)[64];
+static int ndirs;
+
+// the setup (the directory tree and the initial files) is done; it is
+// not part of the results, and a record file marks where it ends
+void setup_done()
+{
+  for(int i=0; i<NUM_OPS; i++) {
+    results[i].count = results[i].errors = 0;
+    results[i].total = 0;
+  }
+  if(record_file) fprintf(record_file, "# setup done\n");
+  start = now();
+}
+
+int think()
+{
+  return prof.think_us > 0 ? next_rand() % (2*prof.think_us + 1) : 0;
+}
+
+void gen_create(rec_t* r)
+{
+  char *dir = dirs[next_rand() % ndirs];
+  r->op = OP_CREATE;
+  snprintf(r->path, sizeof(r->path), "%s/f%d", strcmp(dir, "/") ? dir : "", nseq++);
+  r->arg1 = pick(&prof.filesize);
+  if(r->arg1 > MAX_FILE_SIZE) r->arg1 = MAX_FILE_SIZE;
+  strcpy(files[nfiles], r->path);
+  sizes[nfiles++] = r->arg1;
+}
+
+// generate the workload from the profile, running each op as soon as
+// it is generated; the generator never looks at the outcome of an op,
+// so the op stream depends on the profile only
+void generate()
+{
+  int maxdirs = 1, level = 1;
+  for(int l=0; l<prof.depth; l++) { level *= prof.fanout; maxdirs += level; }
+  dirs = malloc(maxdirs * sizeof(*dirs));
+  files = malloc(prof.max_files * sizeof(*files));
+  sizes = malloc(prof.max_files * sizeof(int));
+
+  rec_t r;
+  memset(&r, 0, sizeof(r));
+  strcpy(dirs[ndirs++], "/");
+  for(int i=0; i<ndirs && ndirs < maxdirs; i++) {
+    int deep = 0;
+    for(char *p = dirs[i]; *p; p++) deep += *p == '/';
+    if(strcmp(dirs[i], "/") && deep >= prof.depth) continue;
+    for(int j=0; j<prof.fanout; j++) {
+      r.op = OP_MKDIR;
+      snprintf(r.path, sizeof(r.path), "%s/d%d", strcmp(dirs[i], "/") ? dirs[i] : "", j);
+      strcpy(dirs[ndirs++], r.path);
+      run(&r);
+    }
+  }
+
+  for(int i=0; i<prof.files && nfiles < prof.max_files; i++) {
+    gen_create(&r);
+    run(&r);
+  }
+  setup_done();
+
+  for(int i=0; i<prof.ops; i++) {
+    int op = pick(&prof.mix);
+    memset(&r, 0, sizeof(r));
+    if(op == OP_CREATE && nfiles == prof.max_files) op = OP_UNLINK;
+    if(op != OP_CREATE && op != OP_LIST && op != OP_MKDIR && nfiles == 0) op = OP_CREATE;
+    if(op == OP_MKDIR) op = OP_LIST;   // the tree is fixed by the profile
+
+    int f = nfiles > 0 ? next_rand() % nfiles : 0;
+    r.op = op;
+    switch(op) {
+    case OP_CREATE:
+      gen_create(&r);
+      break;
+    case OP_UNLINK:
+      strcpy(r.path, files[f]);
+      nfiles--;
+      memmove(files[f], files[nfiles], sizeof(files[f]));
+      sizes[f] = sizes[nfiles];
+      break;
+    case OP_WRITE:
+      strcpy(r.path, files[f]);
+      r.arg2 = prof.chunk < MAX_FILE_SIZE ? prof.chunk : MAX_FILE_SIZE;
+      r.arg1 = next_rand() % (MAX_FILE_SIZE - r.arg2 + 1);
+      if(r.arg1 > sizes[f]) r.arg1 = sizes[f];
+      if(r.arg1 + r.arg2 > sizes[f]) sizes[f] = r.arg1 + r.arg2;
+      break;
+    case OP_LIST:
+      strcpy(r.path, dirs[next_rand() % ndirs]);
+      break;
+    default:
+      strcpy(r.path, files[f]);
+    }
+    r.think_us = think();
+    run(&r);
+  }
+}
+
+// replay a recorded op stream
+int replay(char *fname)
+{
+  FILE *fp = fopen(fname, "r");
+  if(!fp) return -1;
+  char line[256], name[16];
+  rec_t r;
+  int lineno = 0;
+  start = now();
+  while(fgets(line, sizeof(line), fp)) {
+    lineno++;
+    if(line[0] == '#') { setup_done(); continue; }
+    memset(&r, 0, sizeof(r));
+    if(sscanf(line, "%15s %63s %d %d %d", name, r.path, &r.arg1, &r.arg2, &r.think_us) != 5 ||
+       (int)(r.op = op_by_name(name)) < 0) {
+      fprintf(stderr, "ERROR: %s:%d: bad record\n", fname, lineno);
+      fclose(fp);
+      return -1;
+    }
+    run(&r);
+  }
+  fclose(fp);
+  return 0;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(double*)a, y = *(double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// print one JSON object per op, and one for all of them
+void report(double secs)
+{
+  int total = 0, errors = 0;
+  for(int i=0; i<NUM_OPS; i++) {
+    result_t* res = &results[i];
+    if(res->count == 0) continue;
+    qsort(res->lat, res->count, sizeof(double), cmp_double);
+    printf("{\"op\":\"%s\",\"count\":%d,\"errors\":%d,\"mean_us\":%.3f,"
+	   "\"p50_us\":%.3f,\"p99_us\":%.3f}\n", op_names[i], res->count, res->errors,
+	   res->total / res->count / 1e3, res->lat[res->count/2] / 1e3,
+	   res->lat[(int)(res->count*0.99)] / 1e3);
+    total += res->count;
+    errors += res->errors;
+  }
+  printf("{\"op\":\"all\",\"count\":%d,\"errors\":%d,\"secs\":%.6f,\"ops_per_sec\":%.1f}\n",
+	 total, errors, secs, secs > 0 ? total/secs : 0);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "workload-disk", *profile = NULL, *recfile = NULL, *playfile = NULL;
+  int force = 0, given = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-f")) force = 1;
+    else if(!strcmp(argv[i], "-r") && i+1 < argc) recfile = argv[++i];
+    else if(!strcmp(argv[i], "-p") && i+1 < argc) playfile = argv[++i];
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else if(!profile && !playfile) profile = argv[i];
+    else { diskfile = argv[i]; given = 1; }
+  }
+  if(!profile == !playfile) usage(argv[0]);
+
+  // the disk gets formatted over; one named on the command line is
+  // only when told to, as it may well be an image in use
+  if(given && !force && access(diskfile, F_OK) == 0) {
+    fprintf(stderr, "ERROR: disk '%s' exists; -f to format it over\n", diskfile);
+    return -1;
+  }
+
+  if(profile && load_profile(profile) < 0) {
+    fprintf(stderr, "ERROR: can't load profile '%s'\n", profile);
+    return -1;
+  }
+  if(recfile && !(record_file = fopen(recfile, "w"))) {
+    fprintf(stderr, "ERROR: can't create record file '%s'\n", recfile);
+    return -1;
+  }
+
+  // a workload always starts from a freshly formatted disk, so that a
+  // replay finds the file system in the state the recording did
+  unlink(diskfile);
+  if(FS_Boot(diskfile) < 0) {
+    fprintf(stderr, "ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  if(profile) generate();
+  else if(replay(playfile) < 0) {
+    fprintf(stderr, "ERROR: can't replay '%s'\n", playfile);
+    return -2;
+  }
+  report((now() - start) / 1e9);
+
+  if(record_file) fclose(record_file);
+  if(FS_Sync() < 0) {
+    fprintf(stderr, "ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+# a sample workload profile for fs-workload: a small tree of
+# directories holding mostly small files, read far more than written
+
+seed      = 42
+fanout    = 4          # subdirectories of each directory
+depth     = 2          # levels of subdirectories
+files     = 300        # files created before the measured ops
+max_files = 600
+ops       = 20000
+chunk     = 512        # size of a write
+think_us  = 0          # mean think time between ops
+
+# file sizes (bytes:weight)
+filesize  = 100:40,1024:30,4096:20,15360:10
+
+# op mix (op:weight); ops are create, unlink, read, write, open, list
+mix       = read:50,write:15,open:15,create:8,unlink:7,list:5
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "LibDisk.h"
 #include "LibFS.h"
 
 void usage(char *prog)
@@ -9,6 +10,45 @@ void usage(char *prog)
   exit(1);
 }
 
+// whether directory 'dir' has an entry named 'name'
+int has_entry(char *dir, char *name)
+{
+  char buf[4096];
+  int n = Dir_Read(dir, buf, sizeof(buf));
+  for(int i=0; i<n; i++)
+    if(!strcmp(buf+i*20, name)) return 1;
+  return 0;
+}
+
+// whether the first 'size' bytes of file 'file' are those of 'data'
+int reads_back(char *file, void *data, int size)
+{
+  static char got[MAX_FILE_SIZE];
+  int fd = File_Open(file);
+  if(fd < 0) return 0;
+  int n = File_Read(fd, got, size);
+  File_Close(fd);
+  return n == size && !memcmp(got, data, size);
+}
+
+// fill the disk with files in directory 'dir' (each block different,
+// so that none can be shared); return how many were created
+int fill_disk(char *dir)
+{
+  char name[64], blk[512];
+  memset(blk, 0, sizeof(blk));
+  for(int n=0; ; n++) {
+    sprintf(name, "%s/f%d", dir, n);
+    if(File_Create(name) < 0) return n;
+    int fd = File_Open(name), size = 0;
+    do sprintf(blk, "%s %d", name, size);
+    while(size < MAX_FILE_SIZE && File_Write(fd, blk, sizeof(blk)) == sizeof(blk) &&
+	  (size += sizeof(blk)));
+    File_Close(fd);
+    if(size < MAX_FILE_SIZE) return n+1;
+  }
+}
+
 int main(int argc, char *argv[])
 {
   if (argc != 2) usage(argv[0]);
@@ -74,6 +114,78 @@ int main(int argc, char *argv[])
   if(File_Close(fd) < 0) printf("ERROR: can't close fd %d\n", fd);
   else printf("fd %d closed successfully\n", fd);
   
+  // a directory emptied one entry at a time, from the middle first,
+  // can be removed
+  if(Dir_Create("/empty-dir") < 0 || File_Create("/empty-dir/a") < 0 ||
+     File_Create("/empty-dir/b") < 0 || File_Create("/empty-dir/c") < 0 ||
+     File_Unlink("/empty-dir/b") < 0 || File_Unlink("/empty-dir/a") < 0 ||
+     File_Unlink("/empty-dir/c") < 0 || Dir_Unlink("/empty-dir") < 0)
+    printf("ERROR: can't unlink dir '/empty-dir' once emptied\n");
+  else printf("dir '/empty-dir' emptied and unlinked successfully\n");
+
+  // a hole reads as zeros, even where the blocks of a removed file are
+  // reused, and still once File_Reserve() has gone over it
+  static char big[15000], zeros[10000];
+  memset(big, 'A', sizeof(big));
+  if(File_Create("/a") < 0 || (fd = File_Open("/a")) < 0 ||
+     File_Write(fd, big, sizeof(big)) != sizeof(big) || File_Close(fd) < 0 ||
+     File_Unlink("/a") < 0 || File_Create("/s") < 0 || (fd = File_Open("/s")) < 0 ||
+     File_Seek(fd, 10000) < 0 || File_Write(fd, "s", 1) != 1 || File_Close(fd) < 0 ||
+     !reads_back("/s", zeros, sizeof(zeros)))
+    printf("ERROR: hole in file '/s' doesn't read as zeros\n");
+  else printf("hole in file '/s' read successfully\n");
+  if((fd = File_Open("/s")) < 0 || File_Reserve(fd, 10001) < 0 || File_Close(fd) < 0 ||
+     !reads_back("/s", zeros, sizeof(zeros)))
+    printf("ERROR: hole in file '/s' doesn't read as zeros once reserved\n");
+  else printf("file '/s' reserved successfully\n");
+
+  // a write to a clone needs a block of its own, which a full disk
+  // doesn't have: the write fails, and leaves the disk as it was
+  FS_StatFS_t st;
+  FS_Check_t chk;
+  if(File_Clone("/second-file", "/clone-file") < 0 || Dir_Create("/fill") < 0 ||
+     fill_disk("/fill") <= 0 || (fd = File_Open("/clone-file")) < 0)
+    printf("ERROR: can't clone file '/second-file' and fill the disk\n");
+  else {
+    int ret = File_Write(fd, "c", 1), err = osErrno;
+    if(File_Close(fd) < 0 || ret != -1 || err != E_NO_SPACE || FS_StatFS(&st) < 0 ||
+       st.free_blocks < 0 || FS_Check(0, 0, &chk) < 0 || chk.errors > 0 ||
+       !reads_back("/clone-file", buf, sizeof(buf)))
+      printf("ERROR: write to clone '/clone-file' on a full disk didn't fail cleanly\n");
+    else printf("write to clone '/clone-file' on a full disk failed as it should\n");
+  }
+  char name[64];
+  for(int n=0; sprintf(name, "/fill/f%d", n), File_Unlink(name) == 0; n++);
+  Dir_Unlink("/fill");
+
+  // a compressed file reads back what was written to it
+  if(File_Create("/packed") < 0 || (fd = File_Open("/packed")) < 0 ||
+     File_Write(fd, buf, sizeof(buf)) != sizeof(buf) || File_Close(fd) < 0 ||
+     File_Compress("/packed", 1) < 0 || !reads_back("/packed", buf, sizeof(buf)))
+    printf("ERROR: compressed file '/packed' doesn't read back\n");
+  else printf("compressed file '/packed' read back successfully\n");
+
+  // a file moved to another directory keeps what it holds
+  if(Dir_Create("/from-dir") < 0 || Dir_Create("/to-dir") < 0 ||
+     File_Create("/from-dir/moved") < 0 || (fd = File_Open("/from-dir/moved")) < 0 ||
+     File_Write(fd, buf, sizeof(buf)) != sizeof(buf) || File_Close(fd) < 0 ||
+     File_Rename("/from-dir/moved", "/to-dir/moved") < 0 || has_entry("/from-dir", "moved") ||
+     !has_entry("/to-dir", "moved") || !reads_back("/to-dir/moved", buf, sizeof(buf)))
+    printf("ERROR: can't rename file '/from-dir/moved' to '/to-dir/moved'\n");
+  else printf("file '/from-dir/moved' renamed to '/to-dir/moved' successfully\n");
+
+  // a second link in the same directory: unlinking or renaming it
+  // must leave the first one alone
+  if(File_Link("/second-file", "/third-file") < 0 || File_Unlink("/third-file") < 0 ||
+     !has_entry("/", "second-file") || has_entry("/", "third-file"))
+    printf("ERROR: unlinking link '/third-file' didn't leave '/second-file' alone\n");
+  else printf("link '/third-file' unlinked successfully\n");
+
+  if(File_Link("/second-file", "/third-file") < 0 || File_Rename("/third-file", "/fourth-file") < 0 ||
+     !has_entry("/", "second-file") || has_entry("/", "third-file") || !has_entry("/", "fourth-file"))
+    printf("ERROR: renaming link '/third-file' didn't leave '/second-file' alone\n");
+  else printf("link '/third-file' renamed successfully\n");
+
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
     return -1;
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "LibFS.h"
+#include "LibFSNet.h"
 
 #define BFSZ 256
 
@@ -42,7 +43,7 @@ int main(int argc, char *argv[])
   
   File_Close(fd);
   
-  if(FS_Sync() < 0) {
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);
     return -3;
   }
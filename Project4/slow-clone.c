@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] file new_file\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path, *newpath;
+  if(argc != 3 && argc != 4) usage(argv[0]);
+  if(argc == 4) { diskfile = argv[1]; path = argv[2]; newpath = argv[3]; }
+  else { diskfile = "default-disk"; path = argv[1]; newpath = argv[2]; }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  
+  if(File_Clone(path, newpath) < 0) {
+    printf("ERROR: can't clone file '%s' as '%s'\n", path, newpath);
+    return -2;
+  }
+  printf("file '%s' cloned as '%s' successfully\n", path, newpath);
+
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
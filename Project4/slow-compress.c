@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] file on|off\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path, *mode;
+  if(argc != 3 && argc != 4) usage(argv[0]);
+  if(argc == 4) { diskfile = argv[1]; path = argv[2]; mode = argv[3]; }
+  else { diskfile = "default-disk"; path = argv[1]; mode = argv[2]; }
+  if(strcmp(mode, "on") && strcmp(mode, "off")) usage(argv[0]);
+  int on = !strcmp(mode, "on");
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  
+  if(File_Compress(path, on) < 0) {
+    printf("ERROR: can't turn compression %s for file '%s'\n", mode, path);
+    return -2;
+  }
+  printf("compression of file '%s' turned %s successfully\n", path, mode);
+
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-t budget_ms] [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  int budget = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-t") && i+1 < argc) budget = atoi(argv[++i]);
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Defrag_t res;
+  if(FS_Defrag(budget, &res) < 0) {
+    printf("ERROR: can't defragment file system '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%s: %d inodes looked at%s\n", diskfile, res.inodes,
+	 res.done ? "" : " (out of time, run again to go on)");
+  printf("%-10s %10s %10s\n", "", "BEFORE", "AFTER");
+  printf("%-10s %10d %10d\n", "extents", res.extents_before, res.extents_after);
+  printf("%-10s %10d %10d\n", "fragmented", res.fragmented_before, res.fragmented_after);
+  printf("%d inodes, %d blocks moved\n", res.inodes_moved, res.blocks_moved);
+
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc != 1 && argc != 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "default-disk";
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_StatFS_t st;
+  if(FS_StatFS(&st) < 0) {
+    printf("ERROR: can't stat file system '%s'\n", diskfile);
+    return -2;
+  }
+
+  printf("%-8s %10s %10s %10s\n", "", "TOTAL", "USED", "FREE");
+  printf("%-8s %10d %10d %10d\n", "inodes", st.total_inodes,
+	 st.total_inodes - st.free_inodes, st.free_inodes);
+  printf("%-8s %10d %10d %10d\n", "blocks", st.total_blocks,
+	 st.total_blocks - st.free_blocks, st.free_blocks);
+  printf("%-8s %10d %10d %10d\n", "bytes", st.total_blocks*st.block_size,
+	 (st.total_blocks - st.free_blocks)*st.block_size,
+	 st.free_blocks*st.block_size);
+  if(st.saved_blocks > 0)
+    printf("%-8s %10d blocks saved by sharing\n", "shared", st.saved_blocks);
+  return 0;
+}
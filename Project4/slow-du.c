@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-a] [-j threads] [disk] [path]\n", prog);
+  exit(1);
+}
+
+// totals of the walk; the workers add to them at the same time
+typedef struct {
+  int all;
+  long long files, dirs, bytes;
+} du_t;
+
+int count(FS_WalkEntry_t *entry, void *arg)
+{
+  du_t *du = arg;
+  if(entry->type == 0) {
+    __sync_fetch_and_add(&du->files, 1);
+    __sync_fetch_and_add(&du->bytes, entry->size);
+  } else __sync_fetch_and_add(&du->dirs, 1);
+  if(du->all) printf("%10d %s%s\n", entry->size, entry->path,
+		     entry->type && entry->path[strlen(entry->path)-1] != '/' ? "/" : "");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *path = "/";
+  int nargs = 0, nthreads = 0;
+  du_t du;
+  memset(&du, 0, sizeof(du));
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-a")) du.all = 1;
+    else if(!strcmp(argv[i], "-j") && i+1 < argc) nthreads = atoi(argv[++i]);
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else if(nargs == 0) { diskfile = argv[i]; nargs++; }
+    else if(nargs == 1) { path = argv[i]; nargs++; }
+    else usage(argv[0]);
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  if(FS_Walk(path, count, &du, FS_WALK_WORKERS(nthreads)) < 0) {
+    printf("ERROR: can't walk '%s'\n", path);
+    return -2;
+  }
+  printf("%s: %lld files, %lld directories, %lld bytes\n",
+	 path, du.files, du.dirs, du.bytes);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] [-j threads] [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  int repair = 0, nthreads = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-r")) repair = 1;
+    else if(!strcmp(argv[i], "-j") && i+1 < argc) nthreads = atoi(argv[++i]);
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Check_t res;
+  if(FS_Check(repair, nthreads, &res) < 0) {
+    printf("ERROR: can't check file system '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%s: %d inodes, %d data blocks in use, %d errors\n",
+	 diskfile, res.inodes_used, res.blocks_used, res.errors);
+
+  if(repair) {
+    if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
+      printf("ERROR: can't sync disk '%s'\n", diskfile);
+      return -3;
+    }
+    if(res.inode_bits_fixed > 0 || res.sector_bits_fixed > 0)
+      printf("%s: bitmaps rebuilt (%d inode bits, %d sector bits fixed)\n",
+	     diskfile, res.inode_bits_fixed, res.sector_bits_fixed);
+  }
+  return res.errors > 0 ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "LibFS.h"
+#include "LibFSNet.h"
 
 #define BFSZ 1024
 
@@ -40,6 +41,13 @@ int main(int argc, char *argv[])
     return -3;
   }
 
+  // the final size is known, so have all its sectors allocated in one
+  // go (this is only an optimization; the writes below still fail if
+  // the file doesn't fit)
+  fseek(fptr, 0, SEEK_END);
+  File_Reserve(fd, (int)ftell(fptr));
+  rewind(fptr);
+
   char buf[BFSZ]; 
   while(!feof(fptr)) {
     int rsz = fread(buf, 1, BFSZ, fptr);
@@ -58,7 +66,7 @@ int main(int argc, char *argv[])
   fclose(fptr);
   File_Close(fd);
   
-  if(FS_Sync() < 0) {
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);
     return -3;
   }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "LibFS.h"
+#include "LibFSNet.h"
 
 void usage(char *prog)
 {
@@ -27,7 +28,7 @@ int main(int argc, char *argv[])
   }
   printf("directory '%s' created successfully\n", path);
 
-  if(FS_Sync() < 0) {
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);
     return -3;
   }
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+#define BFSZ 1024
+#define MAX_ARGS 4
+
+// a command of the shell, with the number of arguments it takes
+typedef struct {
+  char *name;
+  int   nargs;
+  char *args;
+  int (*run)(char **argv);
+  int   count;      // number of times it was run
+  double total_ns;  // time spent in it
+} cmd_t;
+
+static char *diskfile = "default-disk";
+static int dirty;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-q] [-f script] [disk]\n", prog);
+  exit(1);
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int do_ls(char **argv)
+{
+  int sz = Dir_Size(argv[1]);
+  if(sz < 0) {
+    printf("ERROR: can't list '%s'\n", argv[1]);
+    return -1;
+  } else if(sz == 0) {
+    printf("directory '%s': empty\n", argv[1]);
+    return 0;
+  }
+  char* buf = malloc(sz);
+  int entries = Dir_Read(argv[1], buf, sz);
+  if(entries < 0) {
+    printf("ERROR: can't list '%s'\n", argv[1]);
+    free(buf);
+    return -1;
+  }
+  printf("directory '%s':\n     %-15s\t%-s\n", argv[1], "NAME", "INODE");
+  for(int i=0, idx=0; i<entries; i++, idx+=20)
+    printf("%-4d %-15s\t%-d\n", i, &buf[idx], *(int*)&buf[idx+16]);
+  free(buf);
+  return 0;
+}
+
+int do_mkdir(char **argv)
+{
+  if(Dir_Create(argv[1]) < 0) {
+    printf("ERROR: can't create directory '%s'\n", argv[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_rmdir(char **argv)
+{
+  if(Dir_Unlink(argv[1]) < 0) {
+    printf("ERROR: can't remove directory '%s'\n", argv[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_touch(char **argv)
+{
+  if(File_Create(argv[1]) < 0) {
+    printf("ERROR: can't create file '%s'\n", argv[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_rm(char **argv)
+{
+  if(File_Unlink(argv[1]) < 0) {
+    printf("ERROR: can't remove file '%s'\n", argv[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_clone(char **argv)
+{
+  if(File_Clone(argv[1], argv[2]) < 0) {
+    printf("ERROR: can't clone file '%s' as '%s'\n", argv[1], argv[2]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_mv(char **argv)
+{
+  if(File_Rename(argv[1], argv[2]) < 0) {
+    printf("ERROR: can't move '%s' to '%s'\n", argv[1], argv[2]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_ln(char **argv)
+{
+  if(File_Link(argv[1], argv[2]) < 0) {
+    printf("ERROR: can't link '%s' as '%s'\n", argv[1], argv[2]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_cat(char **argv)
+{
+  int fd = File_Open(argv[1]);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", argv[1]);
+    return -1;
+  }
+  char buf[BFSZ]; int sz;
+  while((sz = File_Read(fd, buf, BFSZ)) > 0)
+    fwrite(buf, 1, sz, stdout);
+  File_Close(fd);
+  if(sz < 0) {
+    printf("ERROR: can't read file '%s'\n", argv[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_import(char **argv)
+{
+  FILE* fptr = fopen(argv[2], "r");
+  if(!fptr) {
+    printf("ERROR: can't open file '%s' to import\n", argv[2]);
+    return -1;
+  }
+  if(File_Create(argv[1]) < 0) {
+    printf("ERROR: can't create file '%s'\n", argv[1]);
+    fclose(fptr);
+    return -1;
+  }
+  int fd = File_Open(argv[1]);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", argv[1]);
+    fclose(fptr);
+    return -1;
+  }
+  fseek(fptr, 0, SEEK_END);
+  File_Reserve(fd, (int)ftell(fptr));
+  rewind(fptr);
+
+  char buf[BFSZ]; int rsz, ret = 0;
+  while((rsz = fread(buf, 1, BFSZ, fptr)) > 0) {
+    if(File_Write(fd, buf, rsz) != rsz) {
+      printf("ERROR: can't write file '%s'\n", argv[1]);
+      ret = -1;
+      break;
+    }
+  }
+  fclose(fptr);
+  File_Close(fd);
+  return ret;
+}
+
+int do_export(char **argv)
+{
+  int fd = File_Open(argv[1]);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", argv[1]);
+    return -1;
+  }
+  FILE* fptr = fopen(argv[2], "w");
+  if(!fptr) {
+    printf("ERROR: can't open file '%s' to export\n", argv[2]);
+    File_Close(fd);
+    return -1;
+  }
+  char buf[BFSZ]; int sz;
+  while((sz = File_Read(fd, buf, BFSZ)) > 0)
+    fwrite(buf, 1, sz, fptr);
+  fclose(fptr);
+  File_Close(fd);
+  if(sz < 0) {
+    printf("ERROR: can't read file '%s'\n", argv[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int do_df(char **argv)
+{
+  FS_StatFS_t st;
+  if(FS_StatFS(&st) < 0) {
+    printf("ERROR: can't get file system statistics\n");
+    return -1;
+  }
+  printf("%-8s %10s %10s %10s\n", "", "TOTAL", "USED", "FREE");
+  printf("%-8s %10d %10d %10d\n", "inodes", st.total_inodes,
+	 st.total_inodes - st.free_inodes, st.free_inodes);
+  printf("%-8s %10d %10d %10d\n", "blocks", st.total_blocks,
+	 st.total_blocks - st.free_blocks, st.free_blocks);
+  return 0;
+}
+
+int do_fsck(char **argv)
+{
+  FS_Check_t res;
+  if(FS_Check(0, 0, &res) < 0) {
+    printf("ERROR: can't check file system\n");
+    return -1;
+  }
+  printf("%d inodes, %d data blocks in use, %d errors\n",
+	 res.inodes_used, res.blocks_used, res.errors);
+  return res.errors > 0 ? -1 : 0;
+}
+
+int do_sync(char **argv)
+{
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -1;
+  }
+  dirty = 0;
+  return 0;
+}
+
+int do_help(char **argv);
+
+static cmd_t cmds[] = {
+  { "ls",     1, "dir",            do_ls },
+  { "mkdir",  1, "dir",            do_mkdir },
+  { "rmdir",  1, "dir",            do_rmdir },
+  { "touch",  1, "file",           do_touch },
+  { "rm",     1, "file",           do_rm },
+  { "clone",  2, "file new_file",  do_clone },
+  { "mv",     2, "path new_path",  do_mv },
+  { "ln",     2, "file new_file",  do_ln },
+  { "cat",    1, "file",           do_cat },
+  { "import", 2, "file unix_file", do_import },
+  { "export", 2, "file unix_file", do_export },
+  { "df",     0, "",               do_df },
+  { "fsck",   0, "",               do_fsck },
+  { "sync",   0, "",               do_sync },
+  { "help",   0, "",               do_help },
+};
+#define NUM_CMDS (int)(sizeof(cmds) / sizeof(cmds[0]))
+
+int do_help(char **argv)
+{
+  for(int i=0; i<NUM_CMDS; i++)
+    printf("  %-7s %s\n", cmds[i].name, cmds[i].args);
+  printf("  quit\n");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *script = NULL;
+  int quiet = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-q")) quiet = 1;
+    else if(!strcmp(argv[i], "-f") && i+1 < argc) script = argv[++i];
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  FILE* in = stdin;
+  if(script && !(in = fopen(script, "r"))) {
+    printf("ERROR: can't open script '%s'\n", script);
+    return -1;
+  }
+  int prompt = !script && isatty(0);
+
+  // the disk is booted once, however many commands there are
+  double t = now();
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  if(!quiet) fprintf(stderr, "# boot %.1f us\n", (now() - t) / 1e3);
+
+  char line[1024];
+  int lineno = 0, errors = 0;
+  for(;;) {
+    if(prompt) { printf("slow> "); fflush(stdout); }
+    if(!fgets(line, sizeof(line), in)) break;
+    lineno++;
+    char *hash = strchr(line, '#');
+    if(hash) *hash = '\0';
+    char *args[MAX_ARGS+1];
+    int n = 0;
+    for(char *tok = strtok(line, " \t\r\n"); tok && n <= MAX_ARGS; tok = strtok(NULL, " \t\r\n"))
+      args[n++] = tok;
+    if(n == 0) continue;
+    if(!strcmp(args[0], "quit") || !strcmp(args[0], "exit")) break;
+
+    cmd_t* cmd = NULL;
+    for(int i=0; i<NUM_CMDS; i++)
+      if(!strcmp(cmds[i].name, args[0])) cmd = &cmds[i];
+    if(!cmd || n != cmd->nargs + 1) {
+      if(cmd) printf("ERROR: line %d: usage: %s %s\n", lineno, cmd->name, cmd->args);
+      else printf("ERROR: line %d: unknown command '%s'\n", lineno, args[0]);
+      errors++;
+      continue;
+    }
+
+    t = now();
+    int ret = cmd->run(args);
+    t = now() - t;
+    cmd->count++;
+    cmd->total_ns += t;
+    if(ret < 0) errors++;
+    if(cmd->run != do_sync) dirty = 1;
+    if(!quiet) {
+      fflush(stdout);
+      fprintf(stderr, "# %s %.1f us\n", cmd->name, t / 1e3);
+    }
+  }
+  if(script) fclose(in);
+
+  // and synced once, unless the last command was a sync or the disk is
+  // a server's (which writes it back by itself)
+  if(dirty && !FS_NET_PATH(diskfile)) {
+    t = now();
+    if(FS_Sync() < 0) {
+      printf("ERROR: can't sync disk '%s'\n", diskfile);
+      return -3;
+    }
+    if(!quiet) fprintf(stderr, "# sync %.1f us\n", (now() - t) / 1e3);
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "# %-7s %8s %12s %12s\n", "COMMAND", "COUNT", "TOTAL(us)", "MEAN(us)");
+  for(int i=0; i<NUM_CMDS; i++)
+    if(cmds[i].count > 0)
+      fprintf(stderr, "# %-7s %8d %12.1f %12.1f\n", cmds[i].name, cmds[i].count,
+	      cmds[i].total_ns / 1e3, cmds[i].total_ns / 1e3 / cmds[i].count);
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+#include "LibFSNet.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] name\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *name;
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; name = argv[2]; }
+  else { diskfile = "default-disk"; name = argv[1]; }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  
+  if(FS_Snapshot(name) < 0) {
+    printf("ERROR: can't take snapshot '%s'\n", name);
+    return -2;
+  }
+  printf("snapshot '%s' taken successfully\n", name);
+
+  if(!FS_NET_PATH(diskfile) && FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}